@@ -0,0 +1,384 @@
+/*
+ * GPU frame timing shared by shadertoy and es2gears-wayland.
+ * See gputimer.h.
+ */
+
+#include "gputimer.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <GLES2/gl2.h>
+#include <EGL/egl.h>
+
+#define TIME_ELAPSED_EXT            0x88BF
+#define QUERY_RESULT_EXT            0x8866
+#define QUERY_RESULT_AVAILABLE_EXT  0x8867
+#define GPU_DISJOINT_EXT            0x8FBB
+
+typedef void (*gen_queries_proc)(GLsizei n, GLuint *ids);
+typedef void (*delete_queries_proc)(GLsizei n, const GLuint *ids);
+typedef void (*begin_query_proc)(GLenum target, GLuint id);
+typedef void (*end_query_proc)(GLenum target);
+typedef void (*get_query_objectuiv_proc)(GLuint id, GLenum pname, GLuint *params);
+typedef void (*get_query_objectui64v_proc)(GLuint id, GLenum pname, uint64_t *params);
+
+static struct {
+    gen_queries_proc gen_queries;
+    delete_queries_proc delete_queries;
+    begin_query_proc begin_query;
+    end_query_proc end_query;
+    get_query_objectuiv_proc get_query_objectuiv;
+    get_query_objectui64v_proc get_query_objectui64v;
+} ext;
+
+static double
+now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static int
+has_extension(const char *name)
+{
+    const char *extensions = (const char *) glGetString(GL_EXTENSIONS);
+    size_t len = strlen(name);
+    const char *p = extensions;
+
+    while (p && (p = strstr(p, name)) != NULL) {
+        if ((p == extensions || p[-1] == ' ') && (p[len] == ' ' || p[len] == '\0'))
+            return 1;
+        p += len;
+    }
+    return 0;
+}
+
+static int
+resolve_queries(void)
+{
+    if (!has_extension("GL_EXT_disjoint_timer_query"))
+        return 0;
+
+    ext.gen_queries = (gen_queries_proc) eglGetProcAddress("glGenQueriesEXT");
+    ext.delete_queries = (delete_queries_proc) eglGetProcAddress("glDeleteQueriesEXT");
+    ext.begin_query = (begin_query_proc) eglGetProcAddress("glBeginQueryEXT");
+    ext.end_query = (end_query_proc) eglGetProcAddress("glEndQueryEXT");
+    ext.get_query_objectuiv = (get_query_objectuiv_proc) eglGetProcAddress("glGetQueryObjectuivEXT");
+    ext.get_query_objectui64v = (get_query_objectui64v_proc) eglGetProcAddress("glGetQueryObjectui64vEXT");
+
+    return ext.gen_queries && ext.delete_queries && ext.begin_query &&
+           ext.end_query && ext.get_query_objectuiv && ext.get_query_objectui64v;
+}
+
+static void
+series_add(struct gpu_timer_series *series, float ms)
+{
+    series->samples[series->next] = ms;
+    series->next = (series->next + 1) % GPU_TIMER_SAMPLES;
+    if (series->count < GPU_TIMER_SAMPLES)
+        series->count++;
+}
+
+static const struct gpu_timer_series *
+series_get(const struct gpu_timer *timer, int pass)
+{
+    if (pass == GPU_TIMER_FRAME)
+        return &timer->total;
+    if (pass < 0 || pass >= timer->npasses)
+        return NULL;
+    return &timer->passes[pass];
+}
+
+static int
+compare_float(const void *a, const void *b)
+{
+    float x = *(const float *) a, y = *(const float *) b;
+
+    return (x > y) - (x < y);
+}
+
+enum gpu_timer_mode
+gpu_timer_init(struct gpu_timer *timer)
+{
+    const char *env = getenv("GPU_TIMER");
+    int i;
+
+    memset(timer, 0, sizeof *timer);
+    timer->pass = -1;
+
+    if (env && strcmp(env, "off") == 0)
+        timer->mode = GPU_TIMER_OFF;
+    else if (env && strcmp(env, "finish") == 0)
+        timer->mode = GPU_TIMER_FINISH;
+    else if (resolve_queries())
+        timer->mode = GPU_TIMER_QUERY;
+    else
+        /* glFinish() every pass is too costly to pay when nobody asked */
+        timer->mode = GPU_TIMER_OFF;
+
+    if (timer->mode == GPU_TIMER_QUERY)
+        for (i = 0; i < GPU_TIMER_LATENCY; i++)
+            ext.gen_queries(GPU_TIMER_MAX_PASSES, timer->frames[i].queries);
+
+    return timer->mode;
+}
+
+void
+gpu_timer_fini(struct gpu_timer *timer)
+{
+    int i;
+
+    if (timer->mode == GPU_TIMER_QUERY)
+        for (i = 0; i < GPU_TIMER_LATENCY; i++)
+            ext.delete_queries(GPU_TIMER_MAX_PASSES, timer->frames[i].queries);
+
+    timer->mode = GPU_TIMER_OFF;
+}
+
+const char *
+gpu_timer_mode_name(const struct gpu_timer *timer)
+{
+    switch (timer->mode) {
+    case GPU_TIMER_QUERY:
+        return "GL_EXT_disjoint_timer_query";
+    case GPU_TIMER_FINISH:
+        return "glFinish";
+    default:
+        return "off";
+    }
+}
+
+int
+gpu_timer_add_pass(struct gpu_timer *timer, const char *name)
+{
+    if (timer->npasses >= GPU_TIMER_MAX_PASSES)
+        return -1;
+
+    timer->pass_names[timer->npasses] = name;
+    return timer->npasses++;
+}
+
+/*
+ * Reads back every pending frame whose queries have finished, oldest
+ * first (the slot about to be reused), and stops at the first one that
+ * has not.
+ */
+static void
+collect(struct gpu_timer *timer)
+{
+    int i, p, disjoint = 0;
+
+    for (i = 0; i < GPU_TIMER_LATENCY; i++) {
+        int slot = (timer->frame + i) % GPU_TIMER_LATENCY;
+        GLuint available = 0;
+        int last = -1;
+        float total = 0;
+
+        if (!timer->frames[slot].pending)
+            continue;
+
+        /* Queries finish in order, so the last one decides */
+        for (p = 0; p < timer->npasses; p++)
+            if (timer->frames[slot].used[p])
+                last = p;
+
+        if (last >= 0)
+            ext.get_query_objectuiv(timer->frames[slot].queries[last],
+                                    QUERY_RESULT_AVAILABLE_EXT, &available);
+        if (last >= 0 && !available)
+            break;
+
+        timer->frames[slot].pending = 0;
+        if (last < 0)
+            continue;
+
+        /* A disjoint event makes every result since the last check
+         * meaningless (frequency change, GPU reset, ...) */
+        if (!disjoint)
+            glGetIntegerv(GPU_DISJOINT_EXT, &disjoint);
+        if (disjoint) {
+            timer->disjoint++;
+            continue;
+        }
+
+        for (p = 0; p < timer->npasses; p++) {
+            uint64_t ns = 0;
+
+            if (!timer->frames[slot].used[p])
+                continue;
+
+            ext.get_query_objectui64v(timer->frames[slot].queries[p],
+                                      QUERY_RESULT_EXT, &ns);
+            series_add(&timer->passes[p], ns / 1000000.f);
+            total += ns / 1000000.f;
+        }
+        series_add(&timer->total, total);
+    }
+}
+
+void
+gpu_timer_frame_begin(struct gpu_timer *timer)
+{
+    int p;
+
+    timer->frame_ms = 0;
+
+    if (timer->mode != GPU_TIMER_QUERY)
+        return;
+
+    timer->frame = (timer->frame + 1) % GPU_TIMER_LATENCY;
+    collect(timer);
+
+    /* Still busy after GPU_TIMER_LATENCY frames; drop it rather than wait */
+    if (timer->frames[timer->frame].pending) {
+        timer->frames[timer->frame].pending = 0;
+        timer->dropped++;
+    }
+
+    for (p = 0; p < GPU_TIMER_MAX_PASSES; p++)
+        timer->frames[timer->frame].used[p] = 0;
+}
+
+void
+gpu_timer_frame_end(struct gpu_timer *timer)
+{
+    if (timer->pass >= 0)
+        gpu_timer_pass_end(timer);
+
+    if (timer->mode == GPU_TIMER_QUERY)
+        timer->frames[timer->frame].pending = 1;
+    else if (timer->mode == GPU_TIMER_FINISH)
+        series_add(&timer->total, timer->frame_ms);
+}
+
+void
+gpu_timer_pass_begin(struct gpu_timer *timer, int pass)
+{
+    if (timer->mode == GPU_TIMER_OFF || pass < 0 || pass >= timer->npasses)
+        return;
+
+    /* Time elapsed queries can't nest; passes are sequential */
+    if (timer->pass >= 0)
+        gpu_timer_pass_end(timer);
+
+    timer->pass = pass;
+
+    if (timer->mode == GPU_TIMER_QUERY) {
+        timer->frames[timer->frame].used[pass] = 1;
+        ext.begin_query(TIME_ELAPSED_EXT, timer->frames[timer->frame].queries[pass]);
+    } else {
+        glFinish();
+        timer->pass_start = now_ms();
+    }
+}
+
+void
+gpu_timer_pass_end(struct gpu_timer *timer)
+{
+    float ms;
+
+    if (timer->pass < 0)
+        return;
+
+    if (timer->mode == GPU_TIMER_QUERY) {
+        ext.end_query(TIME_ELAPSED_EXT);
+    } else {
+        glFinish();
+        ms = now_ms() - timer->pass_start;
+        series_add(&timer->passes[timer->pass], ms);
+        timer->frame_ms += ms;
+    }
+
+    timer->pass = -1;
+}
+
+int
+gpu_timer_stats(const struct gpu_timer *timer, int pass,
+                struct gpu_timer_stats *stats)
+{
+    const struct gpu_timer_series *series = series_get(timer, pass);
+    float sorted[GPU_TIMER_SAMPLES];
+    float sum = 0;
+    int i, n;
+
+    memset(stats, 0, sizeof *stats);
+    if (!series || series->count == 0)
+        return 0;
+
+    n = series->count;
+    memcpy(sorted, series->samples, n * sizeof sorted[0]);
+    qsort(sorted, n, sizeof sorted[0], compare_float);
+
+    for (i = 0; i < n; i++)
+        sum += sorted[i];
+
+    stats->count = n;
+    stats->min = sorted[0];
+    stats->max = sorted[n - 1];
+    stats->avg = sum / n;
+    stats->p50 = sorted[(n - 1) * 50 / 100];
+    stats->p95 = sorted[(n - 1) * 95 / 100];
+
+    return n;
+}
+
+void
+gpu_timer_histogram(const struct gpu_timer *timer, int pass,
+                    int *buckets, int nbuckets, float bucket_ms)
+{
+    const struct gpu_timer_series *series = series_get(timer, pass);
+    int i;
+
+    memset(buckets, 0, nbuckets * sizeof buckets[0]);
+    if (!series || nbuckets < 1 || bucket_ms <= 0)
+        return;
+
+    for (i = 0; i < series->count; i++) {
+        int b = (int) (series->samples[i] / bucket_ms);
+        buckets[b < nbuckets ? b : nbuckets - 1]++;
+    }
+}
+
+void
+gpu_timer_print(const struct gpu_timer *timer, FILE *file)
+{
+    static const int nbuckets = 16;
+    static const float bucket_ms = 2.0f;
+    struct gpu_timer_stats stats;
+    int buckets[16];
+    int i, j, peak = 0;
+
+    if (timer->mode == GPU_TIMER_OFF)
+        return;
+
+    fprintf(file, "gpu time (%s), last %d frames, %d dropped, %d disjoint:\n",
+            gpu_timer_mode_name(timer), timer->total.count,
+            timer->dropped, timer->disjoint);
+
+    for (i = GPU_TIMER_FRAME; i < timer->npasses; i++) {
+        if (!gpu_timer_stats(timer, i, &stats))
+            continue;
+        fprintf(file, "  %-10s min %6.2f  avg %6.2f  p50 %6.2f  p95 %6.2f  max %6.2f ms\n",
+                i == GPU_TIMER_FRAME ? "frame" : timer->pass_names[i],
+                stats.min, stats.avg, stats.p50, stats.p95, stats.max);
+    }
+
+    gpu_timer_histogram(timer, GPU_TIMER_FRAME, buckets, nbuckets, bucket_ms);
+    for (i = 0; i < nbuckets; i++)
+        if (buckets[i] > peak)
+            peak = buckets[i];
+
+    for (i = 0; i < nbuckets && peak > 0; i++) {
+        if (buckets[i] == 0)
+            continue;
+        fprintf(file, "  %5.1f%s ms |", i * bucket_ms, i == nbuckets - 1 ? "+" : " ");
+        for (j = 0; j < buckets[i] * 40 / peak; j++)
+            fputc('#', file);
+        fprintf(file, " %d\n", buckets[i]);
+    }
+}
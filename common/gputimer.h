@@ -0,0 +1,112 @@
+/*
+ * GPU frame timing shared by shadertoy and es2gears-wayland.
+ *
+ * Each frame is split into up to GPU_TIMER_MAX_PASSES sequential passes.
+ * With GL_EXT_disjoint_timer_query every pass is wrapped in a
+ * GL_TIME_ELAPSED_EXT query, and results are collected a few frames later
+ * once they are available, so the pipeline is never stalled; frames that
+ * are still not ready when their slot comes around again are dropped, as
+ * are frames hit by a disjoint event. Without the extension timing is
+ * off, unless GPU_TIMER=finish asks for the passes to be bracketed with
+ * glFinish() and timed on the CPU instead, which does stall, but still
+ * tells GPU work apart from CPU work.
+ *
+ * The frame time is the sum of its passes. The last GPU_TIMER_SAMPLES
+ * values of each are kept for percentiles and histograms.
+ *
+ * GPU_TIMER=query|finish|off in the environment overrides the automatic
+ * choice.
+ *
+ * All calls need the GL context current.
+ */
+
+#ifndef GPUTIMER_H
+#define GPUTIMER_H
+
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define GPU_TIMER_MAX_PASSES 4
+#define GPU_TIMER_LATENCY 4
+#define GPU_TIMER_SAMPLES 120
+
+/** Pass index of the whole-frame series in the query functions */
+#define GPU_TIMER_FRAME -1
+
+enum gpu_timer_mode {
+    GPU_TIMER_OFF,
+    GPU_TIMER_FINISH,
+    GPU_TIMER_QUERY
+};
+
+struct gpu_timer_series {
+    float samples[GPU_TIMER_SAMPLES];
+    int count;
+    int next;
+};
+
+struct gpu_timer_stats {
+    float min, avg, p50, p95, max;
+    int count;
+};
+
+struct gpu_timer {
+    enum gpu_timer_mode mode;
+
+    const char *pass_names[GPU_TIMER_MAX_PASSES];
+    int npasses;
+
+    /** Queries in flight, one slot per frame */
+    struct {
+        unsigned int queries[GPU_TIMER_MAX_PASSES];
+        int used[GPU_TIMER_MAX_PASSES];
+        int pending;
+    } frames[GPU_TIMER_LATENCY];
+    int frame;
+    int pass;
+
+    /** glFinish fallback */
+    double pass_start;
+    float frame_ms;
+
+    struct gpu_timer_series passes[GPU_TIMER_MAX_PASSES];
+    struct gpu_timer_series total;
+
+    /** Frames whose results were discarded */
+    int dropped;
+    int disjoint;
+};
+
+enum gpu_timer_mode gpu_timer_init(struct gpu_timer *timer);
+void gpu_timer_fini(struct gpu_timer *timer);
+const char *gpu_timer_mode_name(const struct gpu_timer *timer);
+
+/** Registers a pass and returns its index, or -1 when full */
+int gpu_timer_add_pass(struct gpu_timer *timer, const char *name);
+
+void gpu_timer_frame_begin(struct gpu_timer *timer);
+void gpu_timer_frame_end(struct gpu_timer *timer);
+void gpu_timer_pass_begin(struct gpu_timer *timer, int pass);
+void gpu_timer_pass_end(struct gpu_timer *timer);
+
+int gpu_timer_stats(const struct gpu_timer *timer, int pass,
+                    struct gpu_timer_stats *stats);
+
+/**
+ * Fills nbuckets counts of bucket_ms wide bins from the rolling samples;
+ * the last bucket also takes everything above the range.
+ */
+void gpu_timer_histogram(const struct gpu_timer *timer, int pass,
+                         int *buckets, int nbuckets, float bucket_ms);
+
+/** Prints per-pass statistics and a frame time histogram */
+void gpu_timer_print(const struct gpu_timer *timer, FILE *file);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* GPUTIMER_H */
@@ -54,9 +54,19 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 #include <math.h>
 #include <assert.h>
 #include <signal.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
 
 #include <linux/input.h>
 
@@ -69,6 +79,30 @@
 #include <EGL/egl.h>
 #include <EGL/eglext.h>
 
+#include "../common/gputimer.h"
+#include "matrix.h"
+#include "softrender.h"
+#include "presentation-time-client-protocol.h"
+
+#ifndef GL_EXT_instanced_arrays
+#define GL_EXT_instanced_arrays 1
+typedef void (GL_APIENTRYP PFNGLDRAWELEMENTSINSTANCEDEXTPROC) (GLenum mode, GLsizei count, GLenum type, const void *indices, GLsizei primcount);
+typedef void (GL_APIENTRYP PFNGLVERTEXATTRIBDIVISOREXTPROC) (GLuint index, GLuint divisor);
+#endif
+
+#ifndef GL_HALF_FLOAT
+#define GL_HALF_FLOAT                 0x140B
+#endif
+#ifndef GL_HALF_FLOAT_OES
+#define GL_HALF_FLOAT_OES             0x8D61
+#endif
+#ifndef GL_INT_2_10_10_10_REV
+#define GL_INT_2_10_10_10_REV         0x8D9F
+#endif
+#ifndef GL_INT_10_10_10_2_OES
+#define GL_INT_10_10_10_2_OES         0x8DF7
+#endif
+
 #ifndef EGL_EXT_swap_buffers_with_damage
 #define EGL_EXT_swap_buffers_with_damage 1
 typedef EGLBoolean (EGLAPIENTRYP PFNEGLSWAPBUFFERSWITHDAMAGEEXTPROC)(EGLDisplay dpy, EGLSurface surface, EGLint *rects, EGLint n_rects);
@@ -79,13 +113,47 @@ typedef EGLBoolean (EGLAPIENTRYP PFNEGLSWAPBUFFERSWITHDAMAGEEXTPROC)(EGLDisplay
 #define EGL_BUFFER_AGE_EXT			0x313D
 #endif
 
+#ifndef EGL_EXT_platform_base
+#define EGL_EXT_platform_base 1
+typedef EGLDisplay (EGLAPIENTRYP PFNEGLGETPLATFORMDISPLAYEXTPROC) (EGLenum platform, void *native_display, const EGLint *attrib_list);
+#endif
+
+#ifndef EGL_PLATFORM_SURFACELESS_MESA
+#define EGL_PLATFORM_SURFACELESS_MESA 0x31DD
+#endif
+
 struct window;
 struct seat;
 
+/**
+ * What the render thread needs to know about input.
+ */
+struct input_state {
+    /** Surface coordinates of the pointer or the last touch point */
+    double x, y;
+    /** When that position was reported, on the presentation clock */
+    double time_ms;
+    /** Counts position updates, so new input can be told from old */
+    uint32_t serial;
+    /** Counts the F11 presses asking to toggle fullscreen */
+    uint32_t fullscreen_toggles;
+};
+
+/**
+ * The input state, written by whichever thread dispatches input and read
+ * by the render thread without locking: the sequence count is odd while
+ * the writer is busy, and a reader that sees it odd or changed retries.
+ */
+struct input_snapshot {
+    atomic_uint seq;
+    struct input_state state;
+};
+
 struct display {
     struct wl_display *display;
     struct wl_registry *registry;
     struct wl_compositor *compositor;
+    uint32_t compositor_version;
     struct wl_shell *shell;
     struct wl_seat *seat;
     struct wl_pointer *pointer;
@@ -101,6 +169,16 @@ struct display {
         EGLConfig conf;
     } egl;
     struct window *window;
+    struct wp_presentation *presentation;
+    /** The clock presentation timestamps are in */
+    clockid_t presentation_clock;
+
+    /** Input goes to this queue, dispatched by the event thread; NULL without one */
+    struct wl_event_queue *input_queue;
+    pthread_t event_thread;
+    /** Written to wake the event thread up to check running */
+    int wakeup_pipe[2];
+    struct input_snapshot input;
 
     PFNEGLSWAPBUFFERSWITHDAMAGEEXTPROC swap_buffers_with_damage;
 };
@@ -109,6 +187,65 @@ struct geometry {
     int width, height;
 };
 
+#define SHM_BUFFERS 3
+
+/**
+ * A wl_shm buffer drawn into by the software renderer.
+ */
+struct shm_buffer {
+    struct window *window;
+    struct wl_buffer *buffer;
+    uint32_t *pixels;
+    int width, height, size;
+    /** Attached to the surface and not yet released by the compositor */
+    int busy;
+};
+
+#define MAX_DAMAGE_RECTS 8
+#define DAMAGE_HISTORY 4
+
+/**
+ * A set of window rectangles, as x, y, width, height from the bottom left
+ * like eglSwapBuffersWithDamageEXT and glScissor take them. Beyond
+ * MAX_DAMAGE_RECTS they are merged into their bounding box.
+ */
+struct damage {
+    int nrects;
+    EGLint rects[MAX_DAMAGE_RECTS][4];
+};
+
+/**
+ * What wp_presentation feedback said about the frames of one report
+ * interval. Times are in milliseconds on the presentation clock.
+ */
+struct presentation_stats {
+    int presented, discarded, missed;
+    /** Sum and maximum of the time from starting a frame to its presentation */
+    double latency_ms, max_latency_ms;
+    /** The same from the input a frame was the first to show, for those that had some */
+    int input_frames;
+    double input_latency_ms, max_input_latency_ms;
+    /** Sums of the time between presentations, and of its square */
+    double interval_ms, interval_sq_ms;
+    int intervals;
+    double refresh_ms;
+    /** The last presentation, carried over between intervals */
+    double last_present_ms;
+    uint64_t last_seq;
+};
+
+/**
+ * The wl_surface state that only changes with the window's configuration,
+ * as last sent to the compositor.
+ */
+struct surface_state {
+    /** Whether it has been sent at all */
+    int sent;
+    /** The opaque region, from 0, 0; 0 x 0 for none */
+    struct geometry opaque;
+    int32_t buffer_scale;
+};
+
 struct window {
     struct display *display;
     struct geometry geometry, window_size;
@@ -119,19 +256,104 @@ struct window {
     } gl;
 
     uint32_t benchmark_time, frames;
+    double benchmark_cpu_ms, draw_ms;
+    /** Where the gears were drawn in the last frame */
+    struct damage drawn;
+    /** What changed in each of the last frames, newest first */
+    struct damage damage_history[DAMAGE_HISTORY];
+    int damage_history_length;
+    /** The window size the damage history is for */
+    struct geometry damage_size;
+    /** Fractions of the window repainted and reported damaged, summed over frames */
+    double repaint_fraction, damage_fraction;
+    struct presentation_stats present;
+    /** What the software renderer did, summed over frames */
+    struct soft_stats soft_stats;
+    /** Vertices submitted at the levels of detail drawn, summed over frames */
+    long lod_vertices;
+    /** Time spent preparing the frames drawn, summed over frames */
+    double prepare_ms;
+    /**
+     * Wayland requests sent and events handled for the frames, and the
+     * requests of them setting the surface state, summed over frames
+     */
+    long requests, events, state_requests;
+    struct surface_state surface_state;
+    /** Set when a configure or fullscreen toggle may have changed it */
+    int surface_state_dirty;
+    /** Buffer pixels per surface pixel */
+    int32_t buffer_scale;
+    struct shm_buffer shm_buffers[SHM_BUFFERS];
+    /** The input the last frame was drawn with */
+    uint32_t input_serial, fullscreen_toggles;
     struct wl_egl_window *native;
     struct wl_surface *surface;
     struct wl_shell_surface *shell_surface;
     EGLSurface egl_surface;
     struct wl_callback *callback;
     int fullscreen, configured, opaque, buffer_size, frame_sync;
+    /** Draw from wl_surface frame callbacks rather than in a loop */
+    int frame_callbacks;
 };
 
-static int running = 1;
+static atomic_int running = 1;
 
 #define STRIPS_PER_TOOTH 7
 #define VERTICES_PER_TOOTH 34
 #define GEAR_VERTEX_STRIDE 6
+#define SCENE_GEARS 3
+#define GEAR_LODS 4
+
+/** What a frame is drawn from, fixed when it is queued for preparing */
+struct frame_params {
+    /** The view transformation and the projection */
+    GLfloat transform[16], projection[16];
+    /** The gear rotation angle */
+    GLfloat angle;
+    struct geometry size;
+    /** Whether to work out where the gears are drawn, for damage tracking */
+    int damage;
+    /** When the input the frame shows happened, 0 if it shows none new */
+    double input_ms;
+};
+
+enum packet_state {
+    PACKET_FREE,
+    PACKET_QUEUED,
+    PACKET_READY
+};
+
+/**
+ * A frame worked out ahead of drawing it: all its matrices, the levels
+ * of detail and where its gears are, so that drawing it only takes
+ * uploading and drawing.
+ */
+struct frame_packet {
+    struct frame_params params;
+    /** For unbatched drawing, each gear's level and matrices, train by train */
+    unsigned char (*levels)[SCENE_GEARS];
+    GLfloat (*model_view_projection)[16];
+    GLfloat (*normal_matrix)[16];
+    /** For batched drawing, the matrices of one train at the origin */
+    GLfloat train_model_view_projection[SCENE_GEARS][16];
+    GLfloat train_normal_matrix[SCENE_GEARS][16];
+    GLfloat view_projection[16];
+    /** The number of trains at each level, and the first of them in offsets */
+    int lod_count[GEAR_LODS], lod_first[GEAR_LODS];
+    /** The train offsets sorted by level, as of lod_generation offsets_generation */
+    GLfloat (*offsets)[2];
+    unsigned offsets_generation;
+    /** Vertices submitted at the levels of detail picked */
+    long vertices;
+    /** Where the gears are drawn, if params.damage is set */
+    struct damage damage;
+    /** The time preparing it took */
+    double prepare_ms;
+    /** Under pipeline.mutex once the worker thread runs */
+    enum packet_state state;
+};
+#define MAX_TRAINS 10000
+#define TRAIN_SPACING 16.0
 
 /**
  * Struct describing the vertices in triangle strip
@@ -158,25 +380,182 @@ struct gear {
     struct vertex_strip *strips;
     /** The number of triangle strips comprising the gear */
     int nstrips;
+    /** The strips unrolled into an indexed triangle list */
+    GLushort *indices;
+    /** The number of indices in the triangle list */
+    int nindices;
     /** The Vertex Buffer Object holding the vertices in the graphics card */
     GLuint vbo;
+    /** The element buffer holding the triangle list */
+    GLuint ibo;
+    /** The radius at the tip of the teeth, the width and the number of teeth */
+    GLfloat radius, width;
+    GLint teeth;
+    /** The cache file the vertices and indices are mapped from, if they are */
+    void *mapping;
+    size_t mapping_size;
 };
 
 /** The view rotation [x, y, z] */
 static GLfloat view_rot[3] = { 20.0, 30.0, 0.0 };
-/** The gears */
-static struct gear *gear1, *gear2, *gear3;
+/** The gears of a gear train, at each level of detail from the full one down */
+static struct gear *gears[GEAR_LODS][SCENE_GEARS];
 /** The current gear rotation angle */
 static GLfloat angle = 0.0;
+/** How the gears are submitted, see usage() */
+static enum {
+    DRAW_DEFAULT,
+    DRAW_INDEXED,
+    DRAW_STRIPS,
+    DRAW_BATCHED,
+    DRAW_INSTANCED
+} draw_mode = DRAW_DEFAULT;
+/**
+ * Gear trains replicated into one vertex and one element buffer, for
+ * DRAW_BATCHED (ntrains copies) and DRAW_INSTANCED (one copy)
+ */
+static struct {
+    /** The buffers of each level of detail */
+    struct {
+        GLuint vbo;
+        GLuint ibo;
+        /** The number of indices of one train */
+        int nindices;
+    } lods[GEAR_LODS];
+    /** The level whose buffers are bound */
+    int bound_lod;
+    /** Buffer of per train offsets, for DRAW_INSTANCED */
+    GLuint offsets;
+    /** The lod_generation of the offsets in it */
+    unsigned offsets_generation;
+    /** The number of train copies in the buffers */
+    int ntrains;
+    /** The size of the vertex buffers in bytes */
+    long vbo_size;
+} batch;
+/** Vertex formats for positions and normals, see usage() */
+enum position_format {
+    POSITION_FLOAT,
+    POSITION_HALF
+};
+enum normal_format {
+    NORMAL_FLOAT,
+    NORMAL_2_10_10_10,
+    NORMAL_BYTE
+};
+/**
+ * How GearVertex data is stored in the vertex buffers.
+ *
+ * Half float positions take four halves, the fourth holding the gear
+ * index of batched vertices as an unsigned short; with float positions
+ * the index goes after the normal. Compact normals are normalized to
+ * unit length before packing.
+ */
+static struct {
+    enum position_format position_format;
+    enum normal_format normal_format;
+    GLenum position_type;
+    GLenum normal_type;
+    GLint normal_size;
+    GLboolean normal_normalized;
+    int normal_offset;
+    int gear_offset;
+    /** Bytes per vertex of the per gear buffers */
+    int stride;
+    /** Bytes per vertex of the batch buffer, with the gear index */
+    int batch_stride;
+} layout;
+/** Free the vertex, strip and index arrays once they are in buffers */
+static int free_arrays = 0;
+/** Instanced drawing entry points, from ES 3.0 or an extension */
+static PFNGLDRAWELEMENTSINSTANCEDEXTPROC draw_elements_instanced;
+static PFNGLVERTEXATTRIBDIVISOREXTPROC vertex_attrib_divisor;
+/** The number of gear trains and their positions in the grid */
+static int ntrains = 1;
+static GLfloat (*train_offsets)[2];
+/** Vertices and draw calls submitted per frame, with every gear at full detail */
+static long vertices_per_frame, draws_per_frame;
+/** The software renderer and the gears as its meshes, when drawing without EGL */
+static struct soft_renderer *soft_renderer;
+static struct soft_mesh soft_meshes[GEAR_LODS][SCENE_GEARS];
+/**
+ * How each level of detail makes a gear: teeth_per_segment teeth at a
+ * time, every segment with as many vertices and strips, and the fewest
+ * pixels per tooth on screen the level is drawn at.
+ */
+static const struct {
+    int teeth_per_segment, vertices, strips;
+    GLfloat min_pixels;
+} lod_layout[GEAR_LODS] = {
+    /* The teeth as designed */
+    { 1, VERTICES_PER_TOOTH, STRIPS_PER_TOOTH, 10.0 },
+    /* Pointed teeth, without the flat at the tip */
+    { 1, 28, 6, 3.0 },
+    /* No teeth, a ring with a segment per tooth */
+    { 1, 16, 4, 1.5 },
+    /* A ring with a segment per two teeth */
+    { 2, 16, 4, 0.0 },
+};
+/** How far past a level's limit a gear has to get to change level, against popping */
+#define LOD_HYSTERESIS 1.2
+/** The level to draw every gear at, -1 to pick by size */
+static int forced_lod = -1;
+/** The level each gear of each train is at, as of the last frame prepared */
+static unsigned char (*lod_levels)[SCENE_GEARS];
+/**
+ * Counts the frames prepared with gears changing level. It starts at 1 so
+ * that offsets of generation 0 are never taken for sorted or uploaded.
+ */
+static unsigned lod_generation = 1;
+/** Vertices submitted in the last frame, at the levels it was drawn at */
+static long lod_vertices;
+/**
+ * Frames are prepared a frame ahead of drawing, on a worker thread when
+ * threaded is set: while the render thread draws one packet the worker
+ * fills the other.
+ */
+static struct {
+    int threaded;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int quit;
+    struct frame_packet packets[2];
+    /** The packet to queue the next frame in, and to take the next one from */
+    int tail, head;
+} pipeline;
+/** Where the gears sit in a train and how they turn with angle */
+static const struct {
+    GLfloat x, y;
+    GLfloat speed, phase;
+} gear_layout[SCENE_GEARS] = {
+    { -3.0, -2.0,  1.0,   0.0 },
+    {  3.1, -2.0, -2.0,  -9.0 },
+    { -3.1,  4.2, -2.0, -25.0 },
+};
+/** The gear colors */
+static const GLfloat gear_colors[SCENE_GEARS][4] = {
+    { 0.8, 0.1, 0.0, 1.0 },
+    { 0.0, 0.8, 0.2, 1.0 },
+    { 0.2, 0.2, 1.0, 1.0 },
+};
 /** The location of the shader uniforms */
 static GLuint ModelViewProjectionMatrix_location,
 NormalMatrix_location,
 LightSourcePosition_location,
 MaterialColor_location;
+/** The location of the uniforms used by the batched and instanced shader */
+static GLuint ModelViewProjectionMatrices_location,
+NormalMatrices_location,
+ViewProjectionMatrix_location,
+TrainOffsets_location;
 /** The projection matrix */
 static GLfloat ProjectionMatrix[16];
 /** The direction of the directional light for the scene */
 static const GLfloat LightSourcePosition[4] = { 5.0, 5.0, 10.0, 1.0};
+/** GPU time per frame, split into the clear and the gears */
+static struct gpu_timer gpu_timer;
+static int clear_pass, gears_pass;
 
 /**
  * Fills a gear vertex.
@@ -203,56 +582,305 @@ vert(GearVertex *v, GLfloat x, GLfloat y, GLfloat z, GLfloat n[3])
 }
 
 /**
- *  Create a gear wheel.
+ * Unrolls the triangle strips of a gear into a triangle list.
  *
- *  @param inner_radius radius of hole at center
- *  @param outer_radius radius at center of teeth
- *  @param width width of gear
- *  @param teeth number of teeth
- *  @param tooth_depth depth of tooth
+ * Every other triangle of a strip has its first two vertices swapped so
+ * that all triangles keep the winding order of the strip.
  *
- *  @return pointer to the constructed struct gear
+ * @param gear the gear whose strips to convert
  */
-static struct gear *
-        create_gear(GLfloat inner_radius, GLfloat outer_radius, GLfloat width,
-                    GLint teeth, GLfloat tooth_depth)
+static void
+build_triangle_list(struct gear *gear)
 {
-    GLfloat r0, r1, r2;
-    GLfloat da;
-    GearVertex *v;
-    struct gear *gear;
-    double s[5], c[5];
-    GLfloat normal[3];
-    int cur_strip = 0;
+    GLushort *idx;
+    int n, i;
+
+    gear->nindices = 0;
+    for (n = 0; n < gear->nstrips; n++)
+        gear->nindices += 3 * (gear->strips[n].count - 2);
+
+    gear->indices = calloc(gear->nindices, sizeof(*gear->indices));
+    idx = gear->indices;
+
+    for (n = 0; n < gear->nstrips; n++) {
+        GLint first = gear->strips[n].first;
+
+        for (i = 0; i < gear->strips[n].count - 2; i++) {
+            *idx++ = first + i + (i & 1);
+            *idx++ = first + i + 1 - (i & 1);
+            *idx++ = first + i + 2;
+        }
+    }
+}
+
+/**
+ * Converts a float to an IEEE half float, rounding to nearest.
+ *
+ * Gear coordinates are small and never denormal, infinite or NaN, so
+ * those cases only get the minimum of care.
+ */
+static uint16_t
+float_to_half(float f)
+{
+    union { float f; uint32_t u; } bits = { f };
+    uint32_t sign = (bits.u >> 16) & 0x8000;
+    int32_t exponent = ((bits.u >> 23) & 0xff) - 127 + 15;
+    uint32_t mantissa = bits.u & 0x7fffff;
+
+    if (exponent <= 0)
+        return sign;
+    if (exponent >= 31)
+        return sign | 0x7c00;
+
+    /* Round to nearest; a carry into the exponent is still correct */
+    return (sign | (exponent << 10) | (mantissa >> 13)) + ((mantissa >> 12) & 1);
+}
+
+/**
+ * Packs a unit vector into 10 bit signed normalized components.
+ *
+ * @param n the vector
+ * @param rev GL_INT_2_10_10_10_REV order (x in the low bits) rather
+ *            than GL_INT_10_10_10_2_OES order (x in the high bits)
+ */
+static uint32_t
+pack_2_10_10_10(const GLfloat n[3], int rev)
+{
+    uint32_t x = (uint32_t) lrintf(n[0] * 511.0) & 0x3ff;
+    uint32_t y = (uint32_t) lrintf(n[1] * 511.0) & 0x3ff;
+    uint32_t z = (uint32_t) lrintf(n[2] * 511.0) & 0x3ff;
+
+    if (rev)
+        return x | (y << 10) | (z << 20);
+    return (x << 22) | (y << 12) | (z << 2);
+}
+
+/**
+ * Writes a gear vertex in the current layout.
+ *
+ * @param dst where to write layout.stride or layout.batch_stride bytes
+ * @param v the vertex
+ * @param gear the gear index for batched vertices, -1 for others
+ */
+static void
+encode_vertex(uint8_t *dst, const GLfloat *v, int gear)
+{
+    GLfloat n[3];
+    uint16_t index = gear;
+    float length;
     int i;
 
-    /* Allocate memory for the gear */
-    gear = malloc(sizeof *gear);
-    if (gear == NULL)
-        return NULL;
+    if (layout.position_format == POSITION_HALF) {
+        uint16_t h[3] = { float_to_half(v[0]), float_to_half(v[1]), float_to_half(v[2]) };
+        memcpy(dst, h, sizeof h);
+    } else {
+        memcpy(dst, v, 3 * sizeof(GLfloat));
+    }
 
-    /* Calculate the radii used in the gear */
-    r0 = inner_radius;
-    r1 = outer_radius - tooth_depth / 2.0;
-    r2 = outer_radius + tooth_depth / 2.0;
+    length = sqrt(v[3] * v[3] + v[4] * v[4] + v[5] * v[5]);
+    for (i = 0; i < 3; i++)
+        n[i] = v[3 + i] / length;
+
+    switch (layout.normal_format) {
+    case NORMAL_FLOAT:
+        memcpy(dst + layout.normal_offset, v + 3, 3 * sizeof(GLfloat));
+        break;
+    case NORMAL_2_10_10_10: {
+        uint32_t packed = pack_2_10_10_10(n, layout.normal_type == GL_INT_2_10_10_10_REV);
+        memcpy(dst + layout.normal_offset, &packed, sizeof packed);
+        break;
+    }
+    case NORMAL_BYTE:
+        for (i = 0; i < 3; i++)
+            ((int8_t *) dst)[layout.normal_offset + i] = lrintf(n[i] * 127.0);
+        break;
+    }
 
-    da = 2.0 * M_PI / teeth / 4.0;
+    /* With float positions the index is past the end of unbatched vertices */
+    if (gear >= 0)
+        memcpy(dst + layout.gear_offset, &index, sizeof index);
+}
 
-    /* Allocate memory for the triangle strip information */
-    gear->nstrips = STRIPS_PER_TOOTH * teeth;
-    gear->strips = calloc(gear->nstrips, sizeof (*gear->strips));
+/**
+ * Encodes and uploads the vertices of one or more gears.
+ *
+ * @param target the buffer to fill
+ * @param gears the gears
+ * @param ngears the number of gears
+ * @param copies how many times to repeat them, with increasing gear indices
+ * @param batched whether to use layout.batch_stride and set the gear index
+ *
+ * @return the number of bytes uploaded
+ */
+static long
+upload_vertices(GLuint target, struct gear **gears, int ngears, int copies, int batched)
+{
+    int stride = batched ? layout.batch_stride : layout.stride;
+    long nvertices = 0, size;
+    uint8_t *data, *dst;
+    int c, g, i;
+
+    for (g = 0; g < ngears; g++)
+        nvertices += gears[g]->nvertices;
+    size = nvertices * copies * stride;
+
+    data = calloc(size, 1);
+    dst = data;
+    for (c = 0; c < copies; c++) {
+        for (g = 0; g < ngears; g++) {
+            for (i = 0; i < gears[g]->nvertices; i++) {
+                encode_vertex(dst, gears[g]->vertices[i], batched ? c * ngears + g : -1);
+                dst += stride;
+            }
+        }
+    }
 
-    /* Allocate memory for the vertices */
-    gear->vertices = calloc(VERTICES_PER_TOOTH * teeth, sizeof(*gear->vertices));
-    v = gear->vertices;
+    glBindBuffer(GL_ARRAY_BUFFER, target);
+    glBufferData(GL_ARRAY_BUFFER, size, data, GL_STATIC_DRAW);
+    free(data);
 
-    for (i = 0; i < teeth; i++) {
-        /* Calculate needed sin/cos for varius angles */
-        sincos(i * 2.0 * M_PI / teeth, &s[0], &c[0]);
-        sincos(i * 2.0 * M_PI / teeth + da, &s[1], &c[1]);
-        sincos(i * 2.0 * M_PI / teeth + da * 2, &s[2], &c[2]);
-        sincos(i * 2.0 * M_PI / teeth + da * 3, &s[3], &c[3]);
-        sincos(i * 2.0 * M_PI / teeth + da * 4, &s[4], &c[4]);
+    return size;
+}
+
+/**
+ * Points the position and normal attributes, and for batched buffers the
+ * gear index, at the bound vertex buffer.
+ *
+ * @param batched whether the buffer was uploaded with the gear index
+ */
+static void
+set_vertex_attribs(int batched)
+{
+    int stride = batched ? layout.batch_stride : layout.stride;
+
+    glVertexAttribPointer(0, 3, layout.position_type, GL_FALSE, stride, NULL);
+    glVertexAttribPointer(1, layout.normal_size, layout.normal_type,
+                          layout.normal_normalized, stride,
+                          (uint8_t *) 0 + layout.normal_offset);
+    if (batched)
+        glVertexAttribPointer(2, 1, GL_UNSIGNED_SHORT, GL_FALSE, stride,
+                              (uint8_t *) 0 + layout.gear_offset);
+}
+
+/**
+ * Frees the client side copies of a gear's geometry.
+ *
+ * The strips are kept when they are still needed for drawing.
+ *
+ * @param gear the gear
+ *
+ * @return the number of bytes freed
+ */
+static long
+free_gear_arrays(struct gear *gear)
+{
+    long size = gear->nvertices * sizeof(*gear->vertices)
+            + gear->nindices * sizeof(*gear->indices);
+
+    if (gear->mapping) {
+        munmap(gear->mapping, gear->mapping_size);
+        gear->mapping = NULL;
+    } else {
+        free(gear->vertices);
+        free(gear->indices);
+    }
+    gear->vertices = NULL;
+    gear->indices = NULL;
+
+    if (draw_mode != DRAW_STRIPS) {
+        size += gear->nstrips * sizeof(*gear->strips);
+        free(gear->strips);
+        gear->strips = NULL;
+    }
+
+    return size;
+}
+
+/**
+ * Returns the milliseconds from start to end.
+ */
+static double
+elapsed_ms(const struct timespec *start, const struct timespec *end)
+{
+    return (end->tv_sec - start->tv_sec) * 1e3 + (end->tv_nsec - start->tv_nsec) / 1e6;
+}
+
+/**
+ * The sines and cosines of the five angles each tooth is made of, for
+ * gears with a number of teeth; computed once and shared by all gears
+ * with as many.
+ */
+struct tooth_angles {
+    int teeth;
+    /** For each tooth, s[0..4] then c[0..4] */
+    double (*sincos)[2][5];
+    struct tooth_angles *next;
+};
+
+static struct tooth_angles *tooth_angles;
+
+static const struct tooth_angles *
+get_tooth_angles(int teeth)
+{
+    struct tooth_angles *angles;
+    GLfloat da = 2.0 * M_PI / teeth / 4.0;
+    int i, k;
+
+    for (angles = tooth_angles; angles; angles = angles->next)
+        if (angles->teeth == teeth)
+            return angles;
+
+    angles = malloc(sizeof(*angles));
+    assert(angles);
+    angles->teeth = teeth;
+    angles->sincos = calloc(teeth, sizeof(*angles->sincos));
+    assert(angles->sincos);
+
+    for (i = 0; i < teeth; i++)
+        for (k = 0; k < 5; k++)
+            sincos(i * 2.0 * M_PI / teeth + da * k,
+                   &angles->sincos[i][0][k], &angles->sincos[i][1][k]);
+
+    angles->next = tooth_angles;
+    tooth_angles = angles;
+    return angles;
+}
+
+/** The teeth of a gear to make */
+struct tessellation {
+    struct gear *gear;
+    const struct tooth_angles *angles;
+    GLfloat r0, r1, r2, width;
+    /** The level of detail, and the segments of lod_layout[lod] to make */
+    int lod;
+    int first, last;
+};
+
+/**
+ * Makes the vertices and strips of segments first to last - 1, a tooth
+ * each but at the coarsest level. Every segment has as many vertices
+ * and strips, so each goes to a place of its own.
+ *
+ * @param t the teeth to make
+ */
+static void
+tessellate_teeth(const struct tessellation *t)
+{
+    struct gear *gear = t->gear;
+    const GLfloat r0 = t->r0, r1 = t->r1, r2 = t->r2, width = t->width;
+    const int teeth_per_segment = lod_layout[t->lod].teeth_per_segment;
+    GLfloat normal[3];
+    GearVertex *v;
+    int cur_strip;
+    int i;
+
+    for (i = t->first; i < t->last; i++) {
+        const int tooth = i * teeth_per_segment;
+        const double *s = t->angles->sincos[tooth][0];
+        const double *c = t->angles->sincos[tooth][1];
+
+        v = gear->vertices + i * lod_layout[t->lod].vertices;
+        cur_strip = i * lod_layout[t->lod].strips;
 
         /* A set of macros for making the creation of the gears easier */
 #define  GEAR_POINT(r, da) { (r) * c[(da)], (r) * s[(da)] }
@@ -296,6 +924,94 @@ static struct gear *
                     GEAR_POINT(r0, 4), // 6
         };
 
+        if (t->lod == 1) {
+            /* Pointed teeth: the tip's two points merge into one */
+            p[0].x = (p[0].x + p[1].x) / 2;
+            p[0].y = (p[0].y + p[1].y) / 2;
+
+            START_STRIP;
+            SET_NORMAL(0, 0, 1.0);
+            v = GEAR_VERT(v, 0, +1);
+            v = GEAR_VERT(v, 3, +1);
+            v = GEAR_VERT(v, 2, +1);
+            v = GEAR_VERT(v, 5, +1);
+            v = GEAR_VERT(v, 4, +1);
+            v = GEAR_VERT(v, 6, +1);
+            END_STRIP;
+
+            START_STRIP;
+            QUAD_WITH_NORMAL(4, 6);
+            END_STRIP;
+
+            START_STRIP;
+            SET_NORMAL(0, 0, -1.0);
+            v = GEAR_VERT(v, 6, -1);
+            v = GEAR_VERT(v, 5, -1);
+            v = GEAR_VERT(v, 4, -1);
+            v = GEAR_VERT(v, 3, -1);
+            v = GEAR_VERT(v, 2, -1);
+            v = GEAR_VERT(v, 0, -1);
+            END_STRIP;
+
+            START_STRIP;
+            QUAD_WITH_NORMAL(0, 2);
+            END_STRIP;
+
+            START_STRIP;
+            QUAD_WITH_NORMAL(3, 0);
+            END_STRIP;
+
+            START_STRIP;
+            QUAD_WITH_NORMAL(5, 3);
+            END_STRIP;
+            continue;
+        }
+
+        if (t->lod > 1) {
+            /*
+             * No teeth: a ring segment out to halfway up them, from this
+             * segment's first tooth to the next one's, with points 2 and
+             * 5 on the outside and 4 and 6 on the inside.
+             */
+            int next = tooth + teeth_per_segment < t->angles->teeth ?
+                    tooth + teeth_per_segment : 0;
+            const double *s1 = t->angles->sincos[next][0];
+            const double *c1 = t->angles->sincos[next][1];
+            const GLfloat rm = (r1 + r2) / 2;
+
+            p[2].x = rm * c[0];
+            p[2].y = rm * s[0];
+            p[5].x = rm * c1[0];
+            p[5].y = rm * s1[0];
+            p[6].x = r0 * c1[0];
+            p[6].y = r0 * s1[0];
+
+            START_STRIP;
+            SET_NORMAL(0, 0, 1.0);
+            v = GEAR_VERT(v, 2, +1);
+            v = GEAR_VERT(v, 5, +1);
+            v = GEAR_VERT(v, 4, +1);
+            v = GEAR_VERT(v, 6, +1);
+            END_STRIP;
+
+            START_STRIP;
+            QUAD_WITH_NORMAL(4, 6);
+            END_STRIP;
+
+            START_STRIP;
+            SET_NORMAL(0, 0, -1.0);
+            v = GEAR_VERT(v, 5, -1);
+            v = GEAR_VERT(v, 2, -1);
+            v = GEAR_VERT(v, 6, -1);
+            v = GEAR_VERT(v, 4, -1);
+            END_STRIP;
+
+            START_STRIP;
+            QUAD_WITH_NORMAL(5, 2);
+            END_STRIP;
+            continue;
+        }
+
         /* Front face */
         START_STRIP;
         SET_NORMAL(0, 0, 1.0);
@@ -342,147 +1058,545 @@ static struct gear *
         QUAD_WITH_NORMAL(5, 3);
         END_STRIP;
     }
+}
 
-    gear->nvertices = (v - gear->vertices);
+/** What identifies a gear's mesh in the cache */
+struct gear_key {
+    GLfloat inner_radius, outer_radius, width;
+    GLint teeth;
+    GLfloat tooth_depth;
+};
 
-    /* Store the vertices in a vertex buffer object (VBO) */
-    glGenBuffers(1, &gear->vbo);
-    glBindBuffer(GL_ARRAY_BUFFER, gear->vbo);
-    glBufferData(GL_ARRAY_BUFFER, gear->nvertices * sizeof(GearVertex),
-                 gear->vertices, GL_STATIC_DRAW);
+#define GEAR_CACHE_MAGIC "es2gear"
+#define GEAR_CACHE_VERSION 1
 
-    return gear;
+/**
+ * A cached gear mesh file: this header, then the vertices, strips and
+ * indices, in the host's byte order.
+ */
+struct gear_cache_header {
+    char magic[8];
+    uint32_t version;
+    /** sizeof(GearVertex), so a build with other vertices does not use it */
+    uint32_t vertex_size;
+    struct gear_key key;
+    int32_t nvertices, nstrips, nindices;
+};
+
+/** The directory gear meshes are cached in, NULL not to cache them */
+static char *mesh_cache_dir;
+/** Gears found in the cache, and the time spent making them all */
+static int gears_cached;
+static double gears_ms;
+
+/**
+ * Returns the cache file of a gear mesh, to be freed, or NULL without a
+ * cache. Keys that hash the same share a file; the key in the header
+ * tells them apart.
+ */
+static char *
+gear_cache_path(const struct gear_key *key)
+{
+    const unsigned char *bytes = (const unsigned char *) key;
+    uint32_t hash = 2166136261u;
+    size_t i, size;
+    char *path;
+
+    if (!mesh_cache_dir)
+        return NULL;
+
+    for (i = 0; i < sizeof(*key); i++)
+        hash = (hash ^ bytes[i]) * 16777619u;
+
+    size = strlen(mesh_cache_dir) + sizeof("/gear-01234567.bin");
+    path = malloc(size);
+    if (path)
+        snprintf(path, size, "%s/gear-%08x.bin", mesh_cache_dir, hash);
+    return path;
 }
 
 /**
- * Multiplies two 4x4 matrices.
+ * Maps a gear's mesh from the cache. The vertices and indices are used
+ * in place; the strips are copied, so free_gear_arrays() can keep them
+ * alone.
  *
- * The result is stored in matrix m.
+ * @param gear the gear to fill in
+ * @param key the gear's parameters
  *
- * @param m the first matrix to multiply
- * @param n the second matrix to multiply
+ * @return whether the gear was in the cache
  */
-static void
-multiply(GLfloat *m, const GLfloat *n)
+static int
+load_cached_gear(struct gear *gear, const struct gear_key *key)
 {
-    GLfloat tmp[16];
-    const GLfloat *row, *column;
-    div_t d;
-    int i, j;
-
-    for (i = 0; i < 16; i++) {
-        tmp[i] = 0;
-        d = div(i, 4);
-        row = n + d.quot * 4;
-        column = m + d.rem;
-        for (j = 0; j < 4; j++)
-            tmp[i] += row[j] * column[j * 4];
+    const struct gear_cache_header *header;
+    char *path = gear_cache_path(key);
+    struct stat st;
+    size_t vertices_size, strips_size, indices_size;
+    char *data;
+    int fd;
+
+    if (!path)
+        return 0;
+    fd = open(path, O_RDONLY);
+    free(path);
+    if (fd < 0)
+        return 0;
+
+    if (fstat(fd, &st) < 0 || st.st_size < (off_t) sizeof(*header)) {
+        close(fd);
+        return 0;
     }
-    memcpy(m, &tmp, sizeof tmp);
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return 0;
+
+    header = (const struct gear_cache_header *) data;
+    vertices_size = (size_t) header->nvertices * sizeof(*gear->vertices);
+    strips_size = (size_t) header->nstrips * sizeof(*gear->strips);
+    indices_size = (size_t) header->nindices * sizeof(*gear->indices);
+    if (memcmp(header->magic, GEAR_CACHE_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != GEAR_CACHE_VERSION ||
+        header->vertex_size != sizeof(GearVertex) ||
+        memcmp(&header->key, key, sizeof(*key)) != 0 ||
+        header->nvertices < 0 || header->nstrips < 0 || header->nindices < 0 ||
+        (size_t) st.st_size != sizeof(*header) + vertices_size + strips_size + indices_size) {
+        munmap(data, st.st_size);
+        return 0;
+    }
+
+    gear->mapping = data;
+    gear->mapping_size = st.st_size;
+    gear->nvertices = header->nvertices;
+    gear->vertices = (GearVertex *) (data + sizeof(*header));
+    gear->nstrips = header->nstrips;
+    gear->strips = malloc(strips_size);
+    assert(gear->strips);
+    memcpy(gear->strips, data + sizeof(*header) + vertices_size, strips_size);
+    gear->nindices = header->nindices;
+    gear->indices = (GLushort *) (data + sizeof(*header) + vertices_size + strips_size);
+
+    return 1;
 }
 
 /**
- * Rotates a 4x4 matrix.
+ * Writes a gear's mesh to the cache, through a temporary file so that
+ * readers never see half of one.
  *
- * @param[in,out] m the matrix to rotate
- * @param angle the angle to rotate
- * @param x the x component of the direction to rotate to
- * @param y the y component of the direction to rotate to
- * @param z the z component of the direction to rotate to
+ * @param gear the gear
+ * @param key the gear's parameters
  */
 static void
-rotate(GLfloat *m, GLfloat angle, GLfloat x, GLfloat y, GLfloat z)
+save_cached_gear(const struct gear *gear, const struct gear_key *key)
 {
-    double s, c;
-
-    sincos(angle, &s, &c);
-    GLfloat r[16] = {
-        x * x * (1 - c) + c,     y * x * (1 - c) + z * s, x * z * (1 - c) - y * s, 0,
-        x * y * (1 - c) - z * s, y * y * (1 - c) + c,     y * z * (1 - c) + x * s, 0,
-        x * z * (1 - c) + y * s, y * z * (1 - c) - x * s, z * z * (1 - c) + c,     0,
-        0, 0, 0, 1
-    };
+    struct gear_cache_header header;
+    char *path = gear_cache_path(key);
+    size_t size;
+    char *tmp;
+    FILE *file;
+    int ok;
+
+    if (!path)
+        return;
+    size = strlen(path) + 16;
+    tmp = malloc(size);
+    if (!tmp) {
+        free(path);
+        return;
+    }
+    snprintf(tmp, size, "%s.%d", path, (int) getpid());
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, GEAR_CACHE_MAGIC, sizeof(header.magic));
+    header.version = GEAR_CACHE_VERSION;
+    header.vertex_size = sizeof(GearVertex);
+    header.key = *key;
+    header.nvertices = gear->nvertices;
+    header.nstrips = gear->nstrips;
+    header.nindices = gear->nindices;
+
+    file = fopen(tmp, "wb");
+    if (file) {
+        ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+                fwrite(gear->vertices, sizeof(*gear->vertices), gear->nvertices, file) ==
+                        (size_t) gear->nvertices &&
+                fwrite(gear->strips, sizeof(*gear->strips), gear->nstrips, file) ==
+                        (size_t) gear->nstrips &&
+                fwrite(gear->indices, sizeof(*gear->indices), gear->nindices, file) ==
+                        (size_t) gear->nindices;
+        if (fclose(file) != 0)
+            ok = 0;
+        if (!ok || rename(tmp, path) < 0) {
+            fprintf(stderr, "failed to cache a gear mesh in %s\n", path);
+            unlink(tmp);
+        }
+    }
 
-    multiply(m, r);
+    free(tmp);
+    free(path);
 }
 
-
 /**
- * Translates a 4x4 matrix.
+ * Creates the mesh cache directory, and its parent, if need be.
  *
- * @param[in,out] m the matrix to translate
- * @param x the x component of the direction to translate to
- * @param y the y component of the direction to translate to
- * @param z the z component of the direction to translate to
+ * @return whether the directory is there
  */
-static void
-translate(GLfloat *m, GLfloat x, GLfloat y, GLfloat z)
+static int
+create_mesh_cache_dir(const char *dir)
 {
-    GLfloat t[16] = { 1, 0, 0, 0,  0, 1, 0, 0,  0, 0, 1, 0,  x, y, z, 1 };
+    char *parent = strdup(dir), *slash;
+
+    if (parent && (slash = strrchr(parent, '/')) && slash != parent) {
+        *slash = '\0';
+        mkdir(parent, 0755);
+    }
+    free(parent);
 
-    multiply(m, t);
+    return mkdir(dir, 0755) == 0 || errno == EEXIST;
 }
 
 /**
- * Creates an identity 4x4 matrix.
+ *  Create a gear wheel.
  *
- * @param m the matrix make an identity matrix
+ *  The mesh is mapped from the cache if it is there. Otherwise the teeth
+ *  are made from sines and cosines shared by all gears with as many
+ *  teeth, and the mesh is cached. Only full detail meshes are cached;
+ *  the others take next to no time to make.
+ *
+ *  @param inner_radius radius of hole at center
+ *  @param outer_radius radius at center of teeth
+ *  @param width width of gear
+ *  @param teeth number of teeth
+ *  @param tooth_depth depth of tooth
+ *  @param lod level of detail, see lod_layout
+ *
+ *  @return pointer to the constructed struct gear
  */
-static void
-identity(GLfloat *m)
+static struct gear *
+        create_gear(GLfloat inner_radius, GLfloat outer_radius, GLfloat width,
+                    GLint teeth, GLfloat tooth_depth, int lod)
 {
-    GLfloat t[16] = {
-        1.0, 0.0, 0.0, 0.0,
-        0.0, 1.0, 0.0, 0.0,
-        0.0, 0.0, 1.0, 0.0,
-        0.0, 0.0, 0.0, 1.0,
-    };
+    const struct gear_key key = { inner_radius, outer_radius, width, teeth, tooth_depth };
+    const int segments = (teeth + lod_layout[lod].teeth_per_segment - 1) /
+            lod_layout[lod].teeth_per_segment;
+    struct tessellation all_teeth;
+    struct gear *gear;
+    GLfloat r0, r1, r2;
+
+    /* Allocate memory for the gear */
+    gear = calloc(1, sizeof *gear);
+    if (gear == NULL)
+        return NULL;
+
+    /* Calculate the radii used in the gear */
+    r0 = inner_radius;
+    r1 = outer_radius - tooth_depth / 2.0;
+    r2 = outer_radius + tooth_depth / 2.0;
+
+    gear->radius = r2;
+    gear->width = width;
+    gear->teeth = teeth;
 
-    memcpy(m, t, sizeof(t));
+    if (lod == 0 && load_cached_gear(gear, &key)) {
+        gears_cached++;
+        return gear;
+    }
+
+    /* Allocate memory for the triangle strip information */
+    gear->nstrips = lod_layout[lod].strips * segments;
+    gear->strips = calloc(gear->nstrips, sizeof (*gear->strips));
+
+    /* Allocate memory for the vertices */
+    gear->nvertices = lod_layout[lod].vertices * segments;
+    gear->vertices = calloc(gear->nvertices, sizeof(*gear->vertices));
+
+    all_teeth.gear = gear;
+    all_teeth.angles = get_tooth_angles(teeth);
+    all_teeth.r0 = r0;
+    all_teeth.r1 = r1;
+    all_teeth.r2 = r2;
+    all_teeth.width = width;
+    all_teeth.lod = lod;
+    all_teeth.first = 0;
+    all_teeth.last = segments;
+    tessellate_teeth(&all_teeth);
+
+    /* And the same geometry as one triangle list */
+    build_triangle_list(gear);
+
+    if (lod == 0)
+        save_cached_gear(gear, &key);
+
+    return gear;
 }
 
 /**
- * Transposes a 4x4 matrix.
+ * Stores a gear's vertices and triangle list in buffer objects.
  *
- * @param m the matrix to transpose
+ * @param gear the gear
  */
 static void
-transpose(GLfloat *m)
+upload_gear(struct gear *gear)
 {
-    GLfloat t[16] = {
-        m[0], m[4], m[8],  m[12],
-        m[1], m[5], m[9],  m[13],
-        m[2], m[6], m[10], m[14],
-        m[3], m[7], m[11], m[15]};
+    /* Store the vertices in a vertex buffer object (VBO) */
+    glGenBuffers(1, &gear->vbo);
+    upload_vertices(gear->vbo, &gear, 1, 1, 0);
 
-    memcpy(m, t, sizeof(t));
+    /* And the triangle list in an element buffer */
+    glGenBuffers(1, &gear->ibo);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, gear->ibo);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, gear->nindices * sizeof(*gear->indices),
+                 gear->indices, GL_STATIC_DRAW);
 }
 
 /**
- * Inverts a 4x4 matrix.
- *
- * This function can currently handle only pure translation-rotation matrices.
- * Read http://www.gamedev.net/community/forums/topic.asp?topic_id=425118
- * for an explanation.
+ * Creates the gears of a gear train, at every level of detail.
  */
 static void
-invert(GLfloat *m)
+create_gears(void)
 {
-    GLfloat t[16];
-    identity(t);
-
-    // Extract and invert the translation part 't'. The inverse of a
-    // translation matrix can be calculated by negating the translation
-    // coordinates.
-    t[12] = -m[12]; t[13] = -m[13]; t[14] = -m[14];
-
-    // Invert the rotation part 'r'. The inverse of a rotation matrix is
-    // equal to its transpose.
-    m[12] = m[13] = m[14] = 0;
-    transpose(m);
-
-    // inv(m) = inv(r) * inv(t)
-    multiply(m, t);
+    struct timespec start, end;
+    int lod;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (lod = 0; lod < GEAR_LODS; lod++) {
+        gears[lod][0] = create_gear(1.0, 4.0, 1.0, 20, 0.7, lod);
+        gears[lod][1] = create_gear(0.5, 2.0, 2.0, 10, 0.7, lod);
+        gears[lod][2] = create_gear(1.3, 2.0, 0.5, 10, 0.7, lod);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    gears_ms = elapsed_ms(&start, &end);
+}
+
+/** When main() started, and how long after that the first frame was drawn */
+static struct timespec startup_time;
+static double first_frame_ms;
+
+/**
+ * Prints how long it took from starting to drawing the first frame, the
+ * first time it is called.
+ */
+static void
+report_first_frame(void)
+{
+    struct timespec now;
+
+    if (first_frame_ms > 0)
+        return;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    first_frame_ms = elapsed_ms(&startup_time, &now);
+    printf("startup: first frame after %.2f ms, %.3f ms of it making gears "
+           "(%d of %d from the cache)\n",
+           first_frame_ms, gears_ms, gears_cached, SCENE_GEARS);
+}
+
+/**
+ * Puts copies of a gear train into one vertex and one element buffer per
+ * level of detail.
+ *
+ * Each vertex gets copy * SCENE_GEARS + gear as an extra attribute,
+ * which the batched vertex shader uses to pick the train's offset and
+ * the gear's matrices and color.
+ *
+ * @param copies the number of trains to put into the buffers
+ */
+static void
+create_batch(int copies)
+{
+    GLushort *indices, *idx;
+    int lod, c, g, i;
+
+    batch.ntrains = copies;
+    batch.vbo_size = 0;
+
+    for (lod = 0; lod < GEAR_LODS; lod++) {
+        int nvertices = 0, nindices = 0, base = 0;
+
+        for (g = 0; g < SCENE_GEARS; g++) {
+            nvertices += gears[lod][g]->nvertices;
+            nindices += gears[lod][g]->nindices;
+        }
+        assert(nvertices * copies <= 65536);
+
+        indices = calloc(nindices * copies, sizeof(*indices));
+        idx = indices;
+
+        for (c = 0; c < copies; c++) {
+            for (g = 0; g < SCENE_GEARS; g++) {
+                for (i = 0; i < gears[lod][g]->nindices; i++)
+                    *idx++ = base + gears[lod][g]->indices[i];
+                base += gears[lod][g]->nvertices;
+            }
+        }
+
+        batch.lods[lod].nindices = nindices;
+        glGenBuffers(1, &batch.lods[lod].vbo);
+        batch.vbo_size += upload_vertices(batch.lods[lod].vbo, gears[lod], SCENE_GEARS,
+                                          copies, 1);
+
+        glGenBuffers(1, &batch.lods[lod].ibo);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, batch.lods[lod].ibo);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, nindices * copies * sizeof(*indices),
+                     indices, GL_STATIC_DRAW);
+
+        free(indices);
+    }
+}
+
+/**
+ * Lays the gear trains out in a square grid centered on the origin, all
+ * at full detail to start with or at the forced level of detail.
+ */
+static void
+create_train_grid(void)
+{
+    int columns = ceil(sqrt(ntrains));
+    int rows = (ntrains + columns - 1) / columns;
+    int t;
+
+    train_offsets = calloc(ntrains, sizeof(*train_offsets));
+    lod_levels = calloc(ntrains, sizeof(*lod_levels));
+
+    for (t = 0; t < ntrains; t++) {
+        train_offsets[t][0] = (t % columns - (columns - 1) / 2.0) * TRAIN_SPACING;
+        train_offsets[t][1] = (t / columns - (rows - 1) / 2.0) * TRAIN_SPACING;
+    }
+
+    if (forced_lod > 0)
+        memset(lod_levels, forced_lod, ntrains * sizeof(*lod_levels));
+}
+
+/**
+ * Looks up instanced drawing, from ES 3.0 or GL_EXT/ANGLE_instanced_arrays.
+ *
+ * @return whether instanced drawing is available
+ */
+static int
+init_instancing(void)
+{
+    const char *version = (const char *) glGetString(GL_VERSION);
+    const char *extensions = (const char *) glGetString(GL_EXTENSIONS);
+
+    if (version && strncmp(version, "OpenGL ES 3", 11) == 0) {
+        draw_elements_instanced = (PFNGLDRAWELEMENTSINSTANCEDEXTPROC)
+                eglGetProcAddress("glDrawElementsInstanced");
+        vertex_attrib_divisor = (PFNGLVERTEXATTRIBDIVISOREXTPROC)
+                eglGetProcAddress("glVertexAttribDivisor");
+    } else if (extensions && strstr(extensions, "GL_EXT_instanced_arrays")) {
+        draw_elements_instanced = (PFNGLDRAWELEMENTSINSTANCEDEXTPROC)
+                eglGetProcAddress("glDrawElementsInstancedEXT");
+        vertex_attrib_divisor = (PFNGLVERTEXATTRIBDIVISOREXTPROC)
+                eglGetProcAddress("glVertexAttribDivisorEXT");
+    } else if (extensions && strstr(extensions, "GL_ANGLE_instanced_arrays")) {
+        draw_elements_instanced = (PFNGLDRAWELEMENTSINSTANCEDEXTPROC)
+                eglGetProcAddress("glDrawElementsInstancedANGLE");
+        vertex_attrib_divisor = (PFNGLVERTEXATTRIBDIVISOREXTPROC)
+                eglGetProcAddress("glVertexAttribDivisorANGLE");
+    }
+
+    return draw_elements_instanced && vertex_attrib_divisor;
+}
+
+/**
+ * Works out the vertex layout for the requested formats, falling back to
+ * floats for what the implementation cannot fetch.
+ */
+static void
+init_vertex_layout(void)
+{
+    const char *version = (const char *) glGetString(GL_VERSION);
+    const char *extensions = (const char *) glGetString(GL_EXTENSIONS);
+    int es3 = version && strncmp(version, "OpenGL ES 3", 11) == 0;
+
+    if (!extensions)
+        extensions = "";
+
+    layout.position_type = GL_FLOAT;
+    if (layout.position_format == POSITION_HALF) {
+        if (es3) {
+            layout.position_type = GL_HALF_FLOAT;
+        } else if (strstr(extensions, "GL_OES_vertex_half_float")) {
+            layout.position_type = GL_HALF_FLOAT_OES;
+        } else {
+            printf("no half float vertices, using float positions\n");
+            layout.position_format = POSITION_FLOAT;
+        }
+    }
+
+    if (layout.normal_format == NORMAL_2_10_10_10) {
+        if (es3) {
+            layout.normal_type = GL_INT_2_10_10_10_REV;
+        } else if (strstr(extensions, "GL_OES_vertex_type_10_10_10_2")) {
+            layout.normal_type = GL_INT_10_10_10_2_OES;
+        } else {
+            printf("no 10_10_10_2 vertices, using float normals\n");
+            layout.normal_format = NORMAL_FLOAT;
+        }
+    }
+
+    if (layout.position_format == POSITION_HALF) {
+        layout.gear_offset = 3 * sizeof(uint16_t);
+        layout.normal_offset = 4 * sizeof(uint16_t);
+    } else {
+        layout.normal_offset = 3 * sizeof(GLfloat);
+    }
+
+    switch (layout.normal_format) {
+    case NORMAL_FLOAT:
+        layout.normal_type = GL_FLOAT;
+        layout.normal_size = 3;
+        layout.normal_normalized = GL_FALSE;
+        layout.stride = layout.normal_offset + 3 * sizeof(GLfloat);
+        break;
+    case NORMAL_2_10_10_10:
+        layout.normal_size = 4;
+        layout.normal_normalized = GL_TRUE;
+        layout.stride = layout.normal_offset + sizeof(uint32_t);
+        break;
+    case NORMAL_BYTE:
+        layout.normal_type = GL_BYTE;
+        layout.normal_size = 3;
+        layout.normal_normalized = GL_TRUE;
+        layout.stride = layout.normal_offset + 4;
+        break;
+    }
+
+    /* Float positions have no spare room for the gear index */
+    layout.batch_stride = layout.stride;
+    if (layout.position_format == POSITION_FLOAT) {
+        layout.gear_offset = layout.stride;
+        layout.batch_stride = layout.stride + 4;
+    }
+}
+
+/**
+ * Prints the vertex layout in use and what it saves over floats.
+ */
+static void
+report_vertex_layout(void)
+{
+    static const char *position_names[] = { "float", "half" };
+    static const char *normal_names[] = { "float", "2_10_10_10", "byte" };
+    int batched = draw_mode == DRAW_BATCHED || draw_mode == DRAW_INSTANCED;
+    int stride = batched ? layout.batch_stride : layout.stride;
+    int float_stride = 6 * sizeof(GLfloat) + (batched ? 4 : 0);
+    long nvertices = 0;
+    int lod, g;
+
+    if (batched) {
+        nvertices = batch.vbo_size / stride;
+    } else {
+        for (lod = 0; lod < GEAR_LODS; lod++)
+            for (g = 0; g < SCENE_GEARS; g++)
+                nvertices += gears[lod][g]->nvertices;
+    }
+
+    printf("vertex layout %s/%s: %d bytes per vertex, %ld bytes of vertex buffers "
+           "(%ld as floats), up to %ld bytes fetched per frame\n",
+           position_names[layout.position_format], normal_names[layout.normal_format],
+           stride, nvertices * stride, nvertices * float_stride,
+           vertices_per_frame * stride);
 }
 
 /**
@@ -497,7 +1611,7 @@ invert(GLfloat *m)
 void perspective(GLfloat *m, GLfloat fovy, GLfloat aspect, GLfloat zNear, GLfloat zFar)
 {
     GLfloat tmp[16];
-    identity(tmp);
+    mat4_identity(tmp);
 
     double sine, cosine, cotangent, deltaZ;
     GLfloat radians = fovy / 2 * M_PI / 180;
@@ -521,77 +1635,1145 @@ void perspective(GLfloat *m, GLfloat fovy, GLfloat aspect, GLfloat zNear, GLfloa
 }
 
 /**
- * Draws a gear.
+ * Calculates the matrices for drawing a gear.
  *
- * @param gear the gear to draw
- * @param transform the current transformation matrix
+ * @param params the frame's transformation and projection
  * @param x the x position to draw the gear at
  * @param y the y position to draw the gear at
  * @param angle the rotation angle of the gear
- * @param color the color of the gear
+ * @param[out] model_view_projection the ModelViewProjectionMatrix
+ * @param[out] normal_matrix the NormalMatrix
  */
 static void
-draw_gear(struct gear *gear, GLfloat *transform,
-          GLfloat x, GLfloat y, GLfloat angle, const GLfloat color[4])
+gear_matrices(const struct frame_params *params, GLfloat x, GLfloat y, GLfloat angle,
+              GLfloat *model_view_projection, GLfloat *normal_matrix)
 {
     GLfloat model_view[16];
-    GLfloat normal_matrix[16];
-    GLfloat model_view_projection[16];
 
     /* Translate and rotate the gear */
-    memcpy(model_view, transform, sizeof (model_view));
-    translate(model_view, x, y, 0);
-    rotate(model_view, 2 * M_PI * angle / 360.0, 0, 0, 1);
-
-    /* Create and set the ModelViewProjectionMatrix */
-    memcpy(model_view_projection, ProjectionMatrix, sizeof(model_view_projection));
-    multiply(model_view_projection, model_view);
+    memcpy(model_view, params->transform, sizeof (model_view));
+    mat4_translate(model_view, x, y, 0);
+    mat4_rotate(model_view, 2 * M_PI * angle / 360.0, 0, 0, 1);
 
-    glUniformMatrix4fv(ModelViewProjectionMatrix_location, 1, GL_FALSE,
-                       model_view_projection);
+    /* Create the ModelViewProjectionMatrix */
+    memcpy(model_view_projection, params->projection, 16 * sizeof(GLfloat));
+    mat4_multiply(model_view_projection, model_view);
 
     /*
-    * Create and set the NormalMatrix. It's the inverse transpose of the
-    * ModelView matrix.
+    * Create the NormalMatrix. It's the inverse transpose of the
+    * ModelView matrix, which only rotates, translates and scales.
     */
-    memcpy(normal_matrix, model_view, sizeof (normal_matrix));
-    invert(normal_matrix);
-    transpose(normal_matrix);
+    mat4_normal_matrix(normal_matrix, model_view);
+}
+
+/**
+ * Steps a gear's level of detail towards the one for its size, once it
+ * is far enough past the limit of its current one.
+ *
+ * @param lod the level the gear was drawn at
+ * @param pixels_per_tooth how far apart its teeth are on screen
+ *
+ * @return the level to draw it at
+ */
+static int
+next_lod(int lod, GLfloat pixels_per_tooth)
+{
+    while (lod > 0 && pixels_per_tooth >= lod_layout[lod - 1].min_pixels * LOD_HYSTERESIS)
+        lod--;
+    while (lod < GEAR_LODS - 1 && pixels_per_tooth < lod_layout[lod].min_pixels / LOD_HYSTERESIS)
+        lod++;
+    return lod;
+}
+
+/**
+ * Picks the level of detail of every gear for a frame, from how far
+ * apart its teeth are on screen: its radius projected at the depth of
+ * its center over its number of teeth.
+ *
+ * @param params the frame's transformation, projection and size
+ *
+ * @return whether any gear changed level
+ */
+static int
+select_lods(const struct frame_params *params)
+{
+    const GLfloat *transform = params->transform;
+    /* Pixels per unit at unit distance, times how much the view shrinks the scene */
+    GLfloat pixels = params->projection[5] * params->size.height / 2 *
+            sqrt(transform[0] * transform[0] + transform[1] * transform[1] +
+                 transform[2] * transform[2]);
+    int changed = 0, g, t;
+
+    if (forced_lod >= 0)
+        return 0;
+
+    for (t = 0; t < ntrains; t++) {
+        for (g = 0; g < SCENE_GEARS; g++) {
+            GLfloat x = train_offsets[t][0] + gear_layout[g].x;
+            GLfloat y = train_offsets[t][1] + gear_layout[g].y;
+            GLfloat z = transform[2] * x + transform[6] * y + transform[14];
+            int lod = 0;
+
+            /* Nothing at or behind the eye is worth saving vertices on */
+            if (z < 0)
+                lod = next_lod(lod_levels[t][g], 2 * M_PI * gears[0][g]->radius * pixels /
+                               (gears[0][g]->teeth * -z));
+            changed |= lod != lod_levels[t][g];
+            lod_levels[t][g] = lod;
+        }
+    }
+
+    return changed;
+}
+
+/**
+ * Draws a gear.
+ *
+ * @param gear the gear to draw
+ * @param model_view_projection the ModelViewProjectionMatrix
+ * @param normal_matrix the NormalMatrix
+ * @param color the color of the gear
+ */
+static void
+draw_gear(struct gear *gear, const GLfloat *model_view_projection,
+          const GLfloat *normal_matrix, const GLfloat color[4])
+{
+    glUniformMatrix4fv(ModelViewProjectionMatrix_location, 1, GL_FALSE,
+                       model_view_projection);
     glUniformMatrix4fv(NormalMatrix_location, 1, GL_FALSE, normal_matrix);
 
-    /* Set the gear color */
-    glUniform4fv(MaterialColor_location, 1, color);
+    /* Set the gear color */
+    glUniform4fv(MaterialColor_location, 1, color);
+
+    /* Set the vertex buffer object to use */
+    glBindBuffer(GL_ARRAY_BUFFER, gear->vbo);
+
+    /* Set up the position of the attributes in the vertex buffer object */
+    set_vertex_attribs(0);
+
+    /* Enable the attributes */
+    glEnableVertexAttribArray(0);
+    glEnableVertexAttribArray(1);
+
+    if (draw_mode == DRAW_STRIPS) {
+        /* Draw the triangle strips that comprise the gear */
+        int n;
+        for (n = 0; n < gear->nstrips; n++)
+            glDrawArrays(GL_TRIANGLE_STRIP, gear->strips[n].first, gear->strips[n].count);
+    } else {
+        /* Draw the whole gear in one go */
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, gear->ibo);
+        glDrawElements(GL_TRIANGLES, gear->nindices, GL_UNSIGNED_SHORT, NULL);
+    }
+
+    /* Disable the attributes */
+    glDisableVertexAttribArray(1);
+    glDisableVertexAttribArray(0);
+}
+
+/**
+ * Returns the level of detail a train is batched at, its finest gear's.
+ */
+static int
+train_lod(int t)
+{
+    int lod = lod_levels[t][0], g;
+
+    for (g = 1; g < SCENE_GEARS; g++)
+        if (lod_levels[t][g] < lod)
+            lod = lod_levels[t][g];
+    return lod;
+}
+
+/**
+ * Binds the batch buffers of a level of detail and points the attributes
+ * at them, unless they already are.
+ *
+ * @param lod the level of detail
+ */
+static void
+bind_batch_lod(int lod)
+{
+    if (batch.bound_lod == lod)
+        return;
+
+    glBindBuffer(GL_ARRAY_BUFFER, batch.lods[lod].vbo);
+    set_vertex_attribs(1);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, batch.lods[lod].ibo);
+    batch.bound_lod = lod;
+}
+
+/**
+ * Draws all gear trains from the batch buffers.
+ *
+ * The matrices of one train at the origin are uploaded once; the shader
+ * moves each copy by its train offset. Trains are drawn at the finest
+ * level of detail of their gears, level by level from the packet's
+ * sorted offsets. With instancing that is a single draw call per level,
+ * otherwise one per batch.ntrains trains, each with the offsets for
+ * those trains.
+ *
+ * The batch buffers and attributes stay bound between frames, so a frame
+ * only has to upload uniforms and draw, and to rebind when it draws more
+ * than one level.
+ *
+ * @param packet the prepared frame
+ */
+static void
+draw_gears_batched(const struct frame_packet *packet)
+{
+    int lod, t;
+
+    if (draw_mode == DRAW_INSTANCED && batch.offsets_generation != packet->offsets_generation) {
+        glBindBuffer(GL_ARRAY_BUFFER, batch.offsets);
+        glBufferSubData(GL_ARRAY_BUFFER, 0, ntrains * sizeof(*packet->offsets),
+                        packet->offsets);
+        batch.offsets_generation = packet->offsets_generation;
+    }
+
+    glUniformMatrix4fv(ModelViewProjectionMatrices_location, SCENE_GEARS, GL_FALSE,
+                       packet->train_model_view_projection[0]);
+    glUniformMatrix4fv(NormalMatrices_location, SCENE_GEARS, GL_FALSE,
+                       packet->train_normal_matrix[0]);
+    glUniformMatrix4fv(ViewProjectionMatrix_location, 1, GL_FALSE, packet->view_projection);
+
+    for (lod = 0; lod < GEAR_LODS; lod++) {
+        int first = packet->lod_first[lod], count = packet->lod_count[lod];
+
+        if (count == 0)
+            continue;
+
+        bind_batch_lod(lod);
+
+        if (draw_mode == DRAW_INSTANCED) {
+            /* Without a base instance, the offsets attribute starts at the level's */
+            glBindBuffer(GL_ARRAY_BUFFER, batch.offsets);
+            glVertexAttribPointer(3, 2, GL_FLOAT, GL_FALSE, 0,
+                                  (uint8_t *) 0 + first * sizeof(*packet->offsets));
+            draw_elements_instanced(GL_TRIANGLES, batch.lods[lod].nindices,
+                                    GL_UNSIGNED_SHORT, NULL, count);
+            continue;
+        }
+
+        for (t = first; t < first + count; t += batch.ntrains) {
+            int n = first + count - t;
+
+            if (n > batch.ntrains)
+                n = batch.ntrains;
+            glUniform2fv(TrainOffsets_location, n, packet->offsets[t]);
+            glDrawElements(GL_TRIANGLES, n * batch.lods[lod].nindices,
+                           GL_UNSIGNED_SHORT, NULL);
+        }
+    }
+}
+
+/**
+ * Calculates the view transformation: translated and rotated by view_rot,
+ * shrunk for the grid to fit.
+ *
+ * @param[out] transform the view transformation matrix
+ * @param tilt extra rotation around the x and y axes, in degrees
+ */
+static void
+view_transform(GLfloat *transform, const GLfloat tilt[2])
+{
+    mat4_identity(transform);
+    mat4_translate(transform, 0, 0, -20);
+    mat4_rotate(transform, 2 * M_PI * (view_rot[0] + tilt[0]) / 360.0, 1, 0, 0);
+    mat4_rotate(transform, 2 * M_PI * (view_rot[1] + tilt[1]) / 360.0, 0, 1, 0);
+    mat4_rotate(transform, 2 * M_PI * view_rot[2] / 360.0, 0, 0, 1);
+    if (ntrains > 1)
+        mat4_scale(transform, 1.0 / ceil(sqrt(ntrains)));
+}
+
+/**
+ * Draws all gear trains with the current draw mode, each gear at the
+ * level of detail it was prepared at.
+ *
+ * @param packet the prepared frame
+ */
+static void
+draw_scene(const struct frame_packet *packet)
+{
+    int g, t;
+
+    lod_vertices = packet->vertices;
+
+    if (draw_mode == DRAW_BATCHED || draw_mode == DRAW_INSTANCED) {
+        draw_gears_batched(packet);
+        return;
+    }
+
+    for (t = 0; t < ntrains; t++)
+        for (g = 0; g < SCENE_GEARS; g++)
+            draw_gear(gears[packet->levels[t][g]][g],
+                      packet->model_view_projection[t * SCENE_GEARS + g],
+                      packet->normal_matrix[t * SCENE_GEARS + g], gear_colors[g]);
+}
+
+/**
+ * Creates the gears for the software renderer, without any GL.
+ */
+static void
+init_software(void)
+{
+    int lod, g;
+
+    create_train_grid();
+    create_gears();
+
+    for (lod = 0; lod < GEAR_LODS; lod++) {
+        for (g = 0; g < SCENE_GEARS; g++) {
+            soft_meshes[lod][g].vertices = gears[lod][g]->vertices[0];
+            soft_meshes[lod][g].stride = GEAR_VERTEX_STRIDE;
+            soft_meshes[lod][g].nvertices = gears[lod][g]->nvertices;
+            soft_meshes[lod][g].indices = gears[lod][g]->indices;
+            soft_meshes[lod][g].nindices = gears[lod][g]->nindices;
+        }
+    }
+
+    vertices_per_frame = 0;
+    for (g = 0; g < SCENE_GEARS; g++)
+        vertices_per_frame += gears[0][g]->nindices;
+    vertices_per_frame *= ntrains;
+    draws_per_frame = (long) ntrains * SCENE_GEARS;
+
+    printf("drawing in software (%s): %d trains, %ld triangles per frame\n",
+           soft_renderer_implementation(), ntrains, vertices_per_frame / 3);
+}
+
+/**
+ * Draws all gear trains with the software renderer.
+ *
+ * @param packet the prepared frame
+ * @param size the size of the frame, which the packet may be a resize behind
+ * @param pixels the frame, top row first, as soft_end() takes it
+ * @param stride the bytes between rows of pixels
+ * @param[out] stats what the renderer did
+ */
+static void
+soft_draw_scene(const struct frame_packet *packet, const struct geometry *size,
+                uint32_t *pixels, int stride, struct soft_stats *stats)
+{
+    int g, t;
+
+    lod_vertices = packet->vertices;
+    soft_begin(soft_renderer, size->width, size->height, LightSourcePosition);
+
+    for (t = 0; t < ntrains; t++)
+        for (g = 0; g < SCENE_GEARS; g++)
+            soft_draw(soft_renderer, &soft_meshes[packet->levels[t][g]][g],
+                      packet->model_view_projection[t * SCENE_GEARS + g],
+                      packet->normal_matrix[t * SCENE_GEARS + g], gear_colors[g]);
+
+    soft_end(soft_renderer, pixels, stride, stats);
+}
+
+/**
+ * Calculates the bounding box of a damage set.
+ *
+ * @param d the damage set
+ * @param[out] box the bounding box, empty if the set is
+ */
+static void
+damage_bounds(const struct damage *d, EGLint box[4])
+{
+    EGLint x1 = 0, y1 = 0;
+    int i;
+
+    box[0] = box[1] = box[2] = box[3] = 0;
+
+    for (i = 0; i < d->nrects; i++) {
+        const EGLint *r = d->rects[i];
+
+        if (i == 0) {
+            box[0] = r[0];
+            box[1] = r[1];
+            x1 = r[0] + r[2];
+            y1 = r[1] + r[3];
+            continue;
+        }
+
+        box[0] = fmin(box[0], r[0]);
+        box[1] = fmin(box[1], r[1]);
+        x1 = fmax(x1, r[0] + r[2]);
+        y1 = fmax(y1, r[1] + r[3]);
+    }
+
+    box[2] = x1 - box[0];
+    box[3] = y1 - box[1];
+}
+
+/**
+ * Adds a rectangle to a damage set.
+ *
+ * @param d the damage set
+ * @param r the rectangle
+ */
+static void
+damage_add(struct damage *d, const EGLint r[4])
+{
+    EGLint box[4];
+
+    if (r[2] <= 0 || r[3] <= 0)
+        return;
+
+    if (d->nrects == MAX_DAMAGE_RECTS) {
+        /* Out of room: collapse everything into one box */
+        damage_bounds(d, box);
+        memcpy(d->rects[0], box, sizeof(box));
+        d->nrects = 1;
+    }
+
+    memcpy(d->rects[d->nrects++], r, 4 * sizeof(EGLint));
+}
+
+/**
+ * Calculates the area covered by a damage set, counting overlaps once.
+ *
+ * @param d the damage set
+ *
+ * @return the number of pixels covered
+ */
+static long
+damage_area(const struct damage *d)
+{
+    EGLint xs[2 * MAX_DAMAGE_RECTS], ys[2 * MAX_DAMAGE_RECTS];
+    long area = 0;
+    int i, j, k;
+
+    /* Split the plane at every edge and sum the cells inside any rectangle */
+    for (i = 0; i < d->nrects; i++) {
+        xs[2 * i] = d->rects[i][0];
+        xs[2 * i + 1] = d->rects[i][0] + d->rects[i][2];
+        ys[2 * i] = d->rects[i][1];
+        ys[2 * i + 1] = d->rects[i][1] + d->rects[i][3];
+    }
+
+    for (i = 0; i < 2 * d->nrects; i++) {
+        for (j = 0; j < 2 * d->nrects; j++) {
+            EGLint x0 = xs[i], y0 = ys[j], x1 = INT32_MAX, y1 = INT32_MAX;
+
+            for (k = 0; k < 2 * d->nrects; k++) {
+                if (xs[k] > x0 && xs[k] < x1)
+                    x1 = xs[k];
+                if (ys[k] > y0 && ys[k] < y1)
+                    y1 = ys[k];
+            }
+            if (x1 == INT32_MAX || y1 == INT32_MAX)
+                continue;
+            /* Duplicate edges would count a cell twice */
+            for (k = 0; k < i; k++)
+                if (xs[k] == x0)
+                    break;
+            if (k < i)
+                continue;
+            for (k = 0; k < j; k++)
+                if (ys[k] == y0)
+                    break;
+            if (k < j)
+                continue;
+
+            for (k = 0; k < d->nrects; k++) {
+                const EGLint *r = d->rects[k];
+
+                if (x0 >= r[0] && x1 <= r[0] + r[2] && y0 >= r[1] && y1 <= r[1] + r[3]) {
+                    area += (long) (x1 - x0) * (y1 - y0);
+                    break;
+                }
+            }
+        }
+    }
+
+    return area;
+}
+
+/**
+ * Projects a box to the window.
+ *
+ * @param m the model view projection matrix
+ * @param min the minimum x, y and z of the box
+ * @param max the maximum x, y and z of the box
+ * @param size the window size
+ * @param[out] rect the window rectangle covering the box, padded by a pixel
+ *             for rasterization and clipped to the window
+ */
+static void
+project_box(const GLfloat *m, const GLfloat min[3], const GLfloat max[3],
+            const struct geometry *size, EGLint rect[4])
+{
+    GLfloat x0 = HUGE_VALF, y0 = HUGE_VALF, x1 = -HUGE_VALF, y1 = -HUGE_VALF;
+    int i;
+
+    for (i = 0; i < 8; i++) {
+        GLfloat p[3] = {
+            i & 1 ? max[0] : min[0],
+            i & 2 ? max[1] : min[1],
+            i & 4 ? max[2] : min[2],
+        };
+        GLfloat x = m[0] * p[0] + m[4] * p[1] + m[8] * p[2] + m[12];
+        GLfloat y = m[1] * p[0] + m[5] * p[1] + m[9] * p[2] + m[13];
+        GLfloat w = m[3] * p[0] + m[7] * p[1] + m[11] * p[2] + m[15];
+
+        /* Reaches behind the eye, the projection is unbounded */
+        if (w <= 1e-3) {
+            x0 = y0 = -1;
+            x1 = y1 = 1;
+            break;
+        }
+
+        x0 = fmin(x0, x / w);
+        x1 = fmax(x1, x / w);
+        y0 = fmin(y0, y / w);
+        y1 = fmax(y1, y / w);
+    }
+
+    x0 = fmax(floor((x0 * 0.5 + 0.5) * size->width) - 1, 0);
+    y0 = fmax(floor((y0 * 0.5 + 0.5) * size->height) - 1, 0);
+    x1 = fmin(ceil((x1 * 0.5 + 0.5) * size->width) + 1, size->width);
+    y1 = fmin(ceil((y1 * 0.5 + 0.5) * size->height) + 1, size->height);
+
+    rect[0] = x0;
+    rect[1] = y0;
+    rect[2] = x1 > x0 ? x1 - x0 : 0;
+    rect[3] = y1 > y0 ? y1 - y0 : 0;
+}
+
+/**
+ * Works out where the gears are drawn with the given view.
+ *
+ * A single train gets a rectangle per gear, a grid one per train. Each
+ * gear is bounded by a box of its tip radius, which holds at any angle.
+ *
+ * @param params the frame's view, projection and size
+ * @param[out] d the rectangles covering the gears
+ */
+static void
+scene_damage(const struct frame_params *params, struct damage *d)
+{
+    const struct geometry *size = &params->size;
+    GLfloat view_projection[16];
+    GLfloat min[3], max[3];
+    EGLint rect[4];
+    int g, t;
+
+    memcpy(view_projection, params->projection, sizeof(view_projection));
+    mat4_multiply(view_projection, params->transform);
+    d->nrects = 0;
+
+    for (t = 0; t < ntrains; t++) {
+        for (g = 0; g < SCENE_GEARS; g++) {
+            GLfloat gear_min[3] = {
+                train_offsets[t][0] + gear_layout[g].x - gears[0][g]->radius,
+                train_offsets[t][1] + gear_layout[g].y - gears[0][g]->radius,
+                -gears[0][g]->width / 2
+            };
+            GLfloat gear_max[3] = {
+                train_offsets[t][0] + gear_layout[g].x + gears[0][g]->radius,
+                train_offsets[t][1] + gear_layout[g].y + gears[0][g]->radius,
+                gears[0][g]->width / 2
+            };
+            int i;
+
+            for (i = 0; i < 3; i++) {
+                min[i] = g == 0 ? gear_min[i] : fmin(min[i], gear_min[i]);
+                max[i] = g == 0 ? gear_max[i] : fmax(max[i], gear_max[i]);
+            }
+
+            if (ntrains == 1) {
+                project_box(view_projection, gear_min, gear_max, size, rect);
+                damage_add(d, rect);
+            }
+        }
+
+        if (ntrains > 1) {
+            project_box(view_projection, min, max, size, rect);
+            damage_add(d, rect);
+        }
+    }
+}
+
+/**
+ * Works out what to repaint and what to report as damaged for a frame.
+ *
+ * The frame's damage is where the gears are now plus where they were in
+ * the last frame. A back buffer that is buffer_age frames old is missing
+ * the damage of that many frames, so their union is repainted; when the
+ * age is unknown or older than the history the whole window is.
+ *
+ * @param window the window
+ * @param drawn where the gears are drawn in the frame, from scene_damage()
+ * @param buffer_age the age of the back buffer, 0 if unknown
+ * @param[out] frame_damage what changed since the last frame
+ * @param[out] repaint the rectangle to scissor the frame to
+ */
+static void
+update_damage(struct window *window, const struct damage *drawn, EGLint buffer_age,
+              struct damage *frame_damage, EGLint repaint[4])
+{
+    const struct geometry *size = &window->geometry;
+    EGLint full[4] = { 0, 0, size->width, size->height };
+    struct damage missing;
+    int i;
+
+    if (window->damage_size.width != size->width ||
+        window->damage_size.height != size->height) {
+        window->damage_size = *size;
+        window->damage_history_length = 0;
+        frame_damage->nrects = 0;
+        damage_add(frame_damage, full);
+    } else {
+        *frame_damage = *drawn;
+        for (i = 0; i < window->drawn.nrects; i++)
+            damage_add(frame_damage, window->drawn.rects[i]);
+    }
+    window->drawn = *drawn;
+
+    memmove(&window->damage_history[1], &window->damage_history[0],
+            (DAMAGE_HISTORY - 1) * sizeof(struct damage));
+    window->damage_history[0] = *frame_damage;
+    if (window->damage_history_length < DAMAGE_HISTORY)
+        window->damage_history_length++;
+
+    if (buffer_age < 1 || buffer_age > window->damage_history_length) {
+        memcpy(repaint, full, sizeof(full));
+    } else {
+        missing.nrects = 0;
+        for (i = 0; i < buffer_age; i++) {
+            EGLint box[4];
+
+            damage_bounds(&window->damage_history[i], box);
+            damage_add(&missing, box);
+        }
+        damage_bounds(&missing, repaint);
+    }
+
+    window->repaint_fraction += (double) repaint[2] * repaint[3] / (size->width * size->height);
+    window->damage_fraction += (double) damage_area(frame_damage) / (size->width * size->height);
+}
+
+/**
+ * Prepares a frame from its parameters: picks the levels of detail,
+ * works out every matrix the draw calls take and, if the frame tracks
+ * damage, where the gears are.
+ *
+ * @param packet the packet to fill in, its params set
+ */
+static void
+prepare_frame(struct frame_packet *packet)
+{
+    const struct frame_params *params = &packet->params;
+    struct timespec start, end;
+    int lod, g, t;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    if (select_lods(params))
+        lod_generation++;
+
+    packet->vertices = 0;
+    if (draw_mode == DRAW_BATCHED || draw_mode == DRAW_INSTANCED) {
+        for (g = 0; g < SCENE_GEARS; g++)
+            gear_matrices(params, gear_layout[g].x, gear_layout[g].y,
+                          gear_layout[g].speed * params->angle + gear_layout[g].phase,
+                          packet->train_model_view_projection[g],
+                          packet->train_normal_matrix[g]);
+
+        memcpy(packet->view_projection, params->projection, sizeof(packet->view_projection));
+        mat4_multiply(packet->view_projection, params->transform);
+
+        /* Count the trains at each level, and sort them by level again if that changed */
+        memset(packet->lod_count, 0, sizeof(packet->lod_count));
+        for (t = 0; t < ntrains; t++)
+            packet->lod_count[train_lod(t)]++;
+        for (lod = 0; lod < GEAR_LODS; lod++) {
+            packet->lod_first[lod] = lod == 0 ? 0 :
+                    packet->lod_first[lod - 1] + packet->lod_count[lod - 1];
+            packet->vertices += (long) packet->lod_count[lod] * batch.lods[lod].nindices;
+        }
+
+        if (packet->offsets_generation != lod_generation) {
+            int next[GEAR_LODS];
+
+            memcpy(next, packet->lod_first, sizeof(next));
+            for (t = 0; t < ntrains; t++)
+                memcpy(packet->offsets[next[train_lod(t)]++], train_offsets[t],
+                       sizeof(*packet->offsets));
+            packet->offsets_generation = lod_generation;
+        }
+    } else {
+        memcpy(packet->levels, lod_levels, ntrains * sizeof(*lod_levels));
+        for (t = 0; t < ntrains; t++) {
+            for (g = 0; g < SCENE_GEARS; g++) {
+                struct gear *gear = gears[lod_levels[t][g]][g];
+
+                gear_matrices(params,
+                              train_offsets[t][0] + gear_layout[g].x,
+                              train_offsets[t][1] + gear_layout[g].y,
+                              gear_layout[g].speed * params->angle + gear_layout[g].phase,
+                              packet->model_view_projection[t * SCENE_GEARS + g],
+                              packet->normal_matrix[t * SCENE_GEARS + g]);
+                packet->vertices += draw_mode == DRAW_STRIPS ? gear->nvertices : gear->nindices;
+            }
+        }
+    }
+
+    if (params->damage)
+        scene_damage(params, &packet->damage);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    packet->prepare_ms = elapsed_ms(&start, &end);
+}
+
+/**
+ * Prepares the queued frames, in order, until told to quit.
+ */
+static void *
+pipeline_thread(void *data)
+{
+    int next = 0;
+
+    pthread_mutex_lock(&pipeline.mutex);
+    for (;;) {
+        struct frame_packet *packet = &pipeline.packets[next];
+
+        while (!pipeline.quit && packet->state != PACKET_QUEUED)
+            pthread_cond_wait(&pipeline.cond, &pipeline.mutex);
+        if (pipeline.quit)
+            break;
+
+        pthread_mutex_unlock(&pipeline.mutex);
+        prepare_frame(packet);
+        pthread_mutex_lock(&pipeline.mutex);
+
+        packet->state = PACKET_READY;
+        pthread_cond_broadcast(&pipeline.cond);
+        next ^= 1;
+    }
+    pthread_mutex_unlock(&pipeline.mutex);
+
+    return NULL;
+}
+
+/**
+ * Allocates the frame packets, once the draw mode and the trains are
+ * known, and starts the worker thread if threaded is set.
+ */
+static void
+init_pipeline(int threaded)
+{
+    int batched = draw_mode == DRAW_BATCHED || draw_mode == DRAW_INSTANCED;
+    int i;
+
+    pthread_mutex_init(&pipeline.mutex, NULL);
+    pthread_cond_init(&pipeline.cond, NULL);
+
+    for (i = 0; i < 2; i++) {
+        struct frame_packet *packet = &pipeline.packets[i];
+
+        if (batched) {
+            packet->offsets = calloc(ntrains, sizeof(*packet->offsets));
+            assert(packet->offsets);
+        } else {
+            packet->levels = calloc(ntrains, sizeof(*packet->levels));
+            packet->model_view_projection = calloc((long) ntrains * SCENE_GEARS,
+                                                   sizeof(*packet->model_view_projection));
+            packet->normal_matrix = calloc((long) ntrains * SCENE_GEARS,
+                                           sizeof(*packet->normal_matrix));
+            assert(packet->levels && packet->model_view_projection && packet->normal_matrix);
+        }
+    }
+
+    if (threaded && pthread_create(&pipeline.thread, NULL, pipeline_thread, NULL) != 0) {
+        fprintf(stderr, "failed to start the frame preparation thread\n");
+        threaded = 0;
+    }
+    pipeline.threaded = threaded;
+}
+
+/**
+ * Stops the worker thread and frees the frame packets.
+ */
+static void
+fini_pipeline(void)
+{
+    int i;
+
+    if (pipeline.threaded) {
+        pthread_mutex_lock(&pipeline.mutex);
+        pipeline.quit = 1;
+        pthread_cond_broadcast(&pipeline.cond);
+        pthread_mutex_unlock(&pipeline.mutex);
+        pthread_join(pipeline.thread, NULL);
+    }
+
+    for (i = 0; i < 2; i++) {
+        free(pipeline.packets[i].levels);
+        free(pipeline.packets[i].model_view_projection);
+        free(pipeline.packets[i].normal_matrix);
+        free(pipeline.packets[i].offsets);
+    }
+    memset(&pipeline, 0, sizeof(pipeline));
+}
+
+/**
+ * Queues a frame for preparing, right away without a worker thread. At
+ * most one frame is queued ahead of the one being drawn.
+ *
+ * @param params what to draw the frame from
+ */
+static void
+pipeline_queue(const struct frame_params *params)
+{
+    struct frame_packet *packet = &pipeline.packets[pipeline.tail];
+
+    assert(packet->state == PACKET_FREE);
+    packet->params = *params;
+    pipeline.tail ^= 1;
+
+    if (!pipeline.threaded) {
+        prepare_frame(packet);
+        packet->state = PACKET_READY;
+        return;
+    }
+
+    pthread_mutex_lock(&pipeline.mutex);
+    packet->state = PACKET_QUEUED;
+    pthread_cond_broadcast(&pipeline.cond);
+    pthread_mutex_unlock(&pipeline.mutex);
+}
+
+/**
+ * Returns the queued frame once it is prepared. It stays valid until the
+ * frame after the next one is queued.
+ */
+static struct frame_packet *
+pipeline_take(void)
+{
+    struct frame_packet *packet = &pipeline.packets[pipeline.head];
+
+    assert(pipeline.head != pipeline.tail);
+    pipeline.head ^= 1;
+
+    if (pipeline.threaded) {
+        pthread_mutex_lock(&pipeline.mutex);
+        while (packet->state != PACKET_READY)
+            pthread_cond_wait(&pipeline.cond, &pipeline.mutex);
+        packet->state = PACKET_FREE;
+        pthread_mutex_unlock(&pipeline.mutex);
+    } else {
+        packet->state = PACKET_FREE;
+    }
+
+    return packet;
+}
+
+/**
+ * Returns the frame to draw now, given what the latest one should be
+ * drawn from. Without a worker thread that is the latest one itself;
+ * with one it is the frame queued the last time, and the latest is
+ * queued to be prepared while that one is drawn, a frame behind.
+ *
+ * @param params what to draw the latest frame from
+ */
+static struct frame_packet *
+next_frame(const struct frame_params *params)
+{
+    struct frame_packet *packet;
+
+    if (pipeline.head == pipeline.tail)
+        pipeline_queue(params);
+    packet = pipeline_take();
+    if (pipeline.threaded)
+        pipeline_queue(params);
+
+    return packet;
+}
+
+/**
+ * Sets what a frame of a window is drawn from, as things are now.
+ *
+ * @param window the window
+ * @param tilt extra rotation of the view, see view_transform()
+ * @param input_ms when the input the frame shows happened, 0 if none new
+ * @param[out] params the frame parameters
+ */
+static void
+set_frame_params(const struct window *window, const GLfloat tilt[2], double input_ms,
+                 struct frame_params *params)
+{
+    view_transform(params->transform, tilt);
+    memcpy(params->projection, ProjectionMatrix, sizeof(params->projection));
+    params->angle = angle;
+    params->size = window->geometry;
+    params->damage = !soft_renderer;
+    params->input_ms = input_ms;
+}
+
+static const EGLint egl_context_attribs[] = {
+    EGL_CONTEXT_CLIENT_VERSION, 2,
+    EGL_NONE
+};
+
+/** Whether init_egl() may use the config --tune-egl found fastest */
+static int use_tuned_config = 1;
+
+/** What es2gears tells EGL configs apart by */
+struct egl_config_info {
+    EGLConfig config;
+    EGLint id, red, green, blue, alpha, depth, samples;
+    EGLint min_swap_interval, max_swap_interval;
+};
+
+static void
+get_egl_config_info(EGLDisplay dpy, EGLConfig config, struct egl_config_info *info)
+{
+    info->config = config;
+    eglGetConfigAttrib(dpy, config, EGL_CONFIG_ID, &info->id);
+    eglGetConfigAttrib(dpy, config, EGL_RED_SIZE, &info->red);
+    eglGetConfigAttrib(dpy, config, EGL_GREEN_SIZE, &info->green);
+    eglGetConfigAttrib(dpy, config, EGL_BLUE_SIZE, &info->blue);
+    eglGetConfigAttrib(dpy, config, EGL_ALPHA_SIZE, &info->alpha);
+    eglGetConfigAttrib(dpy, config, EGL_DEPTH_SIZE, &info->depth);
+    eglGetConfigAttrib(dpy, config, EGL_SAMPLES, &info->samples);
+    eglGetConfigAttrib(dpy, config, EGL_MIN_SWAP_INTERVAL, &info->min_swap_interval);
+    eglGetConfigAttrib(dpy, config, EGL_MAX_SWAP_INTERVAL, &info->max_swap_interval);
+}
+
+/**
+ * Returns whether two configs draw the gears alike: the same color,
+ * depth and multisampling. Stencil and the like are not used.
+ */
+static int
+same_egl_config(const struct egl_config_info *a, const struct egl_config_info *b)
+{
+    return a->red == b->red && a->green == b->green && a->blue == b->blue &&
+            a->alpha == b->alpha && a->depth == b->depth && a->samples == b->samples;
+}
+
+/** Names a config's color format, like RGB565 or RGBA8888 */
+static void
+egl_config_format(const struct egl_config_info *info, char *name, size_t size)
+{
+    if (info->alpha)
+        snprintf(name, size, "RGBA%d%d%d%d", info->red, info->green, info->blue, info->alpha);
+    else
+        snprintf(name, size, "RGB%d%d%d", info->red, info->green, info->blue);
+}
+
+/**
+ * Finds a config for surface_type surfaces that draws like want.
+ *
+ * @return the config, or NULL if there is none
+ */
+static EGLConfig
+find_egl_config(EGLDisplay dpy, EGLint surface_type, const struct egl_config_info *want)
+{
+    const EGLint attribs[] = {
+        EGL_SURFACE_TYPE, surface_type,
+        EGL_RENDERABLE_TYPE, EGL_OPENGL_ES2_BIT,
+        EGL_RED_SIZE, want->red,
+        EGL_GREEN_SIZE, want->green,
+        EGL_BLUE_SIZE, want->blue,
+        EGL_ALPHA_SIZE, want->alpha,
+        EGL_DEPTH_SIZE, want->depth,
+        EGL_SAMPLES, want->samples,
+        EGL_NONE
+    };
+    struct egl_config_info info;
+    EGLConfig found = NULL, *configs;
+    EGLint count, i;
+
+    /* The sizes asked for are minimums; take an exact match */
+    if (!eglChooseConfig(dpy, attribs, NULL, 0, &count) || count < 1)
+        return NULL;
+    configs = calloc(count, sizeof(*configs));
+    if (!configs)
+        return NULL;
+    if (eglChooseConfig(dpy, attribs, configs, count, &count)) {
+        for (i = 0; i < count && !found; i++) {
+            get_egl_config_info(dpy, configs[i], &info);
+            if (same_egl_config(&info, want))
+                found = configs[i];
+        }
+    }
+    free(configs);
+
+    return found;
+}
+
+/**
+ * Gets the GL_RENDERER of the display's context, made current without a
+ * surface, to tell devices apart by before drawing anything.
+ *
+ * @return whether it could
+ */
+static int
+query_egl_renderer(struct display *display, char *renderer, size_t size)
+{
+    const char *extensions = eglQueryString(display->egl.dpy, EGL_EXTENSIONS);
+    const char *name;
+
+    if (!extensions || !strstr(extensions, "EGL_KHR_surfaceless_context") ||
+        !eglMakeCurrent(display->egl.dpy, EGL_NO_SURFACE, EGL_NO_SURFACE, display->egl.ctx))
+        return 0;
+
+    name = (const char *) glGetString(GL_RENDERER);
+    if (name)
+        snprintf(renderer, size, "%s", name);
+    eglMakeCurrent(display->egl.dpy, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+
+    return name != NULL;
+}
+
+/**
+ * Returns the file the tuned configs are kept in, next to the gear
+ * meshes, to be freed; NULL without a cache.
+ */
+static char *
+tuned_config_path(void)
+{
+    size_t size;
+    char *path;
+
+    if (!mesh_cache_dir)
+        return NULL;
+
+    size = strlen(mesh_cache_dir) + sizeof("/egl-configs");
+    path = malloc(size);
+    if (path)
+        snprintf(path, size, "%s/egl-configs", mesh_cache_dir);
+    return path;
+}
+
+/*
+ * The tuned configs file has a line per renderer: the red, green, blue,
+ * alpha and depth sizes and the samples of its fastest config, then the
+ * GL_RENDERER string.
+ */
+#define TUNED_CONFIG_FORMAT "%d %d %d %d %d %d %255[^\n]"
+
+/**
+ * Looks up the config tuned for a renderer.
+ *
+ * @return whether there is one
+ */
+static int
+load_tuned_config(const char *renderer, struct egl_config_info *info)
+{
+    char *path = tuned_config_path();
+    char line[512], name[256];
+    FILE *file;
+    int found = 0;
+
+    file = path ? fopen(path, "r") : NULL;
+    free(path);
+    if (!file)
+        return 0;
+
+    while (!found && fgets(line, sizeof line, file))
+        found = sscanf(line, TUNED_CONFIG_FORMAT, &info->red, &info->green,
+                       &info->blue, &info->alpha, &info->depth, &info->samples,
+                       name) == 7 &&
+                strcmp(name, renderer) == 0;
+    fclose(file);
+
+    return found;
+}
+
+/**
+ * Remembers the config tuned for a renderer, replacing what was there
+ * for it before.
+ *
+ * @return whether it was saved
+ */
+static int
+save_tuned_config(const char *renderer, const struct egl_config_info *info)
+{
+    char *path = tuned_config_path();
+    char line[512], name[256], *tmp;
+    struct egl_config_info other;
+    FILE *file, *old;
+    size_t size;
+    int ok;
+
+    if (!path)
+        return 0;
+    size = strlen(path) + 16;
+    tmp = malloc(size);
+    if (!tmp) {
+        free(path);
+        return 0;
+    }
+    snprintf(tmp, size, "%s.%d", path, (int) getpid());
+
+    file = fopen(tmp, "w");
+    ok = file != NULL;
+    if (file) {
+        old = fopen(path, "r");
+        while (old && fgets(line, sizeof line, old)) {
+            if (sscanf(line, TUNED_CONFIG_FORMAT, &other.red, &other.green,
+                       &other.blue, &other.alpha, &other.depth, &other.samples,
+                       name) == 7 && strcmp(name, renderer) != 0)
+                fputs(line, file);
+        }
+        if (old)
+            fclose(old);
+
+        fprintf(file, "%d %d %d %d %d %d %s\n", info->red, info->green, info->blue,
+                info->alpha, info->depth, info->samples, renderer);
+        if (fclose(file) != 0)
+            ok = 0;
+        if (!ok || rename(tmp, path) < 0) {
+            unlink(tmp);
+            ok = 0;
+        }
+    }
+
+    free(tmp);
+    free(path);
+    return ok;
+}
 
-    /* Set the vertex buffer object to use */
-    glBindBuffer(GL_ARRAY_BUFFER, gear->vbo);
+/**
+ * Switches to the config --tune-egl found fastest on this renderer, if
+ * it has been tuned and the config is there for windows too.
+ */
+static void
+use_tuned_egl_config(struct display *display, struct window *window)
+{
+    struct egl_config_info want;
+    char renderer[256], format[32];
+    EGLConfig config;
 
-    /* Set up the position of the attributes in the vertex buffer object */
-    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE,
-                          6 * sizeof(GLfloat), NULL);
-    glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE,
-                          6 * sizeof(GLfloat), (GLfloat *) 0 + 3);
+    if (!query_egl_renderer(display, renderer, sizeof renderer) ||
+        !load_tuned_config(renderer, &want))
+        return;
 
-    /* Enable the attributes */
-    glEnableVertexAttribArray(0);
-    glEnableVertexAttribArray(1);
+    egl_config_format(&want, format, sizeof format);
+    config = find_egl_config(display->egl.dpy, EGL_WINDOW_BIT, &want);
+    if (!config) {
+        fprintf(stderr, "no %s window config with depth %d and %d samples, as tuned; "
+                "using the default\n", format, want.depth, want.samples);
+        return;
+    }
 
-    /* Draw the triangle strips that comprise the gear */
-    int n;
-    for (n = 0; n < gear->nstrips; n++)
-        glDrawArrays(GL_TRIANGLE_STRIP, gear->strips[n].first, gear->strips[n].count);
+    eglDestroyContext(display->egl.dpy, display->egl.ctx);
+    display->egl.conf = config;
+    display->egl.ctx = eglCreateContext(display->egl.dpy, display->egl.conf,
+                                        EGL_NO_CONTEXT, egl_context_attribs);
+    assert(display->egl.ctx);
 
-    /* Disable the attributes */
-    glDisableVertexAttribArray(1);
-    glDisableVertexAttribArray(0);
+    /* Nothing shows through a surface without alpha */
+    if (!want.alpha)
+        window->opaque = 1;
+    printf("using the EGL config tuned for %s: %s, depth %d, %d samples\n",
+           renderer, format, want.depth, want.samples);
 }
 
 static void
 init_egl(struct display *display, struct window *window)
 {
-    static const EGLint context_attribs[] = {
-        EGL_CONTEXT_CLIENT_VERSION, 2,
-        EGL_NONE
-    };
     const char *extensions;
 
     EGLint config_attribs[] = {
@@ -611,7 +2793,22 @@ init_egl(struct display *display, struct window *window)
     if (window->opaque || window->buffer_size == 16)
         config_attribs[9] = 0;
 
-    display->egl.dpy = eglGetDisplay(display->display);
+    if (display->display) {
+        display->egl.dpy = eglGetDisplay(display->display);
+    } else {
+        /* Headless: Mesa's surfaceless platform, rendering to a pbuffer */
+        PFNEGLGETPLATFORMDISPLAYEXTPROC get_platform_display =
+                (PFNEGLGETPLATFORMDISPLAYEXTPROC)
+                eglGetProcAddress("eglGetPlatformDisplayEXT");
+
+        if (!get_platform_display) {
+            fprintf(stderr, "headless needs EGL_EXT_platform_base\n");
+            exit(EXIT_FAILURE);
+        }
+        display->egl.dpy = get_platform_display(EGL_PLATFORM_SURFACELESS_MESA,
+                                                EGL_DEFAULT_DISPLAY, NULL);
+        config_attribs[1] = EGL_PBUFFER_BIT;
+    }
     assert(display->egl.dpy);
 
     ret = eglInitialize(display->egl.dpy, &major, &minor);
@@ -646,9 +2843,12 @@ init_egl(struct display *display, struct window *window)
 
     display->egl.ctx = eglCreateContext(display->egl.dpy,
                                         display->egl.conf,
-                                        EGL_NO_CONTEXT, context_attribs);
+                                        EGL_NO_CONTEXT, egl_context_attribs);
     assert(display->egl.ctx);
 
+    if (display->display && use_tuned_config)
+        use_tuned_egl_config(display, window);
+
     display->swap_buffers_with_damage = NULL;
     extensions = eglQueryString(display->egl.dpy, EGL_EXTENSIONS);
     if (extensions &&
@@ -698,6 +2898,46 @@ static const char vertex_shader[] =
         "    gl_Position = ModelViewProjectionMatrix * vec4(position, 1.0);\n"
         "}";
 
+/*
+ * The same lighting as vertex_shader, for DRAW_BATCHED and DRAW_INSTANCED.
+ * Each vertex picks the matrices and color of its gear from the uniform
+ * arrays, and moves by its train's offset, which comes from a uniform
+ * array indexed by the batch copy or from a per instance attribute.
+ * init_gl() defines BATCH_TRAINS and, when instancing, INSTANCED.
+ */
+static const char batched_vertex_shader[] =
+        "attribute vec3 position;\n"
+        "attribute vec3 normal;\n"
+        "attribute float gear;\n"
+        "#ifdef INSTANCED\n"
+        "attribute vec2 offset;\n"
+        "#else\n"
+        "uniform vec2 TrainOffsets[BATCH_TRAINS];\n"
+        "#endif\n"
+        "\n"
+        "uniform mat4 ModelViewProjectionMatrices[3];\n"
+        "uniform mat4 NormalMatrices[3];\n"
+        "uniform mat4 ViewProjectionMatrix;\n"
+        "uniform vec4 LightSourcePosition;\n"
+        "uniform vec4 MaterialColors[3];\n"
+        "\n"
+        "varying vec4 Color;\n"
+        "\n"
+        "void main(void)\n"
+        "{\n"
+        "    float copy = floor((gear + 0.5) / 3.0);\n"
+        "    int g = int(gear - 3.0 * copy + 0.5);\n"
+        "#ifndef INSTANCED\n"
+        "    vec2 offset = TrainOffsets[int(copy)];\n"
+        "#endif\n"
+        "    vec3 N = normalize(vec3(NormalMatrices[g] * vec4(normal, 1.0)));\n"
+        "    vec3 L = normalize(LightSourcePosition.xyz);\n"
+        "    float diffuse = max(dot(N, L), 0.0);\n"
+        "    Color = diffuse * MaterialColors[g];\n"
+        "    gl_Position = ModelViewProjectionMatrices[g] * vec4(position, 1.0)\n"
+        "                + ViewProjectionMatrix * vec4(offset, 0.0, 0.0);\n"
+        "}";
+
 static const char fragment_shader[] =
         "precision mediump float;\n"
         "varying vec4 Color;\n"
@@ -712,15 +2952,51 @@ init_gl(struct window *window)
 {
     GLuint v, f, program;
     const char *p;
+    const char *sources[2];
+    char defines[128];
     char msg[512];
+    GLint uniform_vectors;
+    int lod, g, batch_trains = 1;
 
     glEnable(GL_CULL_FACE);
     glEnable(GL_DEPTH_TEST);
 
+    create_train_grid();
+
+    if (draw_mode == DRAW_DEFAULT)
+        draw_mode = ntrains > 1 ? DRAW_INSTANCED : DRAW_INDEXED;
+    if (draw_mode == DRAW_INSTANCED && !init_instancing()) {
+        printf("no instanced arrays, falling back to batched drawing\n");
+        draw_mode = DRAW_BATCHED;
+    }
+
+    /*
+     * Trains per batched draw: as many as fit in 16-bit indices and in
+     * the uniform vectors left over after the 32 the matrices, colors
+     * and light take.
+     */
+    if (draw_mode == DRAW_BATCHED) {
+        glGetIntegerv(GL_MAX_VERTEX_UNIFORM_VECTORS, &uniform_vectors);
+        batch_trains = uniform_vectors - 32;
+        if (batch_trains > 48)
+            batch_trains = 48;
+        if (batch_trains > ntrains)
+            batch_trains = ntrains;
+    }
+
+    snprintf(defines, sizeof defines, "#define BATCH_TRAINS %d\n%s",
+             batch_trains, draw_mode == DRAW_INSTANCED ? "#define INSTANCED\n" : "");
+
     /* Compile the vertex shader */
-    p = vertex_shader;
     v = glCreateShader(GL_VERTEX_SHADER);
-    glShaderSource(v, 1, &p, NULL);
+    if (draw_mode == DRAW_BATCHED || draw_mode == DRAW_INSTANCED) {
+        sources[0] = defines;
+        sources[1] = batched_vertex_shader;
+        glShaderSource(v, 2, sources, NULL);
+    } else {
+        p = vertex_shader;
+        glShaderSource(v, 1, &p, NULL);
+    }
     glCompileShader(v);
     glGetShaderInfoLog(v, sizeof msg, NULL, msg);
     printf("vertex shader info: %s\n", msg);
@@ -739,6 +3015,8 @@ init_gl(struct window *window)
     glAttachShader(program, f);
     glBindAttribLocation(program, 0, "position");
     glBindAttribLocation(program, 1, "normal");
+    glBindAttribLocation(program, 2, "gear");
+    glBindAttribLocation(program, 3, "offset");
 
 
     glLinkProgram(program);
@@ -753,15 +3031,91 @@ init_gl(struct window *window)
     NormalMatrix_location = glGetUniformLocation(program, "NormalMatrix");
     LightSourcePosition_location = glGetUniformLocation(program, "LightSourcePosition");
     MaterialColor_location = glGetUniformLocation(program, "MaterialColor");
+    ModelViewProjectionMatrices_location = glGetUniformLocation(program, "ModelViewProjectionMatrices");
+    NormalMatrices_location = glGetUniformLocation(program, "NormalMatrices");
+    ViewProjectionMatrix_location = glGetUniformLocation(program, "ViewProjectionMatrix");
+    TrainOffsets_location = glGetUniformLocation(program, "TrainOffsets");
 
     /* Set the LightSourcePosition uniform which is constant throught the program */
     glUniform4fv(LightSourcePosition_location, 1, LightSourcePosition);
 
     /* make the gears */
-    gear1 = create_gear(1.0, 4.0, 1.0, 20, 0.7);
-    gear2 = create_gear(0.5, 2.0, 2.0, 10, 0.7);
-    gear3 = create_gear(1.3, 2.0, 0.5, 10, 0.7);
+    init_vertex_layout();
+    create_gears();
+    for (lod = 0; lod < GEAR_LODS; lod++)
+        for (g = 0; g < SCENE_GEARS; g++)
+            upload_gear(gears[lod][g]);
+
+    if (draw_mode == DRAW_BATCHED || draw_mode == DRAW_INSTANCED) {
+        create_batch(batch_trains);
+
+        /* Nothing else is drawn, so this state is set once for good */
+        batch.bound_lod = -1;
+        bind_batch_lod(0);
+        glEnableVertexAttribArray(0);
+        glEnableVertexAttribArray(1);
+        glEnableVertexAttribArray(2);
+
+        if (draw_mode == DRAW_INSTANCED) {
+            /* Trains changing level reorder the offsets */
+            glGenBuffers(1, &batch.offsets);
+            glBindBuffer(GL_ARRAY_BUFFER, batch.offsets);
+            glBufferData(GL_ARRAY_BUFFER, ntrains * sizeof(*train_offsets), NULL,
+                         forced_lod < 0 ? GL_DYNAMIC_DRAW : GL_STATIC_DRAW);
+            glVertexAttribPointer(3, 2, GL_FLOAT, GL_FALSE, 0, NULL);
+            glEnableVertexAttribArray(3);
+            vertex_attrib_divisor(3, 1);
+        }
+
+        glUniform4fv(glGetUniformLocation(program, "MaterialColors"), SCENE_GEARS,
+                     gear_colors[0]);
+    }
+
+    vertices_per_frame = 0;
+    for (g = 0; g < SCENE_GEARS; g++) {
+        if (draw_mode == DRAW_STRIPS)
+            vertices_per_frame += gears[0][g]->nvertices;
+        else
+            vertices_per_frame += gears[0][g]->nindices;
+    }
+    vertices_per_frame *= ntrains;
+
+    switch (draw_mode) {
+    case DRAW_STRIPS:
+        draws_per_frame = (long) ntrains * (gears[0][0]->nstrips + gears[0][1]->nstrips + gears[0][2]->nstrips);
+        printf("drawing per strip");
+        break;
+    case DRAW_BATCHED:
+        draws_per_frame = (ntrains + batch_trains - 1) / batch_trains;
+        printf("drawing batched, %d trains per draw", batch_trains);
+        break;
+    case DRAW_INSTANCED:
+        draws_per_frame = 1;
+        printf("drawing instanced");
+        break;
+    default:
+        draws_per_frame = (long) ntrains * SCENE_GEARS;
+        printf("drawing indexed");
+        break;
+    }
+    printf(": %d trains, %ld draw calls and %ld vertices per frame\n",
+           ntrains, draws_per_frame, vertices_per_frame);
+
+    report_vertex_layout();
 
+    if (free_arrays) {
+        long freed = 0;
+
+        for (lod = 0; lod < GEAR_LODS; lod++)
+            for (g = 0; g < SCENE_GEARS; g++)
+                freed += free_gear_arrays(gears[lod][g]);
+        printf("freed %ld bytes of client side geometry\n", freed);
+    }
+
+    gpu_timer_init(&gpu_timer);
+    clear_pass = gpu_timer_add_pass(&gpu_timer, "clear");
+    gears_pass = gpu_timer_add_pass(&gpu_timer, "gears");
+    printf("gpu timing: %s\n", gpu_timer_mode_name(&gpu_timer));
 }
 
 static void
@@ -777,6 +3131,9 @@ handle_configure(void *data, struct wl_shell_surface *shell_surface,
 {
     struct window *window = data;
 
+    if (width != window->geometry.width || height != window->geometry.height)
+        window->surface_state_dirty = 1;
+
     if (window->native)
         wl_egl_window_resize(window->native, width, height, 0, 0);
 
@@ -821,6 +3178,7 @@ set_fullscreen(struct window *window, int fullscreen)
 
     window->fullscreen = fullscreen;
     window->configured = 0;
+    window->surface_state_dirty = 1;
 
     if (fullscreen) {
         wl_shell_surface_set_fullscreen(window->shell_surface,
@@ -840,6 +3198,147 @@ set_fullscreen(struct window *window, int fullscreen)
     }
 }
 
+static void
+buffer_release(void *data, struct wl_buffer *wl_buffer)
+{
+    struct shm_buffer *buffer = data;
+
+    buffer->busy = 0;
+    buffer->window->events++;
+}
+
+static const struct wl_buffer_listener buffer_listener = {
+    buffer_release
+};
+
+/**
+ * Creates an unlinked file of size bytes in XDG_RUNTIME_DIR, to share
+ * with the compositor.
+ *
+ * @return the file descriptor, or -1 on failure
+ */
+static int
+create_anonymous_file(off_t size)
+{
+    static const char template[] = "/es2gears-shm-XXXXXX";
+    const char *dir = getenv("XDG_RUNTIME_DIR");
+    char *name;
+    int fd;
+
+    if (!dir)
+        return -1;
+
+    name = malloc(strlen(dir) + sizeof(template));
+    if (!name)
+        return -1;
+    strcpy(name, dir);
+    strcat(name, template);
+
+    fd = mkstemp(name);
+    if (fd >= 0) {
+        unlink(name);
+        if (ftruncate(fd, size) < 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+
+    free(name);
+    return fd;
+}
+
+/**
+ * Creates a wl_shm buffer the size of the window.
+ *
+ * @param window the window
+ * @param buffer the buffer to fill in
+ *
+ * @return 0 on success, -1 on failure
+ */
+static int
+create_shm_buffer(struct window *window, struct shm_buffer *buffer)
+{
+    struct wl_shm_pool *pool;
+    int width = window->geometry.width, height = window->geometry.height;
+    int stride = width * 4, size = stride * height;
+    void *pixels;
+    int fd;
+
+    fd = create_anonymous_file(size);
+    if (fd < 0) {
+        fprintf(stderr, "failed to create a %d byte buffer file\n", size);
+        return -1;
+    }
+
+    pixels = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (pixels == MAP_FAILED) {
+        fprintf(stderr, "failed to map a %d byte buffer\n", size);
+        close(fd);
+        return -1;
+    }
+
+    /* The gears are drawn premultiplied, as ARGB8888 wants them */
+    pool = wl_shm_create_pool(window->display->shm, fd, size);
+    buffer->buffer = wl_shm_pool_create_buffer(pool, 0, width, height, stride,
+                                               window->opaque ?
+                                               WL_SHM_FORMAT_XRGB8888 :
+                                               WL_SHM_FORMAT_ARGB8888);
+    wl_buffer_add_listener(buffer->buffer, &buffer_listener, buffer);
+    wl_shm_pool_destroy(pool);
+    close(fd);
+    window->requests += 3;
+
+    buffer->window = window;
+    buffer->pixels = pixels;
+    buffer->width = width;
+    buffer->height = height;
+    buffer->size = size;
+    buffer->busy = 0;
+    return 0;
+}
+
+static void
+destroy_shm_buffer(struct shm_buffer *buffer)
+{
+    if (buffer->buffer) {
+        wl_buffer_destroy(buffer->buffer);
+        munmap(buffer->pixels, buffer->size);
+    }
+    memset(buffer, 0, sizeof(*buffer));
+}
+
+/**
+ * Finds a buffer the compositor is done with, the size of the window,
+ * creating or replacing one as needed.
+ *
+ * @param window the window
+ *
+ * @return the buffer, or NULL if they are all busy
+ */
+static struct shm_buffer *
+next_shm_buffer(struct window *window)
+{
+    int i;
+
+    for (i = 0; i < SHM_BUFFERS; i++) {
+        struct shm_buffer *buffer = &window->shm_buffers[i];
+
+        if (buffer->busy)
+            continue;
+
+        if (buffer->buffer && (buffer->width != window->geometry.width ||
+                               buffer->height != window->geometry.height)) {
+            destroy_shm_buffer(buffer);
+            window->requests++;
+        }
+        if (!buffer->buffer && create_shm_buffer(window, buffer) < 0)
+            return NULL;
+        return buffer;
+    }
+
+    return NULL;
+}
+
 static void
 create_surface(struct window *window)
 {
@@ -847,12 +3346,22 @@ create_surface(struct window *window)
     EGLBoolean ret;
 
     window->surface = wl_compositor_create_surface(display->compositor);
+    window->buffer_scale = 1;
+    window->surface_state_dirty = 1;
     window->shell_surface = wl_shell_get_shell_surface(display->shell,
                                                        window->surface);
 
     wl_shell_surface_add_listener(window->shell_surface,
                                   &shell_surface_listener, window);
 
+    wl_shell_surface_set_title(window->shell_surface, "simple-egl");
+
+    /* The software renderer brings its own wl_shm buffers */
+    if (soft_renderer) {
+        set_fullscreen(window, window->fullscreen);
+        return;
+    }
+
     window->native =
             wl_egl_window_create(window->surface,
                                  window->window_size.width,
@@ -862,54 +3371,443 @@ create_surface(struct window *window)
                                    display->egl.conf,
                                    window->native, NULL);
 
-    wl_shell_surface_set_title(window->shell_surface, "simple-egl");
-
     ret = eglMakeCurrent(window->display->egl.dpy, window->egl_surface,
                          window->egl_surface, window->display->egl.ctx);
     assert(ret == EGL_TRUE);
 
-    if (!window->frame_sync)
+    /* With frame callbacks, they alone pace the drawing */
+    if (!window->frame_sync || window->frame_callbacks)
         eglSwapInterval(display->egl.dpy, 0);
 
-    set_fullscreen(window, window->fullscreen);
+    set_fullscreen(window, window->fullscreen);
+}
+
+static void
+destroy_surface(struct window *window)
+{
+    int i;
+
+    for (i = 0; i < SHM_BUFFERS; i++)
+        destroy_shm_buffer(&window->shm_buffers[i]);
+
+    if (!soft_renderer) {
+        /* Required, otherwise segfault in egl_dri2.c: dri2_make_current()
+         * on eglReleaseThread(). */
+        eglMakeCurrent(window->display->egl.dpy, EGL_NO_SURFACE, EGL_NO_SURFACE,
+                       EGL_NO_CONTEXT);
+
+        eglDestroySurface(window->display->egl.dpy, window->egl_surface);
+        wl_egl_window_destroy(window->native);
+    }
+
+    wl_shell_surface_destroy(window->shell_surface);
+    wl_surface_destroy(window->surface);
+
+    if (window->callback)
+        wl_callback_destroy(window->callback);
+}
+
+static const struct wl_callback_listener frame_listener;
+
+static void
+calc_gear_angle(uint32_t time)
+{
+   static double tRot0 = -1.0;
+   double dt, t = time / 1000.0;
+
+   if (tRot0 < 0.0)
+      tRot0 = t;
+   dt = t - tRot0;
+   tRot0 = t;
+
+   /* advance rotation for next frame */
+   angle += 70.0 * dt;  /* 70 degrees per second */
+   if (angle > 3600.0)
+      angle -= 3600.0;
+
+}
+
+/**
+ * Returns the CPU time used by the process so far, all threads included.
+ */
+static double
+cpu_time_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+/**
+ * Returns the CPU time used by the calling thread so far.
+ */
+static double
+thread_cpu_time_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+/**
+ * Returns the time on the clock the compositor reports presentation in.
+ */
+static double
+presentation_time_ms(struct display *display)
+{
+    struct timespec ts;
+
+    clock_gettime(display->presentation_clock, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+/**
+ * Converts an input event timestamp to the presentation clock.
+ *
+ * Input timestamps are in milliseconds with an undefined base; compositors
+ * like weston take them from CLOCK_MONOTONIC, which lets the time the event
+ * spent queued count towards its latency. When that does not fit, the time
+ * it is handled is used instead.
+ *
+ * @param display the display
+ * @param time the event timestamp
+ *
+ * @return the time of the event, on the presentation clock
+ */
+static double
+input_time_ms(struct display *display, uint32_t time)
+{
+    double now = presentation_time_ms(display);
+    uint32_t age = (uint32_t) (uint64_t) now - time;
+
+    if (display->presentation_clock == CLOCK_MONOTONIC && age < 1000)
+        return floor(now) - age;
+
+    return now;
+}
+
+/**
+ * Starts changing the input snapshot. Only one thread may write it.
+ *
+ * @param snapshot the input snapshot
+ *
+ * @return the state to change
+ */
+static struct input_state *
+input_write_begin(struct input_snapshot *snapshot)
+{
+    atomic_fetch_add_explicit(&snapshot->seq, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    return &snapshot->state;
+}
+
+static void
+input_write_end(struct input_snapshot *snapshot)
+{
+    atomic_fetch_add_explicit(&snapshot->seq, 1, memory_order_release);
+}
+
+/**
+ * Records a pointer or touch position.
+ *
+ * @param display the display
+ * @param time the event timestamp
+ * @param x the surface x coordinate
+ * @param y the surface y coordinate
+ */
+static void
+input_set_position(struct display *display, uint32_t time, wl_fixed_t x, wl_fixed_t y)
+{
+    double time_ms = input_time_ms(display, time);
+    struct input_state *state = input_write_begin(&display->input);
+
+    state->x = wl_fixed_to_double(x);
+    state->y = wl_fixed_to_double(y);
+    state->time_ms = time_ms;
+    state->serial++;
+    input_write_end(&display->input);
+}
+
+/**
+ * Takes a consistent copy of the input state.
+ *
+ * @param snapshot the input snapshot
+ * @param[out] state the copy
+ */
+static void
+input_read(struct input_snapshot *snapshot, struct input_state *state)
+{
+    unsigned seq;
+
+    do {
+        seq = atomic_load_explicit(&snapshot->seq, memory_order_acquire);
+        *state = snapshot->state;
+        atomic_thread_fence(memory_order_acquire);
+    } while ((seq & 1) ||
+             seq != atomic_load_explicit(&snapshot->seq, memory_order_relaxed));
+}
+
+/**
+ * A frame waiting for its presentation feedback.
+ */
+struct frame_feedback {
+    struct window *window;
+    struct wp_presentation_feedback *feedback;
+    /** When drawing the frame started, on the presentation clock */
+    double start_ms;
+    /** When the newest input it shows arrived, 0 if it shows none new */
+    double input_ms;
+};
+
+static void
+feedback_sync_output(void *data, struct wp_presentation_feedback *feedback,
+                     struct wl_output *output)
+{
+    struct frame_feedback *frame = data;
+
+    frame->window->events++;
+}
+
+static void
+feedback_presented(void *data, struct wp_presentation_feedback *feedback,
+                   uint32_t tv_sec_hi, uint32_t tv_sec_lo, uint32_t tv_nsec,
+                   uint32_t refresh_ns, uint32_t seq_hi, uint32_t seq_lo,
+                   uint32_t flags)
+{
+    struct frame_feedback *frame = data;
+    struct presentation_stats *stats = &frame->window->present;
+    double present_ms = (((uint64_t) tv_sec_hi << 32) + tv_sec_lo) * 1e3 + tv_nsec / 1e6;
+    uint64_t seq = ((uint64_t) seq_hi << 32) + seq_lo;
+    double latency_ms = present_ms - frame->start_ms;
+
+    frame->window->events++;
+    stats->presented++;
+    stats->latency_ms += latency_ms;
+    stats->max_latency_ms = fmax(stats->max_latency_ms, latency_ms);
+    if (frame->input_ms > 0) {
+        stats->input_frames++;
+        stats->input_latency_ms += present_ms - frame->input_ms;
+        stats->max_input_latency_ms = fmax(stats->max_input_latency_ms,
+                                           present_ms - frame->input_ms);
+    }
+    if (refresh_ns)
+        stats->refresh_ms = refresh_ns / 1e6;
+
+    if (stats->last_present_ms > 0) {
+        double interval_ms = present_ms - stats->last_present_ms;
+
+        stats->interval_ms += interval_ms;
+        stats->interval_sq_ms += interval_ms * interval_ms;
+        stats->intervals++;
+
+        /*
+         * Refresh cycles that went by without a new frame. The vblank
+         * counter is exact; without one, go by the refresh rate.
+         */
+        if (seq && stats->last_seq && seq > stats->last_seq)
+            stats->missed += seq - stats->last_seq - 1;
+        else if (stats->refresh_ms > 0)
+            stats->missed += fmax(floor(interval_ms / stats->refresh_ms + 0.5) - 1, 0);
+    }
+    stats->last_present_ms = present_ms;
+    stats->last_seq = seq;
+
+    wp_presentation_feedback_destroy(feedback);
+    free(frame);
+}
+
+static void
+feedback_discarded(void *data, struct wp_presentation_feedback *feedback)
+{
+    struct frame_feedback *frame = data;
+
+    frame->window->events++;
+    frame->window->present.discarded++;
+    wp_presentation_feedback_destroy(feedback);
+    free(frame);
+}
+
+static const struct wp_presentation_feedback_listener feedback_listener = {
+    feedback_sync_output,
+    feedback_presented,
+    feedback_discarded
+};
+
+/**
+ * Asks for presentation feedback on the frame about to be committed.
+ *
+ * @param window the window
+ * @param start_ms when drawing the frame started, on the presentation clock
+ * @param input_ms when the new input the frame shows arrived, or 0
+ */
+static void
+request_feedback(struct window *window, double start_ms, double input_ms)
+{
+    struct display *display = window->display;
+    struct frame_feedback *frame;
+
+    if (!display->presentation)
+        return;
+
+    frame = calloc(1, sizeof(*frame));
+    if (!frame)
+        return;
+
+    frame->window = window;
+    frame->start_ms = start_ms;
+    frame->input_ms = input_ms;
+    frame->feedback = wp_presentation_feedback(display->presentation, window->surface);
+    wp_presentation_feedback_add_listener(frame->feedback, &feedback_listener, frame);
+    window->requests++;
+}
+
+/**
+ * Prints what the presentation feedback of a report interval says, then
+ * starts over, keeping the last presentation to measure the next one from.
+ *
+ * @param stats the presentation statistics
+ */
+static void
+print_presentation_stats(struct presentation_stats *stats)
+{
+    double mean_ms, jitter_ms;
+
+    if (stats->presented) {
+        mean_ms = stats->intervals ? stats->interval_ms / stats->intervals : 0;
+        jitter_ms = stats->intervals ?
+                sqrt(fmax(stats->interval_sq_ms / stats->intervals - mean_ms * mean_ms, 0)) : 0;
+
+        printf("presented %d frames, %d discarded, %d refreshes missed (%.2f ms refresh)\n",
+               stats->presented, stats->discarded, stats->missed, stats->refresh_ms);
+        printf("presentation latency %.2f ms, max %.2f ms; %.2f ms between frames, %.2f ms jitter\n",
+               stats->latency_ms / stats->presented, stats->max_latency_ms,
+               mean_ms, jitter_ms);
+        if (stats->input_frames)
+            printf("input to presentation %.2f ms, max %.2f ms, over %d frames\n",
+                   stats->input_latency_ms / stats->input_frames,
+                   stats->max_input_latency_ms, stats->input_frames);
+    } else if (stats->discarded) {
+        printf("presentation: all %d frames discarded\n", stats->discarded);
+    }
+
+    stats->presented = stats->discarded = stats->missed = 0;
+    stats->latency_ms = stats->max_latency_ms = 0;
+    stats->input_frames = 0;
+    stats->input_latency_ms = stats->max_input_latency_ms = 0;
+    stats->interval_ms = stats->interval_sq_ms = 0;
+    stats->intervals = 0;
 }
 
+/**
+ * Sends what changed of the surface state since it was last sent, to go
+ * with the next commit: the opaque region, the input region and the
+ * buffer scale. Only configures and fullscreen toggles change them, so
+ * most frames send nothing.
+ *
+ * @param window the window
+ */
 static void
-destroy_surface(struct window *window)
+update_surface_state(struct window *window)
 {
-    /* Required, otherwise segfault in egl_dri2.c: dri2_make_current()
-     * on eglReleaseThread(). */
-    eglMakeCurrent(window->display->egl.dpy, EGL_NO_SURFACE, EGL_NO_SURFACE,
-                   EGL_NO_CONTEXT);
+    struct surface_state *state = &window->surface_state;
+    struct geometry opaque = { 0, 0 };
+    long requests = window->requests;
 
-    eglDestroySurface(window->display->egl.dpy, window->egl_surface);
-    wl_egl_window_destroy(window->native);
+    if (!window->surface_state_dirty)
+        return;
+    window->surface_state_dirty = 0;
+
+    if (window->opaque || window->fullscreen)
+        opaque = window->geometry;
+
+    if (!state->sent || opaque.width != state->opaque.width ||
+        opaque.height != state->opaque.height) {
+        if (opaque.width > 0 && opaque.height > 0) {
+            struct wl_region *region;
+
+            region = wl_compositor_create_region(window->display->compositor);
+            wl_region_add(region, 0, 0, opaque.width, opaque.height);
+            wl_surface_set_opaque_region(window->surface, region);
+            wl_region_destroy(region);
+            window->requests += 4;
+        } else {
+            wl_surface_set_opaque_region(window->surface, NULL);
+            window->requests++;
+        }
+        state->opaque = opaque;
+    }
 
-    wl_shell_surface_destroy(window->shell_surface);
-    wl_surface_destroy(window->surface);
+    /* Input goes to the whole surface, whatever its size */
+    if (!state->sent) {
+        wl_surface_set_input_region(window->surface, NULL);
+        window->requests++;
+    }
 
-    if (window->callback)
-        wl_callback_destroy(window->callback);
-}
+    if ((!state->sent || window->buffer_scale != state->buffer_scale) &&
+        window->display->compositor_version >= WL_SURFACE_SET_BUFFER_SCALE_SINCE_VERSION) {
+        wl_surface_set_buffer_scale(window->surface, window->buffer_scale);
+        window->requests++;
+    }
+    state->buffer_scale = window->buffer_scale;
 
-static const struct wl_callback_listener frame_listener;
+    state->sent = 1;
+    window->state_requests += window->requests - requests;
+}
 
-static void
-calc_gear_angle(uint32_t time)
+/**
+ * Draws a frame with the software renderer into a wl_shm buffer and
+ * commits it, asking for a frame callback for the next one.
+ *
+ * @param window the window
+ * @param params what to draw the latest frame from
+ * @param start_ms when the frame was started, on the presentation clock
+ *
+ * @return whether a frame was drawn; not when all buffers are busy
+ */
+static int
+redraw_software(struct window *window, const struct frame_params *params,
+                double start_ms)
 {
-   static double tRot0 = -1.0;
-   double dt, t = time / 1000.0;
-
-   if (tRot0 < 0.0)
-      tRot0 = t;
-   dt = t - tRot0;
-   tRot0 = t;
-
-   /* advance rotation for next frame */
-   angle += 70.0 * dt;  /* 70 degrees per second */
-   if (angle > 3600.0)
-      angle -= 3600.0;
-
+    struct shm_buffer *buffer = next_shm_buffer(window);
+    struct frame_packet *packet;
+    struct soft_stats stats;
+    struct timespec draw_start, draw_end;
+    struct geometry size;
+
+    /* A release will come and get the main loop going again */
+    if (!buffer)
+        return 0;
+
+    packet = next_frame(params);
+    clock_gettime(CLOCK_MONOTONIC, &draw_start);
+
+    size.width = buffer->width;
+    size.height = buffer->height;
+    soft_draw_scene(packet, &size, buffer->pixels, buffer->width * 4, &stats);
+
+    clock_gettime(CLOCK_MONOTONIC, &draw_end);
+    window->draw_ms += elapsed_ms(&draw_start, &draw_end);
+    window->prepare_ms += packet->prepare_ms;
+    window->lod_vertices += lod_vertices;
+    window->soft_stats.triangles += stats.triangles;
+    window->soft_stats.visible += stats.visible;
+    window->soft_stats.geometry_ms += stats.geometry_ms;
+    window->soft_stats.raster_ms += stats.raster_ms;
+
+    update_surface_state(window);
+    wl_surface_attach(window->surface, buffer->buffer, 0, 0);
+    wl_surface_damage(window->surface, 0, 0, buffer->width, buffer->height);
+    window->callback = wl_surface_frame(window->surface);
+    wl_callback_add_listener(window->callback, &frame_listener, window);
+    request_feedback(window, start_ms, packet->params.input_ms);
+    wl_surface_commit(window->surface);
+    window->requests += 4;
+    buffer->busy = 1;
+    report_first_frame();
+
+    return 1;
 }
 
 static void
@@ -920,38 +3818,118 @@ redraw(void *data, struct wl_callback *callback, uint32_t time)
     struct display *display = window->display;
     static const int32_t speed_div = 5, benchmark_interval = 5;
 
-    struct wl_region *region;
-    EGLint rect[4];
+    struct damage frame_damage;
+    EGLint repaint[4];
     EGLint buffer_age = 0;
     struct timeval tv;
+    double start_ms = presentation_time_ms(display);
+    double input_ms = 0;
+    struct input_state input;
+    struct frame_params params;
+    struct frame_packet *packet;
+    GLfloat tilt[2] = { 0, 0 };
 
     assert(window->callback == callback);
     window->callback = NULL;
 
-    if (callback)
+    if (callback) {
         wl_callback_destroy(callback);
+        window->events++;
+    }
+
+    input_read(&display->input, &input);
+    if (input.fullscreen_toggles != window->fullscreen_toggles) {
+        window->fullscreen_toggles = input.fullscreen_toggles;
+        set_fullscreen(window, window->fullscreen ^ 1);
+    }
 
     if (!window->configured)
         return;
 
+    /* The pointer or touch point tilts the view, up to 30 degrees each way */
+    if (input.serial) {
+        tilt[0] = (input.y / window->geometry.height - 0.5) * 60;
+        tilt[1] = (input.x / window->geometry.width - 0.5) * 60;
+    }
+    if (input.serial != window->input_serial) {
+        window->input_serial = input.serial;
+        input_ms = input.time_ms;
+    }
+
     gettimeofday(&tv, NULL);
     time = tv.tv_sec * 1000 + tv.tv_usec / 1000;
 
     calc_gear_angle(time);
     view_rot[1] -= 0.2;
 
-    if (window->frames == 0)
+    if (window->frames == 0) {
         window->benchmark_time = time;
+        window->benchmark_cpu_ms = cpu_time_ms();
+        window->draw_ms = 0;
+        window->repaint_fraction = window->damage_fraction = 0;
+        window->lod_vertices = 0;
+        window->prepare_ms = 0;
+        window->requests = window->events = window->state_requests = 0;
+        memset(&window->soft_stats, 0, sizeof(window->soft_stats));
+    }
 
     if (time - window->benchmark_time > (benchmark_interval * 1000)) {
+        double cpu_ms = cpu_time_ms();
+
         printf("%d frames in %d seconds: %f fps\n",
                window->frames,
                benchmark_interval,
                (float) window->frames / benchmark_interval);
+        printf("%d trains: %.3f ms cpu/frame, %.3f ms of it drawing and %.3f ms "
+               "preparing%s, %.2f Mvertices/s\n",
+               ntrains,
+               (cpu_ms - window->benchmark_cpu_ms) / window->frames,
+               window->draw_ms / window->frames,
+               window->prepare_ms / window->frames,
+               pipeline.threaded ? " on the worker thread" : "",
+               (double) window->lod_vertices / benchmark_interval / 1e6);
+        printf("lod: %ld vertices per frame, %ld (%.1f%%) fewer than at full detail\n",
+               window->lod_vertices / window->frames,
+               vertices_per_frame - window->lod_vertices / window->frames,
+               100.0 - 100.0 * window->lod_vertices / window->frames / vertices_per_frame);
+        if (soft_renderer)
+            printf("software, %d threads: %.2f Mtriangles/s, %.1f%% of them drawn, "
+                   "%.3f ms setup and %.3f ms raster per frame\n",
+                   soft_renderer_threads(soft_renderer),
+                   window->soft_stats.triangles / (benchmark_interval * 1e6),
+                   100.0 * window->soft_stats.visible / window->soft_stats.triangles,
+                   window->soft_stats.geometry_ms / window->frames,
+                   window->soft_stats.raster_ms / window->frames);
+        else
+            printf("damage: %.1f%% of pixels repainted, %.1f%% reported to the compositor\n",
+                   100 * window->repaint_fraction / window->frames,
+                   100 * window->damage_fraction / window->frames);
+        printf("wayland: %.1f requests per frame, %.2f of them surface state%s, "
+               "%.1f events per frame\n",
+               (double) window->requests / window->frames,
+               (double) window->state_requests / window->frames,
+               soft_renderer ? "" : ", besides eglSwapBuffers'",
+               (double) window->events / window->frames);
+        print_presentation_stats(&window->present);
+        gpu_timer_print(&gpu_timer, stdout);
         window->benchmark_time = time;
+        window->benchmark_cpu_ms = cpu_ms;
+        window->draw_ms = 0;
+        window->repaint_fraction = window->damage_fraction = 0;
+        window->lod_vertices = 0;
+        window->prepare_ms = 0;
+        window->requests = window->events = window->state_requests = 0;
+        memset(&window->soft_stats, 0, sizeof(window->soft_stats));
         window->frames = 0;
     }
 
+    set_frame_params(window, tilt, input_ms, &params);
+
+    if (soft_renderer) {
+        if (redraw_software(window, &params, start_ms))
+            window->frames++;
+        return;
+    }
 
     if (display->swap_buffers_with_damage)
         eglQuerySurface(display->egl.dpy, window->egl_surface,
@@ -959,49 +3937,58 @@ redraw(void *data, struct wl_callback *callback, uint32_t time)
 
     glViewport(0, 0, window->geometry.width, window->geometry.height);
 
-    const static GLfloat red[4] = { 0.8, 0.1, 0.0, 1.0 };
-    const static GLfloat green[4] = { 0.0, 0.8, 0.2, 1.0 };
-    const static GLfloat blue[4] = { 0.2, 0.2, 1.0, 1.0 };
+    struct timespec draw_start, draw_end;
+
+    packet = next_frame(&params);
+    clock_gettime(CLOCK_MONOTONIC, &draw_start);
 
-    GLfloat transform[16];
-    identity(transform);
+    /* Only what the back buffer is missing gets cleared and redrawn */
+    update_damage(window, &packet->damage, buffer_age, &frame_damage, repaint);
+    glEnable(GL_SCISSOR_TEST);
+    glScissor(repaint[0], repaint[1], repaint[2], repaint[3]);
 
+    gpu_timer_frame_begin(&gpu_timer);
+
+    gpu_timer_pass_begin(&gpu_timer, clear_pass);
     glClearColor(0.0, 0.0, 0.0, 0.0);
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-    /* Translate and rotate the view */
-    translate(transform, 0, 0, -20);
-    rotate(transform, 2 * M_PI * view_rot[0] / 360.0, 1, 0, 0);
-    rotate(transform, 2 * M_PI * view_rot[1] / 360.0, 0, 1, 0);
-    rotate(transform, 2 * M_PI * view_rot[2] / 360.0, 0, 0, 1);
+    gpu_timer_pass_begin(&gpu_timer, gears_pass);
 
     /* Draw the gears */
-    draw_gear(gear1, transform, -3.0, -2.0, angle, red);
-    draw_gear(gear2, transform, 3.1, -2.0, -2 * angle - 9.0, green);
-    draw_gear(gear3, transform, -3.1, 4.2, -2 * angle - 25.0, blue);
-
-    if (window->opaque || window->fullscreen) {
-        region = wl_compositor_create_region(window->display->compositor);
-        wl_region_add(region, 0, 0,
-                      window->geometry.width,
-                      window->geometry.height);
-        wl_surface_set_opaque_region(window->surface, region);
-        wl_region_destroy(region);
-    } else {
-        wl_surface_set_opaque_region(window->surface, NULL);
+    draw_scene(packet);
+
+    glDisable(GL_SCISSOR_TEST);
+
+    clock_gettime(CLOCK_MONOTONIC, &draw_end);
+    window->draw_ms += elapsed_ms(&draw_start, &draw_end);
+    window->prepare_ms += packet->prepare_ms;
+    window->lod_vertices += lod_vertices;
+
+    gpu_timer_frame_end(&gpu_timer);
+
+    update_surface_state(window);
+
+    /*
+     * Both go with the commit eglSwapBuffers makes. Its own requests,
+     * attaching, damaging and committing, are not counted.
+     */
+    if (window->frame_callbacks) {
+        window->callback = wl_surface_frame(window->surface);
+        wl_callback_add_listener(window->callback, &frame_listener, window);
+        window->requests++;
     }
+    request_feedback(window, start_ms, packet->params.input_ms);
 
-    if (display->swap_buffers_with_damage && buffer_age > 0) {
-        rect[0] = window->geometry.width / 4 - 1;
-        rect[1] = window->geometry.height / 4 - 1;
-        rect[2] = window->geometry.width / 2 + 2;
-        rect[3] = window->geometry.height / 2 + 2;
+    if (display->swap_buffers_with_damage) {
         display->swap_buffers_with_damage(display->egl.dpy,
                                           window->egl_surface,
-                                          rect, 1);
+                                          frame_damage.rects[0],
+                                          frame_damage.nrects);
     } else {
         eglSwapBuffers(display->egl.dpy, window->egl_surface);
     }
+    report_first_frame();
 
     window->frames++;
 
@@ -1011,6 +3998,475 @@ static const struct wl_callback_listener frame_listener = {
     redraw
 };
 
+/** The simulation rate of the headless benchmark, in frames per second */
+#define BENCHMARK_HZ 60
+
+/**
+ * Creates the pbuffer the headless benchmark draws to, the size of the
+ * window.
+ *
+ * @param window the window
+ */
+static void
+create_headless_surface(struct window *window)
+{
+    struct display *display = window->display;
+    EGLint attribs[] = {
+        EGL_WIDTH, window->window_size.width,
+        EGL_HEIGHT, window->window_size.height,
+        EGL_NONE
+    };
+    EGLBoolean ret;
+
+    window->egl_surface = eglCreatePbufferSurface(display->egl.dpy,
+                                                  display->egl.conf, attribs);
+    if (window->egl_surface == EGL_NO_SURFACE) {
+        fprintf(stderr, "failed to create a %dx%d pbuffer\n",
+                window->window_size.width, window->window_size.height);
+        exit(EXIT_FAILURE);
+    }
+
+    ret = eglMakeCurrent(display->egl.dpy, window->egl_surface,
+                         window->egl_surface, display->egl.ctx);
+    assert(ret == EGL_TRUE);
+
+    window->geometry = window->window_size;
+    window->configured = 1;
+    perspective(ProjectionMatrix, 60.0,
+                window->geometry.width / (float) window->geometry.height, 1.0, 1024.0);
+}
+
+/**
+ * Returns the FNV-1a hash of the RGBA pixels of the framebuffer.
+ */
+static uint32_t
+framebuffer_checksum(const struct window *window)
+{
+    int size = window->geometry.width * window->geometry.height * 4;
+    GLubyte *pixels = malloc(size);
+    uint32_t hash = 2166136261u;
+    int i;
+
+    assert(pixels);
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    glReadPixels(0, 0, window->geometry.width, window->geometry.height,
+                 GL_RGBA, GL_UNSIGNED_BYTE, pixels);
+    for (i = 0; i < size; i++)
+        hash = (hash ^ pixels[i]) * 16777619u;
+    free(pixels);
+
+    return hash;
+}
+
+/**
+ * Returns the same hash as framebuffer_checksum() of a frame drawn by
+ * the software renderer, as glReadPixels() would read it.
+ */
+static uint32_t
+software_checksum(const uint32_t *pixels, const struct geometry *size)
+{
+    uint32_t hash = 2166136261u;
+    int x, y, c;
+
+    for (y = size->height - 1; y >= 0; y--) {
+        for (x = 0; x < size->width; x++) {
+            uint32_t argb = pixels[(long) y * size->width + x];
+            const uint8_t rgba[4] = { argb >> 16, argb >> 8, argb, argb >> 24 };
+
+            for (c = 0; c < 4; c++)
+                hash = (hash ^ rgba[c]) * 16777619u;
+        }
+    }
+
+    return hash;
+}
+
+static int
+compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * Returns the nearest-rank percentile of sorted values.
+ */
+static double
+percentile(const double *sorted, int n, double p)
+{
+    int rank = ceil(p / 100 * n);
+
+    return sorted[rank < 1 ? 0 : rank > n ? n - 1 : rank - 1];
+}
+
+/**
+ * Prints a string as a quoted JSON string, escaping what JSON needs
+ * escaped, for strings such as GL_RENDERER that come from elsewhere.
+ */
+static void
+print_json_string(const char *s)
+{
+    putchar('"');
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\')
+            printf("\\%c", *s);
+        else if ((unsigned char) *s < 0x20)
+            printf("\\u%04x", (unsigned char) *s);
+        else
+            putchar(*s);
+    }
+    putchar('"');
+}
+
+/**
+ * Sets what frame i of the benchmark is drawn from. The animation steps
+ * 1/BENCHMARK_HZ second per frame from where it was when the benchmark
+ * started, however far ahead the frame is prepared.
+ */
+static void
+benchmark_params(const struct window *window, int i, GLfloat start_angle,
+                 GLfloat start_rot, struct frame_params *params)
+{
+    static const GLfloat no_tilt[2] = { 0, 0 };
+
+    /* 70 degrees per second, as calc_gear_angle() turns them */
+    angle = fmod(start_angle + 70.0 * i / BENCHMARK_HZ, 3600.0);
+    view_rot[1] = start_rot - 0.2 * (i + 1);
+    set_frame_params(window, no_tilt, 0, params);
+    params->damage = 0;
+}
+
+/**
+ * Runs the headless benchmark and prints its report as one line of JSON.
+ *
+ * The simulation advances a fixed 1/BENCHMARK_HZ second per frame whatever
+ * the frames take, so a given number of frames always ends on the same
+ * picture: the checksum of the last one guards correctness. Each frame is
+ * timed up to glFinish(), so it includes the GPU's work; its CPU time is
+ * split into preparing it, the matrix maths, and the GL submission. With
+ * the pipeline's worker thread, frames are prepared one ahead on it, and
+ * the render thread's own CPU time is what that leaves.
+ *
+ * With the software renderer, frames are drawn to memory instead, and
+ * the report adds its thread count and triangle throughput. The
+ * animation and levels of detail start over on every run, so runs with
+ * different thread counts draw the same frames and end on the same
+ * checksum.
+ *
+ * @param window the window, with its pbuffer current unless drawing in
+ * software
+ * @param frames the number of frames to time, or 0 to go by duration
+ * @param duration how long to time frames for, in seconds, if frames is 0
+ * @param warmup the number of frames to draw before timing any
+ * @param[out] mean_ms the mean frame time, if not NULL
+ *
+ * @return the exit status
+ */
+static int
+run_benchmark(struct window *window, int frames, double duration, int warmup,
+              double *mean_ms)
+{
+    static const char *mode_names[] = {
+        "default", "indexed", "strips", "batched", "instanced"
+    };
+    double *frame_ms = NULL;
+    int capacity = 0, n = 0, i;
+    double cpu_ms = 0, render_ms = 0, draw_ms = 0, prepare_ms = 0, total_ms = 0;
+    double sum_ms = 0, cpu_start_ms, render_start_ms;
+    struct timespec start, draw_start, draw_end, end, bench_start;
+    struct frame_params params;
+    const struct frame_packet *packet;
+    GLfloat start_angle = angle, start_rot = view_rot[1];
+    uint32_t *pixels = NULL;
+    struct soft_stats stats, soft_total = { 0 };
+    long lod_total = 0;
+    char renderer[64], lod_name[16];
+    uint32_t checksum;
+
+    if (soft_renderer) {
+        pixels = malloc((long) window->geometry.width * window->geometry.height *
+                        sizeof(*pixels));
+        assert(pixels);
+        snprintf(renderer, sizeof renderer, "software (%s)",
+                 soft_renderer_implementation());
+    } else {
+        glViewport(0, 0, window->geometry.width, window->geometry.height);
+        glClearColor(0.0, 0.0, 0.0, 0.0);
+        snprintf(renderer, sizeof renderer, "%s", (const char *) glGetString(GL_RENDERER));
+    }
+
+    /* Levels of detail start over too, not at the last run's */
+    memset(lod_levels, forced_lod > 0 ? forced_lod : 0, ntrains * sizeof(*lod_levels));
+    lod_generation++;
+
+    for (i = 0; ; i++) {
+        if (i == warmup)
+            clock_gettime(CLOCK_MONOTONIC, &bench_start);
+        if (i >= warmup) {
+            if (frames > 0 ? n >= frames : total_ms >= duration * 1e3)
+                break;
+            if (n == capacity) {
+                capacity = capacity ? capacity * 2 : 1024;
+                frame_ms = realloc(frame_ms, capacity * sizeof(*frame_ms));
+                assert(frame_ms);
+            }
+        }
+
+        cpu_start_ms = cpu_time_ms();
+        render_start_ms = thread_cpu_time_ms();
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        /*
+         * Frame i is prepared ahead while frame i - 1 is drawn; both
+         * step the animation as if they were drawn in turn.
+         */
+        if (pipeline.head == pipeline.tail) {
+            benchmark_params(window, i, start_angle, start_rot, &params);
+            pipeline_queue(&params);
+        }
+        packet = pipeline_take();
+        if (pipeline.threaded) {
+            benchmark_params(window, i + 1, start_angle, start_rot, &params);
+            pipeline_queue(&params);
+        }
+
+        if (soft_renderer) {
+            clock_gettime(CLOCK_MONOTONIC, &draw_start);
+            soft_draw_scene(packet, &window->geometry, pixels,
+                            window->geometry.width * 4, &stats);
+            clock_gettime(CLOCK_MONOTONIC, &draw_end);
+        } else {
+            glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+            clock_gettime(CLOCK_MONOTONIC, &draw_start);
+            draw_scene(packet);
+            clock_gettime(CLOCK_MONOTONIC, &draw_end);
+            glFinish();
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        report_first_frame();
+
+        if (i >= warmup) {
+            frame_ms[n] = elapsed_ms(&start, &end);
+            sum_ms += frame_ms[n];
+            n++;
+            draw_ms += elapsed_ms(&draw_start, &draw_end);
+            prepare_ms += packet->prepare_ms;
+            cpu_ms += cpu_time_ms() - cpu_start_ms;
+            render_ms += thread_cpu_time_ms() - render_start_ms;
+            total_ms = elapsed_ms(&bench_start, &end);
+            lod_total += lod_vertices;
+            if (soft_renderer) {
+                soft_total.triangles += stats.triangles;
+                soft_total.visible += stats.visible;
+                soft_total.geometry_ms += stats.geometry_ms;
+                soft_total.raster_ms += stats.raster_ms;
+            }
+        }
+    }
+
+    if (soft_renderer)
+        checksum = software_checksum(pixels, &window->geometry);
+    else
+        checksum = framebuffer_checksum(window);
+    if (pipeline.head != pipeline.tail)
+        pipeline_take();
+    angle = start_angle;
+    view_rot[1] = start_rot;
+    free(pixels);
+
+    if (n == 0) {
+        fprintf(stderr, "no frames timed\n");
+        free(frame_ms);
+        return EXIT_FAILURE;
+    }
+
+    qsort(frame_ms, n, sizeof(*frame_ms), compare_doubles);
+
+    if (forced_lod >= 0)
+        snprintf(lod_name, sizeof lod_name, "%d", forced_lod);
+    else
+        snprintf(lod_name, sizeof lod_name, "auto");
+
+    printf("{\"renderer\": ");
+    print_json_string(renderer);
+    printf(", \"mode\": \"%s\", \"trains\": %d, "
+           "\"width\": %d, \"height\": %d, \"vertices_per_frame\": %ld, "
+           "\"draws_per_frame\": %ld, \"simulation_hz\": %d, "
+           "\"warmup_frames\": %d, \"frames\": %d, \"seconds\": %.3f, "
+           "\"frame_ms\": {\"min\": %.4f, \"p50\": %.4f, \"p95\": %.4f, "
+           "\"p99\": %.4f, \"max\": %.4f, \"mean\": %.4f}, "
+           "\"cpu_ms_per_frame\": {\"total\": %.4f, \"render_thread\": %.4f, "
+           "\"matrix\": %.4f, \"submit\": %.4f}, \"pipelined\": %s, "
+           "\"startup_ms\": {\"first_frame\": %.3f, \"gears\": %.3f}, \"gears_cached\": %d, ",
+           soft_renderer ? "software" : mode_names[draw_mode], ntrains,
+           window->geometry.width, window->geometry.height, vertices_per_frame,
+           draws_per_frame, BENCHMARK_HZ, warmup, n, total_ms / 1e3,
+           frame_ms[0], percentile(frame_ms, n, 50), percentile(frame_ms, n, 95),
+           percentile(frame_ms, n, 99), frame_ms[n - 1], sum_ms / n,
+           cpu_ms / n, render_ms / n, prepare_ms / n, draw_ms / n,
+           pipeline.threaded ? "true" : "false",
+           first_frame_ms, gears_ms, gears_cached);
+    if (soft_renderer)
+        printf("\"software\": {\"threads\": %d, \"triangles_per_frame\": %ld, "
+               "\"visible_per_frame\": %ld, \"setup_ms\": %.4f, \"raster_ms\": %.4f, "
+               "\"mtriangles_per_s\": %.3f}, ",
+               soft_renderer_threads(soft_renderer), soft_total.triangles / n,
+               soft_total.visible / n, soft_total.geometry_ms / n,
+               soft_total.raster_ms / n, soft_total.triangles / (sum_ms * 1e3));
+    printf("\"lod\": {\"level\": \"%s\", \"vertices_per_frame\": %ld, "
+           "\"saved_per_frame\": %ld}, ",
+           lod_name, lod_total / n, vertices_per_frame - lod_total / n);
+    if (!soft_renderer) {
+        struct egl_config_info info;
+        char format[32];
+
+        get_egl_config_info(window->display->egl.dpy, window->display->egl.conf, &info);
+        egl_config_format(&info, format, sizeof format);
+        printf("\"egl_config\": {\"id\": %d, \"format\": \"%s\", \"depth\": %d, "
+               "\"samples\": %d}, ", info.id, format, info.depth, info.samples);
+    }
+    printf("\"checksum\": \"%08x\"}\n", checksum);
+
+    if (mean_ms)
+        *mean_ms = sum_ms / n;
+    free(frame_ms);
+    return EXIT_SUCCESS;
+}
+
+/** Frames --tune-egl times each config for, unless told otherwise */
+#define TUNE_FRAMES 120
+
+/**
+ * Runs the headless benchmark on every EGL config es2gears can draw with,
+ * printing a JSON report for each, then ranks them by mean frame time in
+ * a table and remembers the fastest for this renderer in the cache, for
+ * init_egl() to use for windows from then on.
+ *
+ * Configs that differ only in what the gears do not use, like stencil,
+ * are timed once. One context, made without a config, draws to a pbuffer
+ * of each in turn, so the gears are set up only once. Pbuffers are never
+ * swapped: the table lists the swap intervals each config allows, but
+ * they are not timed.
+ *
+ * @param display the display, with EGL initialized headless
+ * @param window the window
+ * @param frames the number of frames to time each config for, or 0 to go
+ * by duration
+ * @param duration how long to time each config for, in seconds, if frames
+ * is 0
+ * @param warmup the number of frames to draw before timing any
+ * @param pipelined whether to prepare frames on a worker thread
+ *
+ * @return the exit status
+ */
+static int
+tune_egl_configs(struct display *display, struct window *window, int frames,
+                 double duration, int warmup, int pipelined)
+{
+    static const EGLint config_attribs[] = {
+        EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+        EGL_RED_SIZE, 1,
+        EGL_GREEN_SIZE, 1,
+        EGL_BLUE_SIZE, 1,
+        EGL_RENDERABLE_TYPE, EGL_OPENGL_ES2_BIT,
+        EGL_DEPTH_SIZE, 1,
+        EGL_NONE
+    };
+    const char *extensions = eglQueryString(display->egl.dpy, EGL_EXTENSIONS);
+    struct egl_config_info *infos, info;
+    EGLConfig *configs;
+    EGLSurface previous;
+    double *mean_ms;
+    int *order;
+    char renderer[256], format[32];
+    EGLint count, n = 0, i, j;
+    int timed = 0, ret = EXIT_SUCCESS;
+
+    if (!extensions || !strstr(extensions, "EGL_KHR_no_config_context")) {
+        fprintf(stderr, "tuning needs EGL_KHR_no_config_context\n");
+        return EXIT_FAILURE;
+    }
+
+    if (!eglChooseConfig(display->egl.dpy, config_attribs, NULL, 0, &count) || count < 1)
+        return EXIT_FAILURE;
+    configs = calloc(count, sizeof(*configs));
+    infos = calloc(count, sizeof(*infos));
+    mean_ms = calloc(count, sizeof(*mean_ms));
+    order = calloc(count, sizeof(*order));
+    assert(configs && infos && mean_ms && order);
+    eglChooseConfig(display->egl.dpy, config_attribs, configs, count, &count);
+
+    for (i = 0; i < count; i++) {
+        get_egl_config_info(display->egl.dpy, configs[i], &info);
+        for (j = 0; j < n && !same_egl_config(&infos[j], &info); j++)
+            ;
+        if (j == n)
+            infos[n++] = info;
+    }
+    free(configs);
+    printf("tuning: %d EGL configs\n", n);
+
+    eglDestroyContext(display->egl.dpy, display->egl.ctx);
+    display->egl.ctx = eglCreateContext(display->egl.dpy, EGL_NO_CONFIG_KHR,
+                                        EGL_NO_CONTEXT, egl_context_attribs);
+    assert(display->egl.ctx);
+
+    for (i = 0; i < n && ret == EXIT_SUCCESS; i++) {
+        previous = window->egl_surface;
+        display->egl.conf = infos[i].config;
+        create_headless_surface(window);
+        if (previous)
+            eglDestroySurface(display->egl.dpy, previous);
+
+        if (i == 0) {
+            init_gl(window);
+            init_pipeline(pipelined);
+            snprintf(renderer, sizeof renderer, "%s",
+                     (const char *) glGetString(GL_RENDERER));
+        }
+
+        ret = run_benchmark(window, frames, duration, warmup, &mean_ms[i]);
+        if (ret == EXIT_SUCCESS)
+            timed++;
+    }
+
+    /* Fastest first */
+    for (i = 0; i < timed; i++) {
+        for (j = i; j > 0 && mean_ms[order[j - 1]] > mean_ms[i]; j--)
+            order[j] = order[j - 1];
+        order[j] = i;
+    }
+
+    printf("\n%4s %6s  %-12s %5s %7s %13s %9s %9s\n", "rank", "config", "format",
+           "depth", "samples", "swap interval", "mean ms", "fps");
+    for (i = 0; i < timed; i++) {
+        const struct egl_config_info *c = &infos[order[i]];
+
+        egl_config_format(c, format, sizeof format);
+        printf("%4d %6d  %-12s %5d %7d %9d..%-2d %9.3f %9.1f\n", i + 1, c->id, format,
+               c->depth, c->samples, c->min_swap_interval, c->max_swap_interval,
+               mean_ms[order[i]], 1e3 / mean_ms[order[i]]);
+    }
+
+    if (timed > 0) {
+        const struct egl_config_info *best = &infos[order[0]];
+
+        egl_config_format(best, format, sizeof format);
+        printf("fastest on %s: %s, depth %d, %d samples, ", renderer, format,
+               best->depth, best->samples);
+        if (save_tuned_config(renderer, best))
+            printf("used for windows from now on\n");
+        else
+            printf("not saved without a cache\n");
+    }
+
+    free(infos);
+    free(mean_ms);
+    free(order);
+    return ret;
+}
+
 static void
 pointer_handle_enter(void *data, struct wl_pointer *pointer,
                      uint32_t serial, struct wl_surface *surface,
@@ -1047,7 +4503,7 @@ static void
 pointer_handle_motion(void *data, struct wl_pointer *pointer,
                       uint32_t time, wl_fixed_t sx, wl_fixed_t sy)
 {
-    printf("pointer_handle_motion sx=%d sy=%d", sx, sy);
+    input_set_position(data, time, sx, sy);
 }
 
 static void
@@ -1096,6 +4552,7 @@ static void
 touch_handle_motion(void *data, struct wl_touch *wl_touch,
                     uint32_t time, int32_t id, wl_fixed_t x_w, wl_fixed_t y_w)
 {
+    input_set_position(data, time, x_w, y_w);
 }
 
 static void
@@ -1142,9 +4599,11 @@ keyboard_handle_key(void *data, struct wl_keyboard *keyboard,
 {
     struct display *d = data;
 
-    if (key == KEY_F11 && state)
-        set_fullscreen(d->window, d->window->fullscreen ^ 1);
-    else if (key == KEY_ESC && state)
+    /* The render thread does the toggling, between frames */
+    if (key == KEY_F11 && state) {
+        input_write_begin(&d->input)->fullscreen_toggles++;
+        input_write_end(&d->input);
+    } else if (key == KEY_ESC && state)
         running = 0;
 }
 
@@ -1200,6 +4659,19 @@ static const struct wl_seat_listener seat_listener = {
     seat_handle_capabilities,
 };
 
+static void
+presentation_clock_id(void *data, struct wp_presentation *presentation,
+                      uint32_t clock_id)
+{
+    struct display *d = data;
+
+    d->presentation_clock = clock_id;
+}
+
+static const struct wp_presentation_listener presentation_listener = {
+    presentation_clock_id
+};
+
 static void
 registry_handle_global(void *data, struct wl_registry *registry,
                        uint32_t name, const char *interface, uint32_t version)
@@ -1207,15 +4679,20 @@ registry_handle_global(void *data, struct wl_registry *registry,
     struct display *d = data;
 
     if (strcmp(interface, "wl_compositor") == 0) {
+        /* Version 3 has wl_surface.set_buffer_scale */
+        d->compositor_version = version < 3 ? version : 3;
         d->compositor =
                 wl_registry_bind(registry, name,
-                                 &wl_compositor_interface, 1);
+                                 &wl_compositor_interface, d->compositor_version);
     } else if (strcmp(interface, "wl_shell") == 0) {
         d->shell = wl_registry_bind(registry, name,
                                     &wl_shell_interface, 1);
     } else if (strcmp(interface, "wl_seat") == 0) {
         d->seat = wl_registry_bind(registry, name,
                                    &wl_seat_interface, 1);
+        /* The input devices get the seat's queue */
+        if (d->input_queue)
+            wl_proxy_set_queue((struct wl_proxy *) d->seat, d->input_queue);
         wl_seat_add_listener(d->seat, &seat_listener, d);
     } else if (strcmp(interface, "wl_shm") == 0) {
         d->shm = wl_registry_bind(registry, name,
@@ -1223,6 +4700,10 @@ registry_handle_global(void *data, struct wl_registry *registry,
         d->cursor_theme = wl_cursor_theme_load(NULL, 32, d->shm);
         d->default_cursor =
                 wl_cursor_theme_get_cursor(d->cursor_theme, "left_ptr");
+    } else if (strcmp(interface, "wp_presentation") == 0) {
+        d->presentation = wl_registry_bind(registry, name,
+                                           &wp_presentation_interface, 1);
+        wp_presentation_add_listener(d->presentation, &presentation_listener, d);
     }
 }
 
@@ -1237,10 +4718,93 @@ static const struct wl_registry_listener registry_listener = {
     registry_handle_global_remove
 };
 
+/** The event thread's wakeup pipe, for the signal handler; -1 without one */
+static int signal_wakeup_fd = -1;
+
+/**
+ * Reads and dispatches the events for the input queue until running is
+ * cleared, so input is handled while the render thread is busy drawing.
+ *
+ * Reading follows the wl_display_prepare_read_queue() protocol, so it
+ * coexists with the render thread, and EGL, reading for their queues:
+ * whichever thread gets to wl_display_read_events() last does the read,
+ * and events for the other queues are left for their threads.
+ *
+ * @param data the display
+ */
+static void *
+event_thread(void *data)
+{
+    struct display *display = data;
+    struct pollfd fds[2] = {
+        { .fd = wl_display_get_fd(display->display), .events = POLLIN },
+        { .fd = display->wakeup_pipe[0], .events = POLLIN },
+    };
+
+    while (running) {
+        while (wl_display_prepare_read_queue(display->display, display->input_queue) != 0)
+            wl_display_dispatch_queue_pending(display->display, display->input_queue);
+        wl_display_flush(display->display);
+
+        if (poll(fds, 2, -1) > 0 && (fds[0].revents & POLLIN)) {
+            if (wl_display_read_events(display->display) < 0)
+                break;
+        } else {
+            wl_display_cancel_read(display->display);
+        }
+
+        if (wl_display_dispatch_queue_pending(display->display, display->input_queue) < 0)
+            break;
+    }
+
+    running = 0;
+    return NULL;
+}
+
 static void
 signal_int(int signum)
 {
+    static const char wakeup = 0;
+    ssize_t ret;
+
     running = 0;
+    ret = write(signal_wakeup_fd, &wakeup, 1);
+    (void) ret;
+}
+
+/**
+ * Picks the directory to cache gear meshes in, creating it if need be:
+ * dir if not NULL, else es2gears in $XDG_CACHE_HOME or ~/.cache.
+ */
+static void
+init_mesh_cache(const char *dir)
+{
+    const char *base = getenv("XDG_CACHE_HOME"), *home = getenv("HOME");
+    char *path;
+    size_t size;
+
+    if (dir) {
+        path = strdup(dir);
+    } else if (base && base[0]) {
+        size = strlen(base) + sizeof("/es2gears");
+        path = malloc(size);
+        if (path)
+            snprintf(path, size, "%s/es2gears", base);
+    } else if (home) {
+        size = strlen(home) + sizeof("/.cache/es2gears");
+        path = malloc(size);
+        if (path)
+            snprintf(path, size, "%s/.cache/es2gears", home);
+    } else {
+        return;
+    }
+
+    if (path && !create_mesh_cache_dir(path)) {
+        fprintf(stderr, "cannot create %s, not caching gear meshes\n", path);
+        free(path);
+        path = NULL;
+    }
+    mesh_cache_dir = path;
 }
 
 static void
@@ -1250,7 +4814,55 @@ usage(int error_code)
             "  -o\tCreate an opaque surface\n"
             "  -s\tUse a 16 bpp EGL config\n"
             "  -b\tDon't sync to compositor redraw (eglSwapInterval 0)\n"
-            "  -h\tThis help text\n\n");
+            "  -p\tDraw a frame only when the compositor's frame callback\n"
+            "    \tasks for one, instead of as fast as EGL allows\n"
+            "  -t\tHandle input on the render thread between frames\n"
+            "    \tinstead of on an event thread\n"
+            "  --no-pipeline\n"
+            "    \tWork out each frame's matrices and levels of detail on\n"
+            "    \tthe render thread just before drawing it, instead of on\n"
+            "    \ta worker thread while the one before is drawn\n"
+            "  -S\tDraw each triangle strip separately instead of one\n"
+            "    \tindexed draw per gear\n"
+            "  -B\tDraw the whole scene from one buffer with one draw call\n"
+            "    \t(per up to 48 trains)\n"
+            "  -I\tDraw the whole scene with one instanced draw call, if\n"
+            "    \tsupported (default with -n)\n"
+            "  -n N\tDraw N gear trains in a grid (1 to %d)\n"
+            "  -P F\tStore positions as F: float (default) or half\n"
+            "  -N F\tStore normals as F: float (default), 2_10_10_10\n"
+            "    \tor byte; half/2_10_10_10 and half/byte take 12 bytes\n"
+            "    \ta vertex instead of 24\n"
+            "  -F\tFree the client side geometry once it is uploaded\n"
+            "  --headless\n"
+            "    \tBenchmark on an EGL pbuffer without a compositor, with\n"
+            "    \ta fixed time step, and print a JSON report\n"
+            "  --frames N\n"
+            "    \tTime N frames (default 600)\n"
+            "  --duration S\n"
+            "    \tTime frames for S seconds instead\n"
+            "  --warmup N\n"
+            "    \tDraw N frames before timing any (default 60)\n"
+            "  --tune-egl\n"
+            "    \tBenchmark every EGL config headless, %d frames each by\n"
+            "    \tdefault, rank them and use the fastest for windows\n"
+            "    \tfrom then on, unless -o or -s is given\n"
+            "  --no-tuned-config\n"
+            "    \tUse the default EGL config even if tuned\n"
+            "  --software\n"
+            "    \tDraw on the CPU into wl_shm buffers instead of with EGL;\n"
+            "    \twith --headless, benchmark 1, 2, 4... up to --threads\n"
+            "    \tthreads\n"
+            "  --threads N\n"
+            "    \tDraw in software with N threads (default: one per CPU)\n"
+            "  --mesh-cache DIR\n"
+            "    \tCache gear meshes in DIR (default $XDG_CACHE_HOME/es2gears)\n"
+            "  --no-mesh-cache\n"
+            "    \tMake the gear meshes every time\n"
+            "  --lod N\n"
+            "    \tDraw every gear at level of detail N, 0 (full) to %d,\n"
+            "    \tinstead of picking one by its size on screen\n"
+            "  -h\tThis help text\n\n", MAX_TRAINS, TUNE_FRAMES, GEAR_LODS - 1);
 
     exit(error_code);
 }
@@ -1261,7 +4873,14 @@ main(int argc, char **argv)
     struct sigaction sigint;
     struct display display = { 0 };
     struct window  window  = { 0 };
-    int i, ret = 0;
+    int i, ret = 0, threaded = 1, pipelined = 1;
+    int headless = 0, tune = 0, frames = 0, warmup = 60;
+    int software = 0, threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int mesh_cache = 1;
+    const char *cache_dir = NULL;
+    double duration = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &startup_time);
 
     window.display = &display;
     display.window = &window;
@@ -1272,20 +4891,170 @@ main(int argc, char **argv)
     window.fullscreen = 1;
 
     for (i = 1; i < argc; i++) {
-        if (strcmp("-o", argv[i]) == 0)
+        if (strcmp("-o", argv[i]) == 0) {
             window.opaque = 1;
-        else if (strcmp("-s", argv[i]) == 0)
+            use_tuned_config = 0;
+        } else if (strcmp("-s", argv[i]) == 0) {
             window.buffer_size = 16;
+            use_tuned_config = 0;
+        }
         else if (strcmp("-b", argv[i]) == 0)
             window.frame_sync = 0;
+        else if (strcmp("-p", argv[i]) == 0)
+            window.frame_callbacks = 1;
+        else if (strcmp("-t", argv[i]) == 0)
+            threaded = 0;
+        else if (strcmp("-S", argv[i]) == 0)
+            draw_mode = DRAW_STRIPS;
+        else if (strcmp("-B", argv[i]) == 0)
+            draw_mode = DRAW_BATCHED;
+        else if (strcmp("-I", argv[i]) == 0)
+            draw_mode = DRAW_INSTANCED;
+        else if (strcmp("-P", argv[i]) == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "half") == 0)
+                layout.position_format = POSITION_HALF;
+            else if (strcmp(argv[i], "float") != 0)
+                usage(EXIT_FAILURE);
+        } else if (strcmp("-N", argv[i]) == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "2_10_10_10") == 0)
+                layout.normal_format = NORMAL_2_10_10_10;
+            else if (strcmp(argv[i], "byte") == 0)
+                layout.normal_format = NORMAL_BYTE;
+            else if (strcmp(argv[i], "float") != 0)
+                usage(EXIT_FAILURE);
+        } else if (strcmp("-F", argv[i]) == 0)
+            free_arrays = 1;
+        else if (strcmp("-n", argv[i]) == 0 && i + 1 < argc) {
+            ntrains = atoi(argv[++i]);
+            if (ntrains < 1 || ntrains > MAX_TRAINS)
+                usage(EXIT_FAILURE);
+        }
+        else if (strcmp("--no-pipeline", argv[i]) == 0)
+            pipelined = 0;
+        else if (strcmp("--headless", argv[i]) == 0)
+            headless = 1;
+        else if (strcmp("--tune-egl", argv[i]) == 0)
+            headless = tune = 1;
+        else if (strcmp("--no-tuned-config", argv[i]) == 0)
+            use_tuned_config = 0;
+        else if (strcmp("--frames", argv[i]) == 0 && i + 1 < argc) {
+            frames = atoi(argv[++i]);
+            if (frames < 1)
+                usage(EXIT_FAILURE);
+        } else if (strcmp("--duration", argv[i]) == 0 && i + 1 < argc) {
+            duration = atof(argv[++i]);
+            if (duration <= 0)
+                usage(EXIT_FAILURE);
+        } else if (strcmp("--warmup", argv[i]) == 0 && i + 1 < argc) {
+            warmup = atoi(argv[++i]);
+            if (warmup < 0)
+                usage(EXIT_FAILURE);
+        } else if (strcmp("--software", argv[i]) == 0)
+            software = 1;
+        else if (strcmp("--threads", argv[i]) == 0 && i + 1 < argc) {
+            threads = atoi(argv[++i]);
+            if (threads < 1)
+                usage(EXIT_FAILURE);
+        } else if (strcmp("--mesh-cache", argv[i]) == 0 && i + 1 < argc)
+            cache_dir = argv[++i];
+        else if (strcmp("--no-mesh-cache", argv[i]) == 0)
+            mesh_cache = 0;
+        else if (strcmp("--lod", argv[i]) == 0 && i + 1 < argc) {
+            forced_lod = atoi(argv[++i]);
+            if (forced_lod < 0 || forced_lod >= GEAR_LODS)
+                usage(EXIT_FAILURE);
+        }
         else if (strcmp("-h", argv[i]) == 0)
             usage(EXIT_SUCCESS);
         else
             usage(EXIT_FAILURE);
     }
 
+    if (threads < 1)
+        threads = 1;
+
+    if (tune && software)
+        usage(EXIT_FAILURE);
+
+    if (mesh_cache)
+        init_mesh_cache(cache_dir);
+
+    if (software && free_arrays) {
+        printf("the software renderer draws from the client side geometry, not freeing it\n");
+        free_arrays = 0;
+    }
+
+    if (headless && software) {
+        int n;
+
+        if (frames == 0 && duration == 0)
+            frames = 600;
+
+        init_software();
+        init_pipeline(pipelined);
+        window.geometry = window.window_size;
+        perspective(ProjectionMatrix, 60.0,
+                    window.geometry.width / (float) window.geometry.height, 1.0, 1024.0);
+
+        /* One report per thread count, doubling up to the requested one */
+        for (n = 1; ret == EXIT_SUCCESS; n = n * 2 < threads ? n * 2 : threads) {
+            soft_renderer = soft_renderer_create(n);
+            if (!soft_renderer) {
+                fprintf(stderr, "failed to create a software renderer\n");
+                ret = EXIT_FAILURE;
+                break;
+            }
+            ret = run_benchmark(&window, frames, duration, warmup, NULL);
+            soft_renderer_destroy(soft_renderer);
+            soft_renderer = NULL;
+            if (n == threads)
+                break;
+        }
+        fini_pipeline();
+        return ret;
+    }
+
+    if (headless && tune) {
+        if (frames == 0 && duration == 0)
+            frames = TUNE_FRAMES;
+
+        init_egl(&display, &window);
+        ret = tune_egl_configs(&display, &window, frames, duration, warmup, pipelined);
+        fini_pipeline();
+    } else if (headless) {
+        if (frames == 0 && duration == 0)
+            frames = 600;
+
+        init_egl(&display, &window);
+        create_headless_surface(&window);
+        init_gl(&window);
+        init_pipeline(pipelined);
+        ret = run_benchmark(&window, frames, duration, warmup, NULL);
+        fini_pipeline();
+    }
+
+    if (headless) {
+        gpu_timer_fini(&gpu_timer);
+        eglMakeCurrent(display.egl.dpy, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+        eglDestroySurface(display.egl.dpy, window.egl_surface);
+        fini_egl(&display);
+        return ret;
+    }
+
     display.display = wl_display_connect(NULL);
     assert(display.display);
+    display.presentation_clock = CLOCK_MONOTONIC;
+    display.wakeup_pipe[0] = display.wakeup_pipe[1] = -1;
+    if (threaded) {
+        display.input_queue = wl_display_create_queue(display.display);
+        if (pipe(display.wakeup_pipe) < 0) {
+            fprintf(stderr, "failed to create the event thread's pipe\n");
+            exit(EXIT_FAILURE);
+        }
+        signal_wakeup_fd = display.wakeup_pipe[1];
+    }
 
     display.registry = wl_display_get_registry(display.display);
     wl_registry_add_listener(display.registry,
@@ -1293,9 +5062,28 @@ main(int argc, char **argv)
 
     wl_display_dispatch(display.display);
 
-    init_egl(&display, &window);
-    create_surface(&window);
-    init_gl(&window);
+    /* Get the presentation clock before the first frame is timed */
+    if (display.presentation)
+        wl_display_roundtrip(display.display);
+
+    if (software) {
+        if (!display.shm) {
+            fprintf(stderr, "the compositor has no wl_shm\n");
+            exit(EXIT_FAILURE);
+        }
+        init_software();
+        soft_renderer = soft_renderer_create(threads);
+        assert(soft_renderer);
+        printf("software renderer: %d threads\n", soft_renderer_threads(soft_renderer));
+        /* Buffers are only reused once released, so draw when asked to */
+        window.frame_callbacks = 1;
+        create_surface(&window);
+    } else {
+        init_egl(&display, &window);
+        create_surface(&window);
+        init_gl(&window);
+    }
+    init_pipeline(pipelined);
 
     display.cursor_surface =
             wl_compositor_create_surface(display.compositor);
@@ -1305,21 +5093,52 @@ main(int argc, char **argv)
     sigint.sa_flags = SA_RESETHAND;
     sigaction(SIGINT, &sigint, NULL);
 
+    if (threaded &&
+        pthread_create(&display.event_thread, NULL, event_thread, &display) != 0) {
+        fprintf(stderr, "failed to start the event thread\n");
+        exit(EXIT_FAILURE);
+    }
+
     /* The mainloop here is a little subtle.  Redrawing will cause
      * EGL to read events so we can just call
      * wl_display_dispatch_pending() to handle any events that got
-     * queued up as a side effect. */
-    while (running && ret != -1) {
+     * queued up as a side effect. With an event thread, those are only
+     * the surface's own; input is on the input queue. */
+    if (!display.presentation)
+        fprintf(stderr, "no wp_presentation, presentation times will not be reported\n");
+
+    while (running && ret != -1 && !window.frame_callbacks) {
         wl_display_dispatch_pending(display.display);
         while (!window.configured)
             wl_display_dispatch(display.display);
         redraw(&window, NULL, 0);
     }
 
+    /* Each frame asks for the next, the first one when configured */
+    while (running && ret != -1 && window.frame_callbacks) {
+        if (window.configured && !window.callback)
+            redraw(&window, NULL, 0);
+        ret = wl_display_dispatch(display.display);
+    }
+
     fprintf(stderr, "simple-egl exiting\n");
 
+    if (threaded) {
+        static const char wakeup = 0;
+
+        running = 0;
+        if (write(display.wakeup_pipe[1], &wakeup, 1) < 0)
+            perror("waking up the event thread");
+        pthread_join(display.event_thread, NULL);
+    }
+
+    fini_pipeline();
+    gpu_timer_fini(&gpu_timer);
     destroy_surface(&window);
-    fini_egl(&display);
+    if (soft_renderer)
+        soft_renderer_destroy(soft_renderer);
+    else
+        fini_egl(&display);
 
     wl_surface_destroy(display.cursor_surface);
     if (display.cursor_theme)
@@ -1328,6 +5147,25 @@ main(int argc, char **argv)
     if (display.shell)
         wl_shell_destroy(display.shell);
 
+    if (display.presentation)
+        wp_presentation_destroy(display.presentation);
+
+    if (display.pointer)
+        wl_pointer_destroy(display.pointer);
+    if (display.keyboard)
+        wl_keyboard_destroy(display.keyboard);
+    if (display.touch)
+        wl_touch_destroy(display.touch);
+    if (display.seat)
+        wl_seat_destroy(display.seat);
+
+    if (threaded) {
+        wl_event_queue_destroy(display.input_queue);
+        signal_wakeup_fd = -1;
+        close(display.wakeup_pipe[0]);
+        close(display.wakeup_pipe[1]);
+    }
+
     if (display.compositor)
         wl_compositor_destroy(display.compositor);
 
@@ -0,0 +1,262 @@
+/*
+ * 4x4 matrix helpers for es2gears-wayland.
+ * See matrix.h.
+ */
+
+#define _GNU_SOURCE
+#include "matrix.h"
+
+#include <math.h>
+#include <string.h>
+
+/*
+ * All but the AVX multiply are written against a 4-float column type,
+ * with one set of primitives per instruction set. Sums are accumulated
+ * column by column in the same order as the original scalar code, and
+ * never fused, so every implementation gives the same results.
+ */
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#if defined(__AVX__)
+#include <immintrin.h>
+#endif
+
+typedef __m128 vec4;
+
+static inline vec4 vec4_load(const float *p) { return _mm_loadu_ps(p); }
+static inline void vec4_store(float *p, vec4 a) { _mm_storeu_ps(p, a); }
+static inline vec4 vec4_mul_n(vec4 a, float s) { return _mm_mul_ps(a, _mm_set1_ps(s)); }
+static inline vec4 vec4_madd_n(vec4 acc, vec4 a, float s) { return _mm_add_ps(acc, vec4_mul_n(a, s)); }
+
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+
+typedef float32x4_t vec4;
+
+static inline vec4 vec4_load(const float *p) { return vld1q_f32(p); }
+static inline void vec4_store(float *p, vec4 a) { vst1q_f32(p, a); }
+static inline vec4 vec4_mul_n(vec4 a, float s) { return vmulq_n_f32(a, s); }
+static inline vec4 vec4_madd_n(vec4 acc, vec4 a, float s) { return vaddq_f32(acc, vmulq_n_f32(a, s)); }
+
+#else
+
+typedef struct { float v[4]; } vec4;
+
+static inline vec4
+vec4_load(const float *p)
+{
+    vec4 a;
+    memcpy(a.v, p, sizeof a.v);
+    return a;
+}
+
+static inline void
+vec4_store(float *p, vec4 a)
+{
+    memcpy(p, a.v, sizeof a.v);
+}
+
+static inline vec4
+vec4_mul_n(vec4 a, float s)
+{
+    int i;
+    for (i = 0; i < 4; i++)
+        a.v[i] *= s;
+    return a;
+}
+
+static inline vec4
+vec4_madd_n(vec4 acc, vec4 a, float s)
+{
+    int i;
+    for (i = 0; i < 4; i++)
+        acc.v[i] += a.v[i] * s;
+    return acc;
+}
+
+#endif
+
+const char *
+mat4_implementation(void)
+{
+#if defined(__AVX__)
+    return "avx";
+#elif defined(__SSE2__)
+    return "sse2";
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+    return "neon";
+#else
+    return "scalar";
+#endif
+}
+
+void
+mat4_identity(float *m)
+{
+    static const float t[16] = {
+        1.0, 0.0, 0.0, 0.0,
+        0.0, 1.0, 0.0, 0.0,
+        0.0, 0.0, 1.0, 0.0,
+        0.0, 0.0, 0.0, 1.0,
+    };
+
+    memcpy(m, t, sizeof(t));
+}
+
+#if defined(__AVX__)
+
+/* Two result columns per iteration, with n's entries splatted per lane */
+void
+mat4_multiply(float *m, const float *n)
+{
+    __m256 c0 = _mm256_broadcast_ps((const __m128 *) (m + 0));
+    __m256 c1 = _mm256_broadcast_ps((const __m128 *) (m + 4));
+    __m256 c2 = _mm256_broadcast_ps((const __m128 *) (m + 8));
+    __m256 c3 = _mm256_broadcast_ps((const __m128 *) (m + 12));
+    __m256 n01 = _mm256_loadu_ps(n);
+    __m256 n23 = _mm256_loadu_ps(n + 8);
+    __m256 r01, r23;
+
+    r01 = _mm256_mul_ps(c0, _mm256_permute_ps(n01, 0x00));
+    r01 = _mm256_add_ps(r01, _mm256_mul_ps(c1, _mm256_permute_ps(n01, 0x55)));
+    r01 = _mm256_add_ps(r01, _mm256_mul_ps(c2, _mm256_permute_ps(n01, 0xaa)));
+    r01 = _mm256_add_ps(r01, _mm256_mul_ps(c3, _mm256_permute_ps(n01, 0xff)));
+
+    r23 = _mm256_mul_ps(c0, _mm256_permute_ps(n23, 0x00));
+    r23 = _mm256_add_ps(r23, _mm256_mul_ps(c1, _mm256_permute_ps(n23, 0x55)));
+    r23 = _mm256_add_ps(r23, _mm256_mul_ps(c2, _mm256_permute_ps(n23, 0xaa)));
+    r23 = _mm256_add_ps(r23, _mm256_mul_ps(c3, _mm256_permute_ps(n23, 0xff)));
+
+    _mm256_storeu_ps(m, r01);
+    _mm256_storeu_ps(m + 8, r23);
+}
+
+#else
+
+void
+mat4_multiply(float *m, const float *n)
+{
+    vec4 c0 = vec4_load(m + 0);
+    vec4 c1 = vec4_load(m + 4);
+    vec4 c2 = vec4_load(m + 8);
+    vec4 c3 = vec4_load(m + 12);
+    vec4 r[4];
+    int q;
+
+    /* Column q of the result is m times column q of n */
+    for (q = 0; q < 4; q++) {
+        r[q] = vec4_mul_n(c0, n[q * 4 + 0]);
+        r[q] = vec4_madd_n(r[q], c1, n[q * 4 + 1]);
+        r[q] = vec4_madd_n(r[q], c2, n[q * 4 + 2]);
+        r[q] = vec4_madd_n(r[q], c3, n[q * 4 + 3]);
+    }
+
+    for (q = 0; q < 4; q++)
+        vec4_store(m + q * 4, r[q]);
+}
+
+#endif
+
+void
+mat4_translate(float *m, float x, float y, float z)
+{
+    vec4 c3 = vec4_mul_n(vec4_load(m + 0), x);
+
+    c3 = vec4_madd_n(c3, vec4_load(m + 4), y);
+    c3 = vec4_madd_n(c3, vec4_load(m + 8), z);
+    c3 = vec4_madd_n(c3, vec4_load(m + 12), 1.0f);
+    vec4_store(m + 12, c3);
+}
+
+void
+mat4_rotate(float *m, float angle, float x, float y, float z)
+{
+    vec4 c0 = vec4_load(m + 0);
+    vec4 c1 = vec4_load(m + 4);
+    vec4 c2 = vec4_load(m + 8);
+    vec4 r[3];
+    double s, c;
+    int q;
+
+    sincos(angle, &s, &c);
+    const float t[12] = {
+        x * x * (1 - c) + c,     y * x * (1 - c) + z * s, x * z * (1 - c) - y * s, 0,
+        x * y * (1 - c) - z * s, y * y * (1 - c) + c,     y * z * (1 - c) + x * s, 0,
+        x * z * (1 - c) + y * s, y * z * (1 - c) - x * s, z * z * (1 - c) + c,     0,
+    };
+
+    /* The fourth column of a rotation is (0, 0, 0, 1), leaving m's alone */
+    for (q = 0; q < 3; q++) {
+        r[q] = vec4_mul_n(c0, t[q * 4 + 0]);
+        r[q] = vec4_madd_n(r[q], c1, t[q * 4 + 1]);
+        r[q] = vec4_madd_n(r[q], c2, t[q * 4 + 2]);
+    }
+
+    for (q = 0; q < 3; q++)
+        vec4_store(m + q * 4, r[q]);
+}
+
+void
+mat4_scale(float *m, float s)
+{
+    int q;
+
+    for (q = 0; q < 3; q++)
+        vec4_store(m + q * 4, vec4_mul_n(vec4_load(m + q * 4), s));
+}
+
+void
+mat4_transpose(float *m)
+{
+#if defined(__SSE2__)
+    __m128 c0 = _mm_loadu_ps(m + 0);
+    __m128 c1 = _mm_loadu_ps(m + 4);
+    __m128 c2 = _mm_loadu_ps(m + 8);
+    __m128 c3 = _mm_loadu_ps(m + 12);
+
+    _MM_TRANSPOSE4_PS(c0, c1, c2, c3);
+    _mm_storeu_ps(m + 0, c0);
+    _mm_storeu_ps(m + 4, c1);
+    _mm_storeu_ps(m + 8, c2);
+    _mm_storeu_ps(m + 12, c3);
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+    /* De-interleaving load: val[i] gathers element i of every column */
+    float32x4x4_t t = vld4q_f32(m);
+
+    vst1q_f32(m + 0, t.val[0]);
+    vst1q_f32(m + 4, t.val[1]);
+    vst1q_f32(m + 8, t.val[2]);
+    vst1q_f32(m + 12, t.val[3]);
+#else
+    float t[16] = {
+        m[0], m[4], m[8],  m[12],
+        m[1], m[5], m[9],  m[13],
+        m[2], m[6], m[10], m[14],
+        m[3], m[7], m[11], m[15]};
+
+    memcpy(m, t, sizeof(t));
+#endif
+}
+
+void
+mat4_normal_matrix(float *normal, const float *model_view)
+{
+    const float *t = model_view + 12;
+    int q;
+
+    /*
+     * The inverse of [R | t] is [R^T | -R^T t]; transposed back, the 3x3
+     * is R again and -R^T t ends up in the bottom row.
+     */
+    for (q = 0; q < 3; q++) {
+        const float *c = model_view + q * 4;
+
+        normal[q * 4 + 0] = c[0];
+        normal[q * 4 + 1] = c[1];
+        normal[q * 4 + 2] = c[2];
+        normal[q * 4 + 3] = -(c[0] * t[0] + c[1] * t[1] + c[2] * t[2]);
+    }
+
+    normal[12] = normal[13] = normal[14] = 0.0f;
+    normal[15] = 1.0f;
+}
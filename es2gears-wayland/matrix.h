@@ -0,0 +1,53 @@
+/*
+ * 4x4 matrix helpers for es2gears-wayland.
+ *
+ * Matrices are 16 floats in column-major order, as glUniformMatrix4fv
+ * takes them, and need no particular alignment. Every function that takes
+ * a matrix to modify multiplies it on the right, so a sequence of calls
+ * reads like the equivalent fixed-function code.
+ *
+ * The implementation is picked at compile time: AVX or SSE2 on x86,
+ * NEON on ARM (-mfpu=neon on ARMv7), plain C otherwise.
+ * mat4_implementation() tells which one was built.
+ *
+ * The rotate, translate and scale helpers only touch the columns that
+ * change instead of doing a full multiply, and mat4_normal_matrix() uses
+ * the fact that the gear transforms are rotations, translations and
+ * uniform scales to avoid a general inverse.
+ */
+
+#ifndef MATRIX_H
+#define MATRIX_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+const char *mat4_implementation(void);
+
+void mat4_identity(float *m);
+
+/** m = m * n */
+void mat4_multiply(float *m, const float *n);
+
+void mat4_translate(float *m, float x, float y, float z);
+
+/** Rotates by angle radians around the unit vector (x, y, z) */
+void mat4_rotate(float *m, float angle, float x, float y, float z);
+
+void mat4_scale(float *m, float s);
+
+void mat4_transpose(float *m);
+
+/**
+ * Computes the inverse transpose of a rigid-body model view matrix, scaled
+ * uniformly at most. The upper 3x3 of the result is that of model_view;
+ * it is only correct up to scale, which the shader's normalize() removes.
+ */
+void mat4_normal_matrix(float *normal, const float *model_view);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MATRIX_H */
@@ -0,0 +1,528 @@
+/*
+ * Micro-benchmark for the es2gears-wayland matrix helpers.
+ *
+ * Checks that matrix.c agrees with the scalar functions es2gears-wayland
+ * used before it, on random rigid-body transforms, then times both for
+ * each operation and for the per gear sequence gear_matrices() runs.
+ *
+ *     gcc -O2 -o matrixbench es2gears-wayland/matrixbench.c es2gears-wayland/matrix.c -lm
+ *
+ * Add -mavx for the AVX path, or -mfpu=neon on ARMv7 for NEON.
+ * Exits with a non-zero status if any result is off.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include "matrix.h"
+
+typedef float GLfloat;
+
+/*
+ * The original es2gears-wayland functions, unchanged apart from the
+ * names, as the reference.
+ */
+
+/**
+ * Multiplies two 4x4 matrices.
+ *
+ * The result is stored in matrix m.
+ *
+ * @param m the first matrix to multiply
+ * @param n the second matrix to multiply
+ */
+static void
+legacy_multiply(GLfloat *m, const GLfloat *n)
+{
+    GLfloat tmp[16];
+    const GLfloat *row, *column;
+    div_t d;
+    int i, j;
+
+    for (i = 0; i < 16; i++) {
+        tmp[i] = 0;
+        d = div(i, 4);
+        row = n + d.quot * 4;
+        column = m + d.rem;
+        for (j = 0; j < 4; j++)
+            tmp[i] += row[j] * column[j * 4];
+    }
+    memcpy(m, &tmp, sizeof tmp);
+}
+
+/**
+ * Rotates a 4x4 matrix.
+ *
+ * @param[in,out] m the matrix to rotate
+ * @param angle the angle to rotate
+ * @param x the x component of the direction to rotate to
+ * @param y the y component of the direction to rotate to
+ * @param z the z component of the direction to rotate to
+ */
+static void
+legacy_rotate(GLfloat *m, GLfloat angle, GLfloat x, GLfloat y, GLfloat z)
+{
+    double s, c;
+
+    sincos(angle, &s, &c);
+    GLfloat r[16] = {
+        x * x * (1 - c) + c,     y * x * (1 - c) + z * s, x * z * (1 - c) - y * s, 0,
+        x * y * (1 - c) - z * s, y * y * (1 - c) + c,     y * z * (1 - c) + x * s, 0,
+        x * z * (1 - c) + y * s, y * z * (1 - c) - x * s, z * z * (1 - c) + c,     0,
+        0, 0, 0, 1
+    };
+
+    legacy_multiply(m, r);
+}
+
+
+/**
+ * Translates a 4x4 matrix.
+ *
+ * @param[in,out] m the matrix to translate
+ * @param x the x component of the direction to translate to
+ * @param y the y component of the direction to translate to
+ * @param z the z component of the direction to translate to
+ */
+static void
+legacy_translate(GLfloat *m, GLfloat x, GLfloat y, GLfloat z)
+{
+    GLfloat t[16] = { 1, 0, 0, 0,  0, 1, 0, 0,  0, 0, 1, 0,  x, y, z, 1 };
+
+    legacy_multiply(m, t);
+}
+
+/**
+ * Scales a 4x4 matrix uniformly.
+ *
+ * @param[in,out] m the matrix to scale
+ * @param s the scale factor
+ */
+static void
+legacy_scale(GLfloat *m, GLfloat s)
+{
+    GLfloat t[16] = { s, 0, 0, 0,  0, s, 0, 0,  0, 0, s, 0,  0, 0, 0, 1 };
+
+    legacy_multiply(m, t);
+}
+
+/**
+ * Creates an identity 4x4 matrix.
+ *
+ * @param m the matrix make an identity matrix
+ */
+static void
+legacy_identity(GLfloat *m)
+{
+    GLfloat t[16] = {
+        1.0, 0.0, 0.0, 0.0,
+        0.0, 1.0, 0.0, 0.0,
+        0.0, 0.0, 1.0, 0.0,
+        0.0, 0.0, 0.0, 1.0,
+    };
+
+    memcpy(m, t, sizeof(t));
+}
+
+/**
+ * Transposes a 4x4 matrix.
+ *
+ * @param m the matrix to transpose
+ */
+static void
+legacy_transpose(GLfloat *m)
+{
+    GLfloat t[16] = {
+        m[0], m[4], m[8],  m[12],
+        m[1], m[5], m[9],  m[13],
+        m[2], m[6], m[10], m[14],
+        m[3], m[7], m[11], m[15]};
+
+    memcpy(m, t, sizeof(t));
+}
+
+/**
+ * Inverts a 4x4 matrix.
+ *
+ * This function can currently handle only pure translation-rotation matrices.
+ * Read http://www.gamedev.net/community/forums/topic.asp?topic_id=425118
+ * for an explanation.
+ */
+static void
+legacy_invert(GLfloat *m)
+{
+    GLfloat t[16];
+    legacy_identity(t);
+
+    // Extract and invert the translation part 't'. The inverse of a
+    // translation matrix can be calculated by negating the translation
+    // coordinates.
+    t[12] = -m[12]; t[13] = -m[13]; t[14] = -m[14];
+
+    // Invert the rotation part 'r'. The inverse of a rotation matrix is
+    // equal to its transpose.
+    m[12] = m[13] = m[14] = 0;
+    legacy_transpose(m);
+
+    // inv(m) = inv(r) * inv(t)
+    legacy_multiply(m, t);
+}
+
+#define SAMPLES 1024
+#define ITERATIONS 2000
+
+static GLfloat inputs[SAMPLES][16];
+static GLfloat angles[SAMPLES];
+static GLfloat projection[16];
+static int failures;
+
+static double
+now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static float
+random_float(float min, float max)
+{
+    return min + (max - min) * (rand() / (float) RAND_MAX);
+}
+
+/*
+ * Builds the kind of matrices es2gears works with: a view translation,
+ * rotations around random axes, a uniform scale and a translation.
+ */
+static void
+random_transform(GLfloat *m)
+{
+    GLfloat x = random_float(-1, 1), y = random_float(-1, 1), z = random_float(-1, 1);
+    GLfloat length = sqrt(x * x + y * y + z * z) + 1e-6;
+
+    legacy_identity(m);
+    legacy_translate(m, random_float(-10, 10), random_float(-10, 10), random_float(-40, -1));
+    legacy_rotate(m, random_float(0, 2 * M_PI), x / length, y / length, z / length);
+    legacy_rotate(m, random_float(0, 2 * M_PI), 0, 0, 1);
+    legacy_scale(m, random_float(0.01, 2));
+    legacy_translate(m, random_float(-100, 100), random_float(-100, 100), 0);
+}
+
+static void
+compare(const char *name, const GLfloat *reference, const GLfloat *result, float *max_error)
+{
+    int i;
+
+    for (i = 0; i < 16; i++) {
+        float error = fabsf(reference[i] - result[i]) / (fabsf(reference[i]) + 1.0f);
+
+        if (error > *max_error)
+            *max_error = error;
+        if (error > 1e-5f) {
+            if (failures++ < 10)
+                fprintf(stderr, "%s: element %d is %g, expected %g\n",
+                        name, i, result[i], reference[i]);
+        }
+    }
+}
+
+static void
+check(void)
+{
+    float max_error[6] = { 0 };
+    int i;
+
+    for (i = 0; i < SAMPLES; i++) {
+        const GLfloat *m = inputs[i], *n = inputs[(i + 1) % SAMPLES];
+        GLfloat a[16], b[16];
+
+        memcpy(a, m, sizeof a);
+        memcpy(b, m, sizeof b);
+        legacy_multiply(a, n);
+        mat4_multiply(b, n);
+        compare("multiply", a, b, &max_error[0]);
+
+        memcpy(a, m, sizeof a);
+        memcpy(b, m, sizeof b);
+        legacy_translate(a, n[12], n[13], n[14]);
+        mat4_translate(b, n[12], n[13], n[14]);
+        compare("translate", a, b, &max_error[1]);
+
+        memcpy(a, m, sizeof a);
+        memcpy(b, m, sizeof b);
+        legacy_rotate(a, angles[i], 0, 0, 1);
+        mat4_rotate(b, angles[i], 0, 0, 1);
+        compare("rotate", a, b, &max_error[2]);
+
+        memcpy(a, m, sizeof a);
+        memcpy(b, m, sizeof b);
+        legacy_scale(a, angles[i]);
+        mat4_scale(b, angles[i]);
+        compare("scale", a, b, &max_error[3]);
+
+        memcpy(a, m, sizeof a);
+        memcpy(b, m, sizeof b);
+        legacy_transpose(a);
+        mat4_transpose(b);
+        compare("transpose", a, b, &max_error[4]);
+
+        memcpy(a, m, sizeof a);
+        legacy_invert(a);
+        legacy_transpose(a);
+        mat4_normal_matrix(b, m);
+        compare("normal matrix", a, b, &max_error[5]);
+    }
+
+    printf("max relative error: multiply %g, translate %g, rotate %g, scale %g, "
+           "transpose %g, normal matrix %g\n",
+           max_error[0], max_error[1], max_error[2], max_error[3],
+           max_error[4], max_error[5]);
+}
+
+/* What gear_matrices() did per gear before matrix.c */
+static void
+legacy_gear_matrices(const GLfloat *transform, GLfloat angle,
+                     GLfloat *model_view_projection, GLfloat *normal_matrix)
+{
+    GLfloat model_view[16];
+
+    memcpy(model_view, transform, sizeof (model_view));
+    legacy_translate(model_view, -3.0, -2.0, 0);
+    legacy_rotate(model_view, angle, 0, 0, 1);
+
+    memcpy(model_view_projection, projection, 16 * sizeof(GLfloat));
+    legacy_multiply(model_view_projection, model_view);
+
+    memcpy(normal_matrix, model_view, 16 * sizeof(GLfloat));
+    legacy_invert(normal_matrix);
+    legacy_transpose(normal_matrix);
+}
+
+/* And what it does now */
+static void
+gear_matrices(const GLfloat *transform, GLfloat angle,
+              GLfloat *model_view_projection, GLfloat *normal_matrix)
+{
+    GLfloat model_view[16];
+
+    memcpy(model_view, transform, sizeof (model_view));
+    mat4_translate(model_view, -3.0, -2.0, 0);
+    mat4_rotate(model_view, angle, 0, 0, 1);
+
+    memcpy(model_view_projection, projection, 16 * sizeof(GLfloat));
+    mat4_multiply(model_view_projection, model_view);
+
+    mat4_normal_matrix(normal_matrix, model_view);
+}
+
+/* Where the benchmarks work, and a sum of their results to keep them from being optimized away */
+static GLfloat m[16], mvp[16], nm[16];
+static volatile float sink;
+
+static void
+multiply_legacy(void)
+{
+    int i;
+
+    for (i = 0; i < SAMPLES; i++) {
+        memcpy(m, inputs[i], sizeof m);
+        legacy_multiply(m, projection);
+        sink += m[5];
+    }
+}
+
+static void
+multiply(void)
+{
+    int i;
+
+    for (i = 0; i < SAMPLES; i++) {
+        memcpy(m, inputs[i], sizeof m);
+        mat4_multiply(m, projection);
+        sink += m[5];
+    }
+}
+
+static void
+translate_legacy(void)
+{
+    int i;
+
+    for (i = 0; i < SAMPLES; i++) {
+        memcpy(m, inputs[i], sizeof m);
+        legacy_translate(m, 1, 2, 3);
+        sink += m[13];
+    }
+}
+
+static void
+translate(void)
+{
+    int i;
+
+    for (i = 0; i < SAMPLES; i++) {
+        memcpy(m, inputs[i], sizeof m);
+        mat4_translate(m, 1, 2, 3);
+        sink += m[13];
+    }
+}
+
+static void
+rotate_legacy(void)
+{
+    int i;
+
+    for (i = 0; i < SAMPLES; i++) {
+        memcpy(m, inputs[i], sizeof m);
+        legacy_rotate(m, angles[i], 0, 0, 1);
+        sink += m[5];
+    }
+}
+
+static void
+rotate(void)
+{
+    int i;
+
+    for (i = 0; i < SAMPLES; i++) {
+        memcpy(m, inputs[i], sizeof m);
+        mat4_rotate(m, angles[i], 0, 0, 1);
+        sink += m[5];
+    }
+}
+
+static void
+transpose_legacy(void)
+{
+    int i;
+
+    for (i = 0; i < SAMPLES; i++) {
+        memcpy(m, inputs[i], sizeof m);
+        legacy_transpose(m);
+        sink += m[1];
+    }
+}
+
+static void
+transpose(void)
+{
+    int i;
+
+    for (i = 0; i < SAMPLES; i++) {
+        memcpy(m, inputs[i], sizeof m);
+        mat4_transpose(m);
+        sink += m[1];
+    }
+}
+
+static void
+normal_matrix_legacy(void)
+{
+    int i;
+
+    for (i = 0; i < SAMPLES; i++) {
+        memcpy(m, inputs[i], sizeof m);
+        legacy_invert(m);
+        legacy_transpose(m);
+        sink += m[3];
+    }
+}
+
+static void
+normal_matrix(void)
+{
+    int i;
+
+    for (i = 0; i < SAMPLES; i++) {
+        mat4_normal_matrix(m, inputs[i]);
+        sink += m[3];
+    }
+}
+
+static void
+gear_matrices_legacy(void)
+{
+    int i;
+
+    for (i = 0; i < SAMPLES; i++) {
+        legacy_gear_matrices(inputs[i], angles[i], mvp, nm);
+        sink += mvp[5] + nm[3];
+    }
+}
+
+static void
+gear_matrices_current(void)
+{
+    int i;
+
+    for (i = 0; i < SAMPLES; i++) {
+        gear_matrices(inputs[i], angles[i], mvp, nm);
+        sink += mvp[5] + nm[3];
+    }
+}
+
+static const struct benchmark {
+    const char *name;
+    void (*legacy)(void);
+    void (*current)(void);
+} benchmarks[] = {
+    { "multiply", multiply_legacy, multiply },
+    { "translate", translate_legacy, translate },
+    { "rotate", rotate_legacy, rotate },
+    { "transpose", transpose_legacy, transpose },
+    { "normal matrix", normal_matrix_legacy, normal_matrix },
+    { "gear matrices", gear_matrices_legacy, gear_matrices_current },
+};
+
+/* Runs a benchmark over all samples ITERATIONS times; returns ns per sample */
+static double
+time_ns(void (*benchmark)(void))
+{
+    double start = now_ns();
+    int i;
+
+    for (i = 0; i < ITERATIONS; i++)
+        benchmark();
+    return (now_ns() - start) / ((double) ITERATIONS * SAMPLES);
+}
+
+static void
+report(const char *name, double legacy_ns, double ns)
+{
+    printf("%-14s %8.2f ns %8.2f ns %6.2fx\n", name, legacy_ns, ns, legacy_ns / ns);
+}
+
+int
+main(void)
+{
+    size_t b;
+    int i;
+
+    srand(1);
+    for (i = 0; i < SAMPLES; i++) {
+        random_transform(inputs[i]);
+        angles[i] = random_float(0, 2 * M_PI);
+    }
+    memcpy(projection, inputs[0], sizeof projection);
+
+    printf("matrix implementation: %s\n", mat4_implementation());
+    check();
+
+    printf("%-14s %11s %11s %7s\n", "", "legacy", mat4_implementation(), "speedup");
+
+    for (b = 0; b < sizeof(benchmarks) / sizeof(benchmarks[0]); b++) {
+        double legacy_ns = time_ns(benchmarks[b].legacy);
+
+        report(benchmarks[b].name, legacy_ns, time_ns(benchmarks[b].current));
+    }
+
+    if (failures)
+        fprintf(stderr, "%d elements disagree\n", failures);
+
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
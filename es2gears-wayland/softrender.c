@@ -0,0 +1,1005 @@
+/*
+ * Software rasterizer for es2gears-wayland.
+ * See softrender.h.
+ */
+
+#define _GNU_SOURCE
+#include "softrender.h"
+
+#include <float.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define TILE_SIZE 64
+/** Window coordinates are snapped to 1/SUBPIXELS of a pixel */
+#define SUBPIXELS 16
+/** And clamped to this far outside the window, for lack of clipping */
+#define GUARD_BAND 8192.0f
+/** Vertices closer to the eye than this are not drawn, for the same reason */
+#define MIN_W 1e-3f
+/** The most triangles set up before rasterizing, which bounds the bins */
+#define PASS_TRIANGLES (256 * 1024)
+
+/*
+ * Four floats, or four lane masks, with one set of primitives per
+ * instruction set. Every operation is exactly rounded, and there are no
+ * fused multiply-adds, so all of them give the same results.
+ */
+#if defined(__SSE2__)
+#include <emmintrin.h>
+
+typedef __m128 vf4;
+typedef __m128 vm4;
+typedef __m128i vu4;
+
+static inline vf4 vf4_set1(float f) { return _mm_set1_ps(f); }
+static inline vf4 vf4_load(const float *p) { return _mm_loadu_ps(p); }
+static inline void vf4_store(float *p, vf4 a) { _mm_storeu_ps(p, a); }
+static inline vf4 vf4_add(vf4 a, vf4 b) { return _mm_add_ps(a, b); }
+static inline vf4 vf4_sub(vf4 a, vf4 b) { return _mm_sub_ps(a, b); }
+static inline vf4 vf4_mul(vf4 a, vf4 b) { return _mm_mul_ps(a, b); }
+static inline vf4 vf4_div(vf4 a, vf4 b) { return _mm_div_ps(a, b); }
+static inline vf4 vf4_min(vf4 a, vf4 b) { return _mm_min_ps(a, b); }
+static inline vf4 vf4_max(vf4 a, vf4 b) { return _mm_max_ps(a, b); }
+static inline vf4 vf4_sqrt(vf4 a) { return _mm_sqrt_ps(a); }
+/* To nearest, ties to even, as long as it fits an int */
+static inline vf4 vf4_round(vf4 a) { return _mm_cvtepi32_ps(_mm_cvtps_epi32(a)); }
+static inline vm4 vf4_ge(vf4 a, vf4 b) { return _mm_cmpge_ps(a, b); }
+static inline vm4 vf4_lt(vf4 a, vf4 b) { return _mm_cmplt_ps(a, b); }
+static inline vm4 vm4_and(vm4 a, vm4 b) { return _mm_and_ps(a, b); }
+static inline int vm4_any(vm4 m) { return _mm_movemask_ps(m) != 0; }
+static inline vf4 vf4_select(vm4 m, vf4 a, vf4 b) { return _mm_or_ps(_mm_and_ps(m, a), _mm_andnot_ps(m, b)); }
+static inline vu4 vu4_set1(uint32_t u) { return _mm_set1_epi32(u); }
+static inline vu4 vu4_load(const uint32_t *p) { return _mm_loadu_si128((const __m128i *) p); }
+static inline void vu4_store(uint32_t *p, vu4 a) { _mm_storeu_si128((__m128i *) p, a); }
+/* Rounded toward zero */
+static inline void vf4_store_int(int *p, vf4 a) { _mm_storeu_si128((__m128i *) p, _mm_cvttps_epi32(a)); }
+
+static inline vu4
+vu4_select(vm4 m, vu4 a, vu4 b)
+{
+    __m128i mi = _mm_castps_si128(m);
+
+    return _mm_or_si128(_mm_and_si128(mi, a), _mm_andnot_si128(mi, b));
+}
+
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+
+typedef float32x4_t vf4;
+typedef uint32x4_t vm4;
+typedef uint32x4_t vu4;
+
+static inline vf4 vf4_set1(float f) { return vdupq_n_f32(f); }
+static inline vf4 vf4_load(const float *p) { return vld1q_f32(p); }
+static inline void vf4_store(float *p, vf4 a) { vst1q_f32(p, a); }
+static inline vf4 vf4_add(vf4 a, vf4 b) { return vaddq_f32(a, b); }
+static inline vf4 vf4_sub(vf4 a, vf4 b) { return vsubq_f32(a, b); }
+static inline vf4 vf4_mul(vf4 a, vf4 b) { return vmulq_f32(a, b); }
+static inline vf4 vf4_min(vf4 a, vf4 b) { return vminq_f32(a, b); }
+static inline vf4 vf4_max(vf4 a, vf4 b) { return vmaxq_f32(a, b); }
+static inline vm4 vf4_ge(vf4 a, vf4 b) { return vcgeq_f32(a, b); }
+static inline vm4 vf4_lt(vf4 a, vf4 b) { return vcltq_f32(a, b); }
+static inline vm4 vm4_and(vm4 a, vm4 b) { return vandq_u32(a, b); }
+static inline vf4 vf4_select(vm4 m, vf4 a, vf4 b) { return vbslq_f32(m, a, b); }
+static inline vu4 vu4_set1(uint32_t u) { return vdupq_n_u32(u); }
+static inline vu4 vu4_load(const uint32_t *p) { return vld1q_u32(p); }
+static inline void vu4_store(uint32_t *p, vu4 a) { vst1q_u32(p, a); }
+static inline vu4 vu4_select(vm4 m, vu4 a, vu4 b) { return vbslq_u32(m, a, b); }
+static inline void vf4_store_int(int *p, vf4 a) { vst1q_s32(p, vcvtq_s32_f32(a)); }
+
+static inline int
+vm4_any(vm4 m)
+{
+    uint32x2_t t = vorr_u32(vget_low_u32(m), vget_high_u32(m));
+
+    return (vget_lane_u32(t, 0) | vget_lane_u32(t, 1)) != 0;
+}
+
+#if defined(__aarch64__)
+static inline vf4 vf4_div(vf4 a, vf4 b) { return vdivq_f32(a, b); }
+static inline vf4 vf4_sqrt(vf4 a) { return vsqrtq_f32(a); }
+static inline vf4 vf4_round(vf4 a) { return vrndnq_f32(a); }
+#else
+/* ARMv7 NEON has only estimates of these; do them a lane at a time */
+static inline vf4
+vf4_div(vf4 a, vf4 b)
+{
+    float x[4], y[4];
+    int i;
+
+    vst1q_f32(x, a);
+    vst1q_f32(y, b);
+    for (i = 0; i < 4; i++)
+        x[i] /= y[i];
+    return vld1q_f32(x);
+}
+
+static inline vf4
+vf4_sqrt(vf4 a)
+{
+    float x[4];
+    int i;
+
+    vst1q_f32(x, a);
+    for (i = 0; i < 4; i++)
+        x[i] = sqrtf(x[i]);
+    return vld1q_f32(x);
+}
+
+static inline vf4
+vf4_round(vf4 a)
+{
+    float x[4];
+    int i;
+
+    vst1q_f32(x, a);
+    for (i = 0; i < 4; i++)
+        x[i] = nearbyintf(x[i]);
+    return vld1q_f32(x);
+}
+#endif
+
+#else
+
+typedef struct { float v[4]; } vf4;
+typedef struct { uint32_t v[4]; } vm4;
+typedef struct { uint32_t v[4]; } vu4;
+
+#define VF4_OP(name, expr) \
+    static inline vf4 name(vf4 a, vf4 b) \
+    { \
+        int i; \
+        for (i = 0; i < 4; i++) \
+            a.v[i] = (expr); \
+        return a; \
+    }
+
+VF4_OP(vf4_add, a.v[i] + b.v[i])
+VF4_OP(vf4_sub, a.v[i] - b.v[i])
+VF4_OP(vf4_mul, a.v[i] * b.v[i])
+VF4_OP(vf4_div, a.v[i] / b.v[i])
+VF4_OP(vf4_min, a.v[i] < b.v[i] ? a.v[i] : b.v[i])
+VF4_OP(vf4_max, a.v[i] > b.v[i] ? a.v[i] : b.v[i])
+
+static inline vf4
+vf4_set1(float f)
+{
+    vf4 a = { { f, f, f, f } };
+    return a;
+}
+
+static inline vf4
+vf4_load(const float *p)
+{
+    vf4 a;
+    memcpy(a.v, p, sizeof a.v);
+    return a;
+}
+
+static inline void
+vf4_store(float *p, vf4 a)
+{
+    memcpy(p, a.v, sizeof a.v);
+}
+
+static inline vf4
+vf4_sqrt(vf4 a)
+{
+    int i;
+    for (i = 0; i < 4; i++)
+        a.v[i] = sqrtf(a.v[i]);
+    return a;
+}
+
+static inline vf4
+vf4_round(vf4 a)
+{
+    int i;
+    for (i = 0; i < 4; i++)
+        a.v[i] = nearbyintf(a.v[i]);
+    return a;
+}
+
+static inline vm4
+vf4_ge(vf4 a, vf4 b)
+{
+    vm4 m;
+    int i;
+    for (i = 0; i < 4; i++)
+        m.v[i] = a.v[i] >= b.v[i] ? ~0u : 0;
+    return m;
+}
+
+static inline vm4
+vf4_lt(vf4 a, vf4 b)
+{
+    vm4 m;
+    int i;
+    for (i = 0; i < 4; i++)
+        m.v[i] = a.v[i] < b.v[i] ? ~0u : 0;
+    return m;
+}
+
+static inline vm4
+vm4_and(vm4 a, vm4 b)
+{
+    int i;
+    for (i = 0; i < 4; i++)
+        a.v[i] &= b.v[i];
+    return a;
+}
+
+static inline int
+vm4_any(vm4 m)
+{
+    return (m.v[0] | m.v[1] | m.v[2] | m.v[3]) != 0;
+}
+
+static inline vf4
+vf4_select(vm4 m, vf4 a, vf4 b)
+{
+    int i;
+    for (i = 0; i < 4; i++)
+        a.v[i] = m.v[i] ? a.v[i] : b.v[i];
+    return a;
+}
+
+static inline vu4
+vu4_set1(uint32_t u)
+{
+    vu4 a = { { u, u, u, u } };
+    return a;
+}
+
+static inline vu4
+vu4_load(const uint32_t *p)
+{
+    vu4 a;
+    memcpy(a.v, p, sizeof a.v);
+    return a;
+}
+
+static inline void
+vu4_store(uint32_t *p, vu4 a)
+{
+    memcpy(p, a.v, sizeof a.v);
+}
+
+static inline vu4
+vu4_select(vm4 m, vu4 a, vu4 b)
+{
+    int i;
+    for (i = 0; i < 4; i++)
+        a.v[i] = m.v[i] ? a.v[i] : b.v[i];
+    return a;
+}
+
+static inline void
+vf4_store_int(int *p, vf4 a)
+{
+    int i;
+    for (i = 0; i < 4; i++)
+        p[i] = a.v[i];
+}
+
+#endif
+
+static inline vf4
+vf4_set(float a, float b, float c, float d)
+{
+    float t[4] = { a, b, c, d };
+    return vf4_load(t);
+}
+
+/** a * b + c, rounded twice */
+static inline vf4
+vf4_madd(vf4 a, vf4 b, vf4 c)
+{
+    return vf4_add(vf4_mul(a, b), c);
+}
+
+/**
+ * A triangle ready to rasterize. Its edge functions give, for the centre
+ * of pixel (x, y), a * (x - x0) + b * (y - y0) + c: at least bias inside
+ * the edge and less outside.
+ */
+struct triangle {
+    float a[3], b[3], c[3];
+    /** 0 for edges that own the pixel centres exactly on them, FLT_MIN otherwise */
+    float bias[3];
+    /** Depth at the centre of pixel (x0, y0), and its slopes */
+    float z, dzdx, dzdy;
+    /** The pixels it may cover, x0 <= x < x1 and y0 <= y < y1 */
+    int x0, y0, x1, y1;
+    uint32_t color;
+};
+
+struct draw {
+    const struct soft_mesh *mesh;
+    float model_view_projection[16];
+    float normal_matrix[16];
+    float color[4];
+};
+
+/** Indices of the triangles touching a tile, in draw order */
+struct bin {
+    uint32_t *triangles;
+    int count, capacity;
+};
+
+struct worker {
+    struct soft_renderer *renderer;
+    int index;
+    pthread_t thread;
+
+    /** The triangles this thread set up in this pass, and their bins */
+    struct triangle *triangles;
+    int ntriangles, triangles_capacity;
+    struct bin *bins;
+
+    /** Window coordinates, w and diffuse light of the vertices of the current draw */
+    float *x, *y, *z, *w, *diffuse;
+    int vertices_capacity;
+
+    long drawn, visible;
+};
+
+struct soft_renderer {
+    int nthreads;
+    struct worker *workers;
+    pthread_barrier_t barrier;
+    /** Held while the workers are started, until the barrier is ready */
+    pthread_mutex_t start;
+    int quit;
+
+    int width, height;
+    int tiles_x, tiles_y, ntiles;
+    /**
+     * The frame being drawn, bottom row first like GL, padded to whole
+     * tiles so rasterizing never has to check the edges
+     */
+    uint32_t *color;
+    float *depth;
+    long frame_capacity;
+    float light[3];
+
+    struct draw *draws;
+    int ndraws, draws_capacity;
+
+    /** The draws of the pass being run, and whether it is the first or last */
+    int pass_begin, pass_end, first_pass, last_pass;
+    atomic_int next_tile;
+    uint32_t *pixels;
+    int stride;
+};
+
+const char *
+soft_renderer_implementation(void)
+{
+#if defined(__SSE2__)
+    return "sse2";
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+    return "neon";
+#else
+    return "scalar";
+#endif
+}
+
+static double
+now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static void *
+grow(void *array, int *capacity, int needed, size_t size)
+{
+    int n = *capacity ? *capacity : 64;
+
+    if (needed <= *capacity)
+        return array;
+
+    while (n < needed)
+        n *= 2;
+    array = realloc(array, n * size);
+    if (!array)
+        abort();
+    *capacity = n;
+    return array;
+}
+
+static uint32_t
+pack_channel(float v)
+{
+    return (uint32_t) (fminf(fmaxf(v, 0.0f), 1.0f) * 255.0f + 0.5f);
+}
+
+/** The fragment shader's diffuse * MaterialColor, premultiplied ARGB */
+static uint32_t
+pack_color(float diffuse, const float color[4])
+{
+    return pack_channel(diffuse * color[3]) << 24 |
+           pack_channel(diffuse * color[0]) << 16 |
+           pack_channel(diffuse * color[1]) << 8 |
+           pack_channel(diffuse * color[2]);
+}
+
+/**
+ * Transforms and lights the vertices of a draw, four at a time.
+ *
+ * @param renderer the renderer
+ * @param worker the thread's worker
+ * @param draw the draw
+ */
+static void
+transform_vertices(struct soft_renderer *renderer, struct worker *worker,
+                   const struct draw *draw)
+{
+    const struct soft_mesh *mesh = draw->mesh;
+    const float *m = draw->model_view_projection;
+    const float *nm = draw->normal_matrix;
+    int padded = (mesh->nvertices + 3) & ~3;
+    vf4 half_width = vf4_set1(renderer->width * 0.5f);
+    vf4 half_height = vf4_set1(renderer->height * 0.5f);
+    vf4 half = vf4_set1(0.5f), zero = vf4_set1(0.0f);
+    vf4 guard_min = vf4_set1(-GUARD_BAND), guard_max = vf4_set1(GUARD_BAND);
+    vf4 subpixels = vf4_set1(SUBPIXELS), pixels = vf4_set1(1.0f / SUBPIXELS);
+    int i, k;
+
+    if (padded > worker->vertices_capacity) {
+        worker->x = realloc(worker->x, padded * sizeof(float));
+        worker->y = realloc(worker->y, padded * sizeof(float));
+        worker->z = realloc(worker->z, padded * sizeof(float));
+        worker->w = realloc(worker->w, padded * sizeof(float));
+        worker->diffuse = realloc(worker->diffuse, padded * sizeof(float));
+        if (!worker->x || !worker->y || !worker->z || !worker->w || !worker->diffuse)
+            abort();
+        worker->vertices_capacity = padded;
+    }
+
+    for (i = 0; i < mesh->nvertices; i += 4) {
+        float p[6][4];
+        vf4 px, py, pz, nx, ny, nz, cx, cy, cz, cw, n[3], length, d;
+
+        /* Gather four vertices into columns; the last one repeats */
+        for (k = 0; k < 4; k++) {
+            int v = i + k < mesh->nvertices ? i + k : mesh->nvertices - 1;
+            const float *vertex = mesh->vertices + v * mesh->stride;
+            int c;
+
+            for (c = 0; c < 6; c++)
+                p[c][k] = vertex[c];
+        }
+        px = vf4_load(p[0]);
+        py = vf4_load(p[1]);
+        pz = vf4_load(p[2]);
+        nx = vf4_load(p[3]);
+        ny = vf4_load(p[4]);
+        nz = vf4_load(p[5]);
+
+        cx = vf4_madd(px, vf4_set1(m[0]), vf4_madd(py, vf4_set1(m[4]), vf4_madd(pz, vf4_set1(m[8]), vf4_set1(m[12]))));
+        cy = vf4_madd(px, vf4_set1(m[1]), vf4_madd(py, vf4_set1(m[5]), vf4_madd(pz, vf4_set1(m[9]), vf4_set1(m[13]))));
+        cz = vf4_madd(px, vf4_set1(m[2]), vf4_madd(py, vf4_set1(m[6]), vf4_madd(pz, vf4_set1(m[10]), vf4_set1(m[14]))));
+        cw = vf4_madd(px, vf4_set1(m[3]), vf4_madd(py, vf4_set1(m[7]), vf4_madd(pz, vf4_set1(m[11]), vf4_set1(m[15]))));
+        vf4_store(worker->w + i, cw);
+
+        /* To window coordinates, snapped to the subpixel grid */
+        cx = vf4_madd(vf4_div(cx, cw), half_width, half_width);
+        cy = vf4_madd(vf4_div(cy, cw), half_height, half_height);
+        cx = vf4_min(vf4_max(cx, guard_min), guard_max);
+        cy = vf4_min(vf4_max(cy, guard_min), guard_max);
+        vf4_store(worker->x + i, vf4_mul(vf4_round(vf4_mul(cx, subpixels)), pixels));
+        vf4_store(worker->y + i, vf4_mul(vf4_round(vf4_mul(cy, subpixels)), pixels));
+        vf4_store(worker->z + i, vf4_madd(vf4_div(cz, cw), half, half));
+
+        /* The vertex shader's lighting: N = NormalMatrix * vec4(normal, 1.0) */
+        for (k = 0; k < 3; k++)
+            n[k] = vf4_madd(nx, vf4_set1(nm[k]), vf4_madd(ny, vf4_set1(nm[4 + k]),
+                            vf4_madd(nz, vf4_set1(nm[8 + k]), vf4_set1(nm[12 + k]))));
+        length = vf4_sqrt(vf4_madd(n[0], n[0], vf4_madd(n[1], n[1], vf4_mul(n[2], n[2]))));
+        d = vf4_madd(n[0], vf4_set1(renderer->light[0]),
+                     vf4_madd(n[1], vf4_set1(renderer->light[1]),
+                              vf4_mul(n[2], vf4_set1(renderer->light[2]))));
+        vf4_store(worker->diffuse + i, vf4_max(vf4_div(d, length), zero));
+    }
+}
+
+static void
+bin_triangle(struct soft_renderer *renderer, struct worker *worker, const struct triangle *t)
+{
+    int tx, ty;
+
+    for (ty = t->y0 / TILE_SIZE; ty <= (t->y1 - 1) / TILE_SIZE; ty++) {
+        for (tx = t->x0 / TILE_SIZE; tx <= (t->x1 - 1) / TILE_SIZE; tx++) {
+            struct bin *bin = &worker->bins[ty * renderer->tiles_x + tx];
+
+            bin->triangles = grow(bin->triangles, &bin->capacity, bin->count + 1,
+                                  sizeof(*bin->triangles));
+            bin->triangles[bin->count++] = worker->ntriangles - 1;
+        }
+    }
+}
+
+/**
+ * Sets up and bins the triangles of a draw, four at a time.
+ *
+ * In window coordinates, y up, front faces wind counterclockwise, so
+ * their area is positive and each edge function is positive on the
+ * inside. A pixel centre exactly on an edge belongs to the triangle on
+ * the edge's left or bottom side, so shared edges are drawn once.
+ *
+ * @param renderer the renderer
+ * @param worker the thread's worker
+ * @param draw the draw, whose vertices transform_vertices() did
+ */
+static void
+setup_triangles(struct soft_renderer *renderer, struct worker *worker,
+                const struct draw *draw)
+{
+    const unsigned short *indices = draw->mesh->indices;
+    int ntriangles = draw->mesh->nindices / 3;
+    int t, k, e;
+
+    for (t = 0; t < ntriangles; t += 4) {
+        float vx[3][4], vy[3][4], vz[3][4];
+        float area[4], a[3][4], b[3][4], c[3][4];
+        float origin_x[4], origin_y[4], z[4], dzdx[4], dzdy[4];
+        int x0[4], y0[4], x1[4], y1[4], accepted[4];
+        vf4 x[3], y[3], zv[3], av[3], bv[3], cv[3], inverse_area;
+        vf4 zero = vf4_set1(0.0f);
+        vf4 width = vf4_set1(renderer->width), height = vf4_set1(renderer->height);
+
+        for (k = 0; k < 4; k++) {
+            int tri = t + k < ntriangles ? t + k : t;
+
+            for (e = 0; e < 3; e++) {
+                int v = indices[tri * 3 + e];
+
+                vx[e][k] = worker->x[v];
+                vy[e][k] = worker->y[v];
+                vz[e][k] = worker->z[v];
+            }
+        }
+
+        for (e = 0; e < 3; e++) {
+            x[e] = vf4_load(vx[e]);
+            y[e] = vf4_load(vy[e]);
+            zv[e] = vf4_load(vz[e]);
+        }
+
+        /* Edge e runs from vertex e to the next one */
+        for (e = 0; e < 3; e++) {
+            int next = (e + 1) % 3;
+
+            av[e] = vf4_sub(y[e], y[next]);
+            bv[e] = vf4_sub(x[next], x[e]);
+            vf4_store(a[e], av[e]);
+            vf4_store(b[e], bv[e]);
+        }
+        vf4_store(area, vf4_sub(vf4_mul(bv[0], vf4_sub(y[2], y[0])),
+                                vf4_mul(vf4_sub(x[2], x[0]), vf4_sub(y[1], y[0]))));
+        /*
+         * The pixels whose centres the bounding box covers: from
+         * ceil(min - 0.5) to floor(max - 0.5) + 1, clamped to the frame.
+         * Clamped first, everything is positive and truncating floors;
+         * the coordinates are on the subpixel grid, so ceil(v) is
+         * floor(v + 15/16).
+         */
+        vf4_store_int(x0, vf4_min(vf4_max(vf4_add(vf4_min(x[0], vf4_min(x[1], x[2])),
+                                                  vf4_set1(0.5f - 1.0f / SUBPIXELS)), zero), width));
+        vf4_store_int(y0, vf4_min(vf4_max(vf4_add(vf4_min(y[0], vf4_min(y[1], y[2])),
+                                                  vf4_set1(0.5f - 1.0f / SUBPIXELS)), zero), height));
+        vf4_store_int(x1, vf4_min(vf4_max(vf4_add(vf4_max(x[0], vf4_max(x[1], x[2])),
+                                                  vf4_set1(0.5f)), zero), width));
+        vf4_store_int(y1, vf4_min(vf4_max(vf4_add(vf4_max(y[0], vf4_max(y[1], y[2])),
+                                                  vf4_set1(0.5f)), zero), height));
+
+        /* Cull back faces and whatever is off screen */
+        for (k = 0; k < 4; k++) {
+            int tri = t + k;
+
+            accepted[k] = tri < ntriangles && area[k] > 0 &&
+                    x0[k] < x1[k] && y0[k] < y1[k] &&
+                    worker->w[indices[tri * 3]] > MIN_W &&
+                    worker->w[indices[tri * 3 + 1]] > MIN_W &&
+                    worker->w[indices[tri * 3 + 2]] > MIN_W;
+
+            origin_x[k] = x0[k] + 0.5f;
+            origin_y[k] = y0[k] + 0.5f;
+        }
+        if (!(accepted[0] | accepted[1] | accepted[2] | accepted[3]))
+            continue;
+
+        /* The edge functions and depth at the first pixel's centre */
+        for (e = 0; e < 3; e++) {
+            cv[e] = vf4_add(vf4_mul(av[e], vf4_sub(vf4_load(origin_x), x[e])),
+                            vf4_mul(bv[e], vf4_sub(vf4_load(origin_y), y[e])));
+            vf4_store(c[e], cv[e]);
+        }
+        /* Vertex e is weighted by the edge opposite it, e + 1 */
+        inverse_area = vf4_div(vf4_set1(1.0f), vf4_load(area));
+        vf4_store(z, vf4_mul(vf4_madd(cv[1], zv[0], vf4_madd(cv[2], zv[1], vf4_mul(cv[0], zv[2]))),
+                             inverse_area));
+        vf4_store(dzdx, vf4_mul(vf4_madd(av[1], zv[0], vf4_madd(av[2], zv[1], vf4_mul(av[0], zv[2]))),
+                                inverse_area));
+        vf4_store(dzdy, vf4_mul(vf4_madd(bv[1], zv[0], vf4_madd(bv[2], zv[1], vf4_mul(bv[0], zv[2]))),
+                                inverse_area));
+
+        for (k = 0; k < 4; k++) {
+            struct triangle *tri;
+
+            if (!accepted[k])
+                continue;
+
+            worker->triangles = grow(worker->triangles, &worker->triangles_capacity,
+                                     worker->ntriangles + 1, sizeof(*worker->triangles));
+            tri = &worker->triangles[worker->ntriangles++];
+
+            for (e = 0; e < 3; e++) {
+                tri->a[e] = a[e][k];
+                tri->b[e] = b[e][k];
+                tri->c[e] = c[e][k];
+                tri->bias[e] = a[e][k] > 0 || (a[e][k] == 0 && b[e][k] < 0) ? 0 : FLT_MIN;
+            }
+            tri->z = z[k];
+            tri->dzdx = dzdx[k];
+            tri->dzdy = dzdy[k];
+            tri->x0 = x0[k];
+            tri->y0 = y0[k];
+            tri->x1 = x1[k];
+            tri->y1 = y1[k];
+            tri->color = pack_color(worker->diffuse[indices[(t + k) * 3]], draw->color);
+
+            worker->visible++;
+            bin_triangle(renderer, worker, tri);
+        }
+    }
+
+    worker->drawn += ntriangles;
+}
+
+/**
+ * Rasterizes the part of a triangle in one tile, four pixels at a time.
+ *
+ * @param renderer the renderer
+ * @param t the triangle
+ * @param tile_x the x coordinate of the tile's first pixel
+ * @param tile_y the y coordinate of the tile's first pixel
+ */
+static void
+raster_triangle(struct soft_renderer *renderer, const struct triangle *t,
+                int tile_x, int tile_y)
+{
+    int stride = renderer->tiles_x * TILE_SIZE;
+    /* Tiles start on a multiple of four, so groups stay inside them */
+    int x0 = (t->x0 > tile_x ? t->x0 : tile_x) & ~3;
+    int x1 = t->x1 < tile_x + TILE_SIZE ? t->x1 : tile_x + TILE_SIZE;
+    int y0 = t->y0 > tile_y ? t->y0 : tile_y;
+    int y1 = t->y1 < tile_y + TILE_SIZE ? t->y1 : tile_y + TILE_SIZE;
+    vf4 ramp = vf4_set(0, 1, 2, 3);
+    vf4 bias[3];
+    vu4 color = vu4_set1(t->color);
+    int x, y, e;
+
+    for (e = 0; e < 3; e++)
+        bias[e] = vf4_set1(t->bias[e]);
+
+    for (y = y0; y < y1; y++) {
+        uint32_t *color_row = renderer->color + (long) y * stride;
+        float *depth_row = renderer->depth + (long) y * stride;
+        float dy = y - t->y0;
+
+        for (x = x0; x < x1; x += 4) {
+            /* Evaluated afresh for every group, rather than stepped */
+            vf4 dx = vf4_add(vf4_set1(x - t->x0), ramp);
+            vf4 z = vf4_madd(dx, vf4_set1(t->dzdx), vf4_set1(t->z + t->dzdy * dy));
+            vm4 inside = vf4_lt(z, vf4_load(depth_row + x));
+
+            for (e = 0; e < 3; e++) {
+                vf4 edge = vf4_madd(dx, vf4_set1(t->a[e]), vf4_set1(t->c[e] + t->b[e] * dy));
+
+                inside = vm4_and(inside, vf4_ge(edge, bias[e]));
+            }
+
+            if (!vm4_any(inside))
+                continue;
+
+            vf4_store(depth_row + x, vf4_select(inside, z, vf4_load(depth_row + x)));
+            vu4_store(color_row + x, vu4_select(inside, color, vu4_load(color_row + x)));
+        }
+    }
+}
+
+/**
+ * Draws the triangles binned to a tile, clearing it first in the first
+ * pass and copying it out in the last.
+ */
+static void
+raster_tile(struct soft_renderer *renderer, int tile)
+{
+    int stride = renderer->tiles_x * TILE_SIZE;
+    int tile_x = tile % renderer->tiles_x * TILE_SIZE;
+    int tile_y = tile / renderer->tiles_x * TILE_SIZE;
+    int x_end = tile_x + TILE_SIZE < renderer->width ? tile_x + TILE_SIZE : renderer->width;
+    int y_end = tile_y + TILE_SIZE < renderer->height ? tile_y + TILE_SIZE : renderer->height;
+    int w, i, x, y;
+
+    if (renderer->first_pass) {
+        for (y = tile_y; y < tile_y + TILE_SIZE; y++) {
+            memset(renderer->color + (long) y * stride + tile_x, 0, TILE_SIZE * sizeof(uint32_t));
+            for (x = tile_x; x < tile_x + TILE_SIZE; x++)
+                renderer->depth[(long) y * stride + x] = 1.0f;
+        }
+    }
+
+    /* Threads took consecutive draws, so this keeps the draw order */
+    for (w = 0; w < renderer->nthreads; w++) {
+        struct worker *worker = &renderer->workers[w];
+        struct bin *bin = &worker->bins[tile];
+
+        for (i = 0; i < bin->count; i++)
+            raster_triangle(renderer, &worker->triangles[bin->triangles[i]], tile_x, tile_y);
+    }
+
+    if (renderer->last_pass) {
+        for (y = tile_y; y < y_end; y++)
+            memcpy((char *) renderer->pixels + (long) (renderer->height - 1 - y) * renderer->stride
+                           + tile_x * sizeof(uint32_t),
+                   renderer->color + (long) y * stride + tile_x,
+                   (x_end - tile_x) * sizeof(uint32_t));
+    }
+}
+
+/**
+ * Runs a thread's share of a pass: setting up its consecutive share of
+ * the draws, then rasterizing tiles until there are none left.
+ *
+ * @param worker the thread's worker
+ * @param stats the stats to time the pass in, or NULL
+ */
+static void
+run_pass(struct worker *worker, struct soft_stats *stats)
+{
+    struct soft_renderer *renderer = worker->renderer;
+    int ndraws = renderer->pass_end - renderer->pass_begin;
+    int begin = renderer->pass_begin + (long) ndraws * worker->index / renderer->nthreads;
+    int end = renderer->pass_begin + (long) ndraws * (worker->index + 1) / renderer->nthreads;
+    double start = stats ? now_ms() : 0, setup_end;
+    int d, tile;
+
+    worker->ntriangles = 0;
+    for (tile = 0; tile < renderer->ntiles; tile++)
+        worker->bins[tile].count = 0;
+
+    for (d = begin; d < end; d++) {
+        transform_vertices(renderer, worker, &renderer->draws[d]);
+        setup_triangles(renderer, worker, &renderer->draws[d]);
+    }
+
+    pthread_barrier_wait(&renderer->barrier);
+    setup_end = stats ? now_ms() : 0;
+
+    while ((tile = atomic_fetch_add(&renderer->next_tile, 1)) < renderer->ntiles)
+        raster_tile(renderer, tile);
+
+    pthread_barrier_wait(&renderer->barrier);
+
+    if (stats) {
+        stats->geometry_ms += setup_end - start;
+        stats->raster_ms += now_ms() - setup_end;
+    }
+}
+
+static void *
+worker_thread(void *data)
+{
+    struct worker *worker = data;
+    struct soft_renderer *renderer = worker->renderer;
+
+    /* The barrier is only set up once it is known how many threads started */
+    pthread_mutex_lock(&renderer->start);
+    pthread_mutex_unlock(&renderer->start);
+
+    for (;;) {
+        pthread_barrier_wait(&renderer->barrier);
+        if (renderer->quit)
+            return NULL;
+        run_pass(worker, NULL);
+    }
+}
+
+struct soft_renderer *
+soft_renderer_create(int nthreads)
+{
+    struct soft_renderer *renderer;
+    int i;
+
+    if (nthreads < 1)
+        return NULL;
+
+    renderer = calloc(1, sizeof(*renderer));
+    if (!renderer)
+        return NULL;
+
+    renderer->nthreads = nthreads;
+    renderer->workers = calloc(nthreads, sizeof(*renderer->workers));
+    if (!renderer->workers) {
+        free(renderer);
+        return NULL;
+    }
+
+    for (i = 0; i < nthreads; i++) {
+        renderer->workers[i].renderer = renderer;
+        renderer->workers[i].index = i;
+    }
+
+    /* The caller's thread is the first worker */
+    pthread_mutex_init(&renderer->start, NULL);
+    pthread_mutex_lock(&renderer->start);
+    for (i = 1; i < nthreads; i++) {
+        if (pthread_create(&renderer->workers[i].thread, NULL, worker_thread,
+                           &renderer->workers[i]) != 0) {
+            /* Run with the threads there are */
+            renderer->nthreads = i;
+            break;
+        }
+    }
+    pthread_barrier_init(&renderer->barrier, NULL, renderer->nthreads);
+    pthread_mutex_unlock(&renderer->start);
+
+    return renderer;
+}
+
+void
+soft_renderer_destroy(struct soft_renderer *renderer)
+{
+    int i, tile;
+
+    renderer->quit = 1;
+    pthread_barrier_wait(&renderer->barrier);
+    for (i = 1; i < renderer->nthreads; i++)
+        pthread_join(renderer->workers[i].thread, NULL);
+    pthread_barrier_destroy(&renderer->barrier);
+    pthread_mutex_destroy(&renderer->start);
+
+    for (i = 0; i < renderer->nthreads; i++) {
+        struct worker *worker = &renderer->workers[i];
+
+        if (worker->bins) {
+            for (tile = 0; tile < renderer->ntiles; tile++)
+                free(worker->bins[tile].triangles);
+            free(worker->bins);
+        }
+        free(worker->triangles);
+        free(worker->x);
+        free(worker->y);
+        free(worker->z);
+        free(worker->w);
+        free(worker->diffuse);
+    }
+
+    free(renderer->workers);
+    free(renderer->draws);
+    free(renderer->color);
+    free(renderer->depth);
+    free(renderer);
+}
+
+int
+soft_renderer_threads(const struct soft_renderer *renderer)
+{
+    return renderer->nthreads;
+}
+
+void
+soft_begin(struct soft_renderer *renderer, int width, int height, const float light[3])
+{
+    int tiles_x = (width + TILE_SIZE - 1) / TILE_SIZE;
+    int tiles_y = (height + TILE_SIZE - 1) / TILE_SIZE;
+    long pixels = (long) tiles_x * tiles_y * TILE_SIZE * TILE_SIZE;
+    float length = sqrtf(light[0] * light[0] + light[1] * light[1] + light[2] * light[2]);
+    int i, tile;
+
+    if (tiles_x * tiles_y != renderer->ntiles) {
+        for (i = 0; i < renderer->nthreads; i++) {
+            struct worker *worker = &renderer->workers[i];
+
+            if (worker->bins) {
+                for (tile = 0; tile < renderer->ntiles; tile++)
+                    free(worker->bins[tile].triangles);
+                free(worker->bins);
+            }
+            worker->bins = calloc(tiles_x * tiles_y, sizeof(*worker->bins));
+            if (!worker->bins)
+                abort();
+        }
+    }
+
+    if (pixels > renderer->frame_capacity) {
+        free(renderer->color);
+        free(renderer->depth);
+        renderer->color = malloc(pixels * sizeof(*renderer->color));
+        renderer->depth = malloc(pixels * sizeof(*renderer->depth));
+        if (!renderer->color || !renderer->depth)
+            abort();
+        renderer->frame_capacity = pixels;
+    }
+
+    renderer->width = width;
+    renderer->height = height;
+    renderer->tiles_x = tiles_x;
+    renderer->tiles_y = tiles_y;
+    renderer->ntiles = tiles_x * tiles_y;
+    for (i = 0; i < 3; i++)
+        renderer->light[i] = light[i] / length;
+    renderer->ndraws = 0;
+}
+
+void
+soft_draw(struct soft_renderer *renderer, const struct soft_mesh *mesh,
+          const float *model_view_projection, const float *normal_matrix,
+          const float color[4])
+{
+    struct draw *draw;
+
+    renderer->draws = grow(renderer->draws, &renderer->draws_capacity,
+                           renderer->ndraws + 1, sizeof(*renderer->draws));
+    draw = &renderer->draws[renderer->ndraws++];
+    draw->mesh = mesh;
+    memcpy(draw->model_view_projection, model_view_projection, sizeof(draw->model_view_projection));
+    memcpy(draw->normal_matrix, normal_matrix, sizeof(draw->normal_matrix));
+    memcpy(draw->color, color, sizeof(draw->color));
+}
+
+void
+soft_end(struct soft_renderer *renderer, uint32_t *pixels, int stride,
+         struct soft_stats *stats)
+{
+    struct soft_stats pass_stats = { 0 };
+    int begin = 0, i;
+
+    renderer->pixels = pixels;
+    renderer->stride = stride;
+    for (i = 0; i < renderer->nthreads; i++)
+        renderer->workers[i].drawn = renderer->workers[i].visible = 0;
+
+    /* Passes of whole draws, at least one even with nothing to draw */
+    renderer->first_pass = 1;
+    do {
+        int end = begin;
+        long ntriangles = 0;
+
+        while (end < renderer->ndraws &&
+               (end == begin ||
+                ntriangles + renderer->draws[end].mesh->nindices / 3 <= PASS_TRIANGLES)) {
+            ntriangles += renderer->draws[end].mesh->nindices / 3;
+            end++;
+        }
+
+        renderer->pass_begin = begin;
+        renderer->pass_end = end;
+        renderer->last_pass = end == renderer->ndraws;
+        atomic_store(&renderer->next_tile, 0);
+
+        pthread_barrier_wait(&renderer->barrier);
+        run_pass(&renderer->workers[0], &pass_stats);
+
+        renderer->first_pass = 0;
+        begin = end;
+    } while (begin < renderer->ndraws);
+
+    for (i = 0; i < renderer->nthreads; i++) {
+        pass_stats.triangles += renderer->workers[i].drawn;
+        pass_stats.visible += renderer->workers[i].visible;
+    }
+    if (stats)
+        *stats = pass_stats;
+}
@@ -0,0 +1,95 @@
+/*
+ * Software rasterizer for es2gears-wayland, for hosts and devices
+ * without a GPU or EGL.
+ *
+ * It draws indexed triangle lists with the gears' lighting: each vertex
+ * is lit by one directional light, with the diffuse term only, like
+ * es2gears' vertex shader. Colors are not interpolated across triangles;
+ * every triangle takes its first vertex's, which is exact for meshes
+ * like the gears', whose faces each have a single normal. Back faces
+ * are culled and depth is tested as with glEnable(GL_CULL_FACE) and
+ * glDepthFunc(GL_LESS).
+ *
+ * Draws are recorded between soft_begin() and soft_end(), which runs
+ * them on the renderer's threads. Each thread transforms the vertices
+ * and sets up the triangles of its share of the draws, four at a time
+ * with SIMD, and bins them into 64x64 pixel tiles; then the threads
+ * take tiles in turn and rasterize four pixels at a time, depth test
+ * included. Bins are kept in draw order, so the result does not depend
+ * on the number of threads.
+ *
+ * The SIMD code uses SSE2 on x86, NEON on ARM and plain C otherwise,
+ * soft_renderer_implementation() tells which was built; all of them
+ * produce the same pixels.
+ */
+
+#ifndef SOFTRENDER_H
+#define SOFTRENDER_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct soft_renderer;
+
+/** An indexed triangle list */
+struct soft_mesh {
+    /** Vertices with the position at offset 0 and the normal at offset 3 */
+    const float *vertices;
+    /** The number of floats per vertex */
+    int stride;
+    int nvertices;
+    const unsigned short *indices;
+    int nindices;
+};
+
+/** What soft_end() did */
+struct soft_stats {
+    /** Triangles drawn, and those of them facing the viewer and on screen */
+    long triangles, visible;
+    /** Wall time spent setting up and binning triangles, and rasterizing */
+    double geometry_ms, raster_ms;
+};
+
+const char *soft_renderer_implementation(void);
+
+/**
+ * Creates a renderer with nthreads threads, the calling one included.
+ * Returns NULL on failure.
+ */
+struct soft_renderer *soft_renderer_create(int nthreads);
+
+void soft_renderer_destroy(struct soft_renderer *renderer);
+
+int soft_renderer_threads(const struct soft_renderer *renderer);
+
+/**
+ * Starts a frame of width x height pixels, cleared to transparent black,
+ * lit from the direction of light.
+ */
+void soft_begin(struct soft_renderer *renderer, int width, int height,
+                const float light[3]);
+
+/**
+ * Records drawing a mesh. The matrices are column-major like for
+ * glUniformMatrix4fv, and the mesh has to stay valid until soft_end().
+ */
+void soft_draw(struct soft_renderer *renderer, const struct soft_mesh *mesh,
+               const float *model_view_projection, const float *normal_matrix,
+               const float color[4]);
+
+/**
+ * Draws the frame into pixels, premultiplied ARGB8888 from the top row
+ * down, stride bytes apart, like a WL_SHM_FORMAT_ARGB8888 buffer.
+ * Fills in stats if it is not NULL.
+ */
+void soft_end(struct soft_renderer *renderer, uint32_t *pixels, int stride,
+              struct soft_stats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SOFTRENDER_H */
@@ -0,0 +1,584 @@
+/*
+ * Headless benchmark for the shadertoy shader catalogue.
+ *
+ * Renders every .f.glsl shader in shaders/ into an offscreen framebuffer on an
+ * EGL context that needs no compositor (EGL_MESA_platform_surfaceless,
+ * falling back to a pbuffer on the default display), so it also runs on
+ * Mesa llvmpipe on a plain Linux box. Each shader is drawn with the same
+ * quad, uniforms and texture as ShaderToyGLView, at fixed resolutions and
+ * fixed time values, and the per-shader timings are written as JSON.
+ *
+ * Run from the shadertoy/ directory:
+ *
+ *   ./shadertoybench [--size WxH]... [--frames N] [--warmup N] [--root DIR]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <dirent.h>
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#include <GLES2/gl2.h>
+
+#include <jpeglib.h>
+
+#ifndef EGL_PLATFORM_SURFACELESS_MESA
+#define EGL_PLATFORM_SURFACELESS_MESA 0x31DD
+#endif
+
+static const char defaultVertexShader[] =
+        "precision highp float;\n"
+        "attribute vec2 coord2d;\n"
+
+        "void main() {\n"
+        "  gl_Position = vec4(coord2d, 0.0, 1.0);\n"
+        "}\n";
+
+// Simulated frame interval used to step the "time" uniform
+static const float TIME_STEP_S = 1.0f / 60.0f;
+// Start a bit into the animation so shaders are past their trivial first frame
+static const float TIME_START_S = 10.0f;
+
+struct Size {
+    int width;
+    int height;
+};
+
+struct Result {
+    std::string shader;
+    std::string texture;
+    Size size;
+    double compileMs;
+    std::vector<double> frameMs;
+};
+
+static double
+nowMs()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static bool
+readFile(const std::string &filename, std::string &data)
+{
+    FILE *file = fopen(filename.c_str(), "rb");
+    if (!file)
+        return false;
+
+    char buf[4096];
+    size_t n;
+    data.clear();
+    while ((n = fread(buf, 1, sizeof buf, file)) > 0)
+        data.append(buf, n);
+
+    fclose(file);
+    return true;
+}
+
+static bool
+fileExists(const std::string &filename)
+{
+    FILE *file = fopen(filename.c_str(), "rb");
+    if (!file)
+        return false;
+    fclose(file);
+    return true;
+}
+
+/*
+ * The shader -> texture mapping lives in FirstPage.qml. Pick it up from
+ * there so the benchmark runs each shader the way the app does, instead
+ * of keeping a second copy of the table here.
+ */
+static std::map<std::string, std::string>
+loadTextureMap(const std::string &qmlFilename)
+{
+    std::map<std::string, std::string> textures;
+    std::string qml;
+
+    if (!readFile(qmlFilename, qml)) {
+        fprintf(stderr, "could not read %s, running without texture map\n", qmlFilename.c_str());
+        return textures;
+    }
+
+    static const char shaderKey[] = "fragmentShader: \":/foo/";
+    static const char textureKey[] = "texture: \":/foo/";
+
+    size_t pos = 0;
+    while ((pos = qml.find("ListElement", pos)) != std::string::npos) {
+        size_t end = qml.find('}', pos);
+        std::string element = qml.substr(pos, end - pos);
+        pos = end;
+
+        size_t s = element.find(shaderKey);
+        if (s == std::string::npos)
+            continue;
+
+        // Listed without a texture means the app binds none
+        s += sizeof shaderKey - 1;
+        std::string &texture = textures[element.substr(s, element.find('"', s) - s)];
+
+        size_t t = element.find(textureKey);
+        if (t != std::string::npos) {
+            t += sizeof textureKey - 1;
+            texture = element.substr(t, element.find('"', t) - t);
+        }
+    }
+
+    return textures;
+}
+
+static std::vector<std::string>
+listFragmentShaders(const std::string &dirname)
+{
+    std::vector<std::string> shaders;
+    DIR *dir = opendir(dirname.c_str());
+    if (!dir)
+        return shaders;
+
+    static const char suffix[] = ".f.glsl";
+    const size_t suffixLen = sizeof suffix - 1;
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        std::string name = entry->d_name;
+        if (name.size() > suffixLen && name.compare(name.size() - suffixLen, suffixLen, suffix) == 0)
+            shaders.push_back(name);
+    }
+    closedir(dir);
+
+    std::sort(shaders.begin(), shaders.end());
+    return shaders;
+}
+
+/*
+ * Decodes a JPEG and uploads it bottom-up, matching
+ * QImage(textureFilename).mirrored() in ShaderToyGLView.
+ */
+static GLuint
+loadTexture(const std::string &filename)
+{
+    FILE *file = fopen(filename.c_str(), "rb");
+    if (!file) {
+        fprintf(stderr, "could not open texture %s\n", filename.c_str());
+        return 0;
+    }
+
+    jpeg_decompress_struct cinfo;
+    jpeg_error_mgr jerr;
+    cinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_decompress(&cinfo);
+    jpeg_stdio_src(&cinfo, file);
+    jpeg_read_header(&cinfo, TRUE);
+    cinfo.out_color_space = JCS_RGB;
+    jpeg_start_decompress(&cinfo);
+
+    const int width = cinfo.output_width;
+    const int height = cinfo.output_height;
+    const int stride = width * 3;
+    std::vector<unsigned char> pixels(stride * height);
+
+    while (cinfo.output_scanline < cinfo.output_height) {
+        JSAMPROW row = &pixels[(height - 1 - cinfo.output_scanline) * stride];
+        jpeg_read_scanlines(&cinfo, &row, 1);
+    }
+
+    jpeg_finish_decompress(&cinfo);
+    jpeg_destroy_decompress(&cinfo);
+    fclose(file);
+
+    GLuint texture;
+    glGenTextures(1, &texture);
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, &pixels[0]);
+    glGenerateMipmap(GL_TEXTURE_2D);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+
+    return texture;
+}
+
+static GLuint
+compileShader(GLenum type, const std::string &source)
+{
+    const char *p = source.c_str();
+    GLuint shader = glCreateShader(type);
+    glShaderSource(shader, 1, &p, NULL);
+    glCompileShader(shader);
+
+    GLint ok = 0;
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &ok);
+    if (!ok) {
+        char msg[1024];
+        glGetShaderInfoLog(shader, sizeof msg, NULL, msg);
+        fprintf(stderr, "shader compile failed: %s\n", msg);
+        glDeleteShader(shader);
+        return 0;
+    }
+    return shader;
+}
+
+static GLuint
+linkProgram(const std::string &vertexSource, const std::string &fragmentSource)
+{
+    GLuint v = compileShader(GL_VERTEX_SHADER, vertexSource);
+    GLuint f = compileShader(GL_FRAGMENT_SHADER, fragmentSource);
+    if (!v || !f)
+        return 0;
+
+    GLuint program = glCreateProgram();
+    glAttachShader(program, v);
+    glAttachShader(program, f);
+    glBindAttribLocation(program, 0, "coord2d");
+    glLinkProgram(program);
+    glDeleteShader(v);
+    glDeleteShader(f);
+
+    GLint ok = 0;
+    glGetProgramiv(program, GL_LINK_STATUS, &ok);
+    if (!ok) {
+        char msg[1024];
+        glGetProgramInfoLog(program, sizeof msg, NULL, msg);
+        fprintf(stderr, "program link failed: %s\n", msg);
+        glDeleteProgram(program);
+        return 0;
+    }
+    return program;
+}
+
+static bool
+initEGL(EGLDisplay *display, EGLContext *context)
+{
+    EGLDisplay dpy = EGL_NO_DISPLAY;
+    EGLint major, minor;
+
+    PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay =
+            (PFNEGLGETPLATFORMDISPLAYEXTPROC) eglGetProcAddress("eglGetPlatformDisplayEXT");
+    if (getPlatformDisplay)
+        dpy = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+
+    if (dpy == EGL_NO_DISPLAY || !eglInitialize(dpy, &major, &minor)) {
+        dpy = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+        if (dpy == EGL_NO_DISPLAY || !eglInitialize(dpy, &major, &minor)) {
+            fprintf(stderr, "could not initialize EGL\n");
+            return false;
+        }
+    }
+
+    eglBindAPI(EGL_OPENGL_ES_API);
+
+    static const EGLint configAttribs[] = {
+        EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+        EGL_RENDERABLE_TYPE, EGL_OPENGL_ES2_BIT,
+        EGL_NONE
+    };
+    static const EGLint contextAttribs[] = {
+        EGL_CONTEXT_CLIENT_VERSION, 2,
+        EGL_NONE
+    };
+
+    EGLConfig config;
+    EGLint n = 0;
+    if (!eglChooseConfig(dpy, configAttribs, &config, 1, &n) || n < 1) {
+        fprintf(stderr, "no pbuffer capable GLES2 config\n");
+        return false;
+    }
+
+    EGLContext ctx = eglCreateContext(dpy, config, EGL_NO_CONTEXT, contextAttribs);
+    if (ctx == EGL_NO_CONTEXT) {
+        fprintf(stderr, "could not create GLES2 context\n");
+        return false;
+    }
+
+    // All rendering goes to an FBO; the pbuffer only makes the context
+    // current on drivers without EGL_KHR_surfaceless_context.
+    static const EGLint pbufferAttribs[] = { EGL_WIDTH, 1, EGL_HEIGHT, 1, EGL_NONE };
+    EGLSurface surface = EGL_NO_SURFACE;
+    const char *extensions = eglQueryString(dpy, EGL_EXTENSIONS);
+    if (!extensions || !strstr(extensions, "EGL_KHR_surfaceless_context"))
+        surface = eglCreatePbufferSurface(dpy, config, pbufferAttribs);
+
+    if (!eglMakeCurrent(dpy, surface, surface, ctx)) {
+        fprintf(stderr, "eglMakeCurrent failed\n");
+        return false;
+    }
+
+    *display = dpy;
+    *context = ctx;
+    return true;
+}
+
+static double
+percentile(std::vector<double> sorted, double p)
+{
+    // Nearest-rank percentile
+    size_t rank = (size_t) (p / 100.0 * sorted.size() + 0.5);
+    if (rank < 1)
+        rank = 1;
+    if (rank > sorted.size())
+        rank = sorted.size();
+    return sorted[rank - 1];
+}
+
+// Quotes a string for JSON, escaping what JSON needs escaped
+static std::string
+jsonString(const std::string &s)
+{
+    std::string quoted = "\"";
+    for (size_t i = 0; i < s.size(); i++) {
+        unsigned char c = s[i];
+        if (c == '"' || c == '\\') {
+            quoted += '\\';
+            quoted += c;
+        } else if (c < 0x20) {
+            char escape[8];
+            snprintf(escape, sizeof escape, "\\u%04x", c);
+            quoted += escape;
+        } else {
+            quoted += c;
+        }
+    }
+    return quoted + '"';
+}
+
+static void
+printJson(const std::vector<Result> &results, const char *renderer, int frames)
+{
+    printf("{\n");
+    printf("  \"renderer\": %s,\n", jsonString(renderer).c_str());
+    printf("  \"frames\": %d,\n", frames);
+    printf("  \"results\": [\n");
+
+    for (size_t i = 0; i < results.size(); i++) {
+        const Result &r = results[i];
+        std::vector<double> sorted = r.frameMs;
+        std::sort(sorted.begin(), sorted.end());
+
+        double total = 0;
+        for (size_t j = 0; j < sorted.size(); j++)
+            total += sorted[j];
+        double mean = sorted.empty() ? 0 : total / sorted.size();
+        double mpixels = mean > 0 ? (double) r.size.width * r.size.height / (mean * 1000.0) : 0;
+
+        printf("    {\"shader\": %s, \"texture\": %s, \"width\": %d, \"height\": %d, "
+               "\"compile_ms\": %.3f, \"ms_per_frame\": %.3f, \"p50_ms\": %.3f, \"p95_ms\": %.3f, "
+               "\"p99_ms\": %.3f, \"mpixels_per_s\": %.2f}%s\n",
+               jsonString(r.shader).c_str(), jsonString(r.texture).c_str(),
+               r.size.width, r.size.height,
+               r.compileMs, mean,
+               sorted.empty() ? 0 : percentile(sorted, 50),
+               sorted.empty() ? 0 : percentile(sorted, 95),
+               sorted.empty() ? 0 : percentile(sorted, 99),
+               mpixels, i + 1 < results.size() ? "," : "");
+    }
+
+    printf("  ]\n");
+    printf("}\n");
+}
+
+static void
+usage(int error_code)
+{
+    fprintf(stderr, "Usage: shadertoybench [OPTIONS]\n\n"
+            "  --size WxH\tRender size, may be given several times (default 270x480 and 540x960)\n"
+            "  --frames N\tMeasured frames per shader and size (default 60)\n"
+            "  --warmup N\tUnmeasured frames before measuring (default 5)\n"
+            "  --root DIR\tshadertoy source directory (default .)\n"
+            "  -h\t\tThis help text\n\n");
+
+    exit(error_code);
+}
+
+int
+main(int argc, char **argv)
+{
+    std::vector<Size> sizes;
+    std::string root = ".";
+    int frames = 60;
+    int warmup = 5;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp("--size", argv[i]) == 0 && i + 1 < argc) {
+            Size size;
+            if (sscanf(argv[++i], "%dx%d", &size.width, &size.height) != 2
+                    || size.width <= 0 || size.height <= 0)
+                usage(EXIT_FAILURE);
+            sizes.push_back(size);
+        } else if (strcmp("--frames", argv[i]) == 0 && i + 1 < argc) {
+            frames = atoi(argv[++i]);
+        } else if (strcmp("--warmup", argv[i]) == 0 && i + 1 < argc) {
+            warmup = atoi(argv[++i]);
+        } else if (strcmp("--root", argv[i]) == 0 && i + 1 < argc) {
+            root = argv[++i];
+        } else if (strcmp("-h", argv[i]) == 0) {
+            usage(EXIT_SUCCESS);
+        } else {
+            usage(EXIT_FAILURE);
+        }
+    }
+
+    if (frames < 1)
+        usage(EXIT_FAILURE);
+
+    if (sizes.empty()) {
+        // Half and full Jolla portrait resolution
+        Size half = { 270, 480 };
+        Size full = { 540, 960 };
+        sizes.push_back(half);
+        sizes.push_back(full);
+    }
+
+    EGLDisplay display;
+    EGLContext context;
+    if (!initEGL(&display, &context))
+        return EXIT_FAILURE;
+
+    const char *renderer = (const char *) glGetString(GL_RENDERER);
+    fprintf(stderr, "renderer: %s\n", renderer);
+
+    std::map<std::string, std::string> textureMap = loadTextureMap(root + "/qml/pages/FirstPage.qml");
+    std::vector<std::string> shaders = listFragmentShaders(root + "/shaders");
+    if (shaders.empty()) {
+        fprintf(stderr, "no shaders found in %s/shaders\n", root.c_str());
+        return EXIT_FAILURE;
+    }
+
+    GLfloat triangle_vertices[] = {
+        -1.0, -1.0,
+        1.0, -1.0,
+        -1.0,  1.0,
+        1.0, -1.0,
+        1.0,  1.0,
+        -1.0,  1.0
+    };
+
+    GLuint vbo;
+    glGenBuffers(1, &vbo);
+    glBindBuffer(GL_ARRAY_BUFFER, vbo);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(triangle_vertices), triangle_vertices, GL_STATIC_DRAW);
+    glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, 0);
+    glEnableVertexAttribArray(0);
+
+    std::map<std::string, GLuint> textures;
+    std::vector<Result> results;
+
+    for (size_t s = 0; s < shaders.size(); s++) {
+        const std::string &name = shaders[s];
+        std::string fragmentSource, vertexSource;
+
+        if (!readFile(root + "/shaders/" + name, fragmentSource)) {
+            fprintf(stderr, "could not read %s\n", name.c_str());
+            continue;
+        }
+
+        // triangle.f.glsl pairs with triangle.v.glsl; everything else
+        // uses the built-in quad vertex shader like the app does.
+        std::string vertexName = name.substr(0, name.size() - strlen(".f.glsl")) + ".v.glsl";
+        if (!readFile(root + "/shaders/" + vertexName, vertexSource))
+            vertexSource = defaultVertexShader;
+
+        std::string textureName;
+        std::map<std::string, std::string>::const_iterator it = textureMap.find("shaders/" + name);
+        if (it != textureMap.end())
+            textureName = it->second;
+        else if (fragmentSource.find("texture2D(tex0") != std::string::npos)
+            // Not listed in the app but samples tex0; don't time an
+            // incomplete texture.
+            textureName = "textures/texl0.jpg";
+
+        if (!textureName.empty() && !textures.count(textureName)
+                && fileExists(root + "/" + textureName))
+            textures[textureName] = loadTexture(root + "/" + textureName);
+
+        for (size_t z = 0; z < sizes.size(); z++) {
+            const Size &size = sizes[z];
+            Result result;
+            result.shader = name;
+            result.texture = textureName;
+            result.size = size;
+
+            // Time compile + link per size as well, so that each row
+            // stands on its own; drivers may cache the second one.
+            double start = nowMs();
+            GLuint program = linkProgram(vertexSource, fragmentSource);
+            glFinish();
+            result.compileMs = nowMs() - start;
+
+            if (!program) {
+                fprintf(stderr, "skipping %s\n", name.c_str());
+                break;
+            }
+
+            GLuint colorTexture, fbo;
+            glGenTextures(1, &colorTexture);
+            glBindTexture(GL_TEXTURE_2D, colorTexture);
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, size.width, size.height, 0,
+                         GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+            glGenFramebuffers(1, &fbo);
+            glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+            glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, colorTexture, 0);
+
+            if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+                fprintf(stderr, "incomplete framebuffer at %dx%d\n", size.width, size.height);
+                return EXIT_FAILURE;
+            }
+
+            glViewport(0, 0, size.width, size.height);
+            glUseProgram(program);
+
+            GLint unif_time = glGetUniformLocation(program, "time");
+            GLint unif_resolution = glGetUniformLocation(program, "resolution");
+            GLint unif_tex0 = glGetUniformLocation(program, "tex0");
+
+            glUniform2f(unif_resolution, size.width, size.height);
+            if (unif_tex0 != -1 && !textureName.empty()) {
+                glUniform1i(unif_tex0, 0);
+                glActiveTexture(GL_TEXTURE0);
+                glBindTexture(GL_TEXTURE_2D, textures[textureName]);
+            }
+
+            for (int f = -warmup; f < frames; f++) {
+                // Fixed time values so every run draws exactly the same frames
+                glUniform1f(unif_time, TIME_START_S + f * TIME_STEP_S);
+
+                double frameStart = nowMs();
+                glClear(GL_COLOR_BUFFER_BIT);
+                glDrawArrays(GL_TRIANGLES, 0, 6);
+                glFinish();
+                double frameMs = nowMs() - frameStart;
+
+                if (f >= 0)
+                    result.frameMs.push_back(frameMs);
+            }
+
+            fprintf(stderr, "%-20s %4dx%-4d done\n", name.c_str(), size.width, size.height);
+            results.push_back(result);
+
+            glBindFramebuffer(GL_FRAMEBUFFER, 0);
+            glDeleteFramebuffers(1, &fbo);
+            glDeleteTextures(1, &colorTexture);
+            glDeleteProgram(program);
+        }
+    }
+
+    printJson(results, renderer, frames);
+
+    eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+    eglDestroyContext(display, context);
+    eglTerminate(display);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,140 @@
+#include "framescheduler.h"
+
+// Interval for the presented / dropped frames log line
+static const qint64 REPORT_INTERVAL_MS = 5000;
+
+FrameScheduler::FrameScheduler(QQuickWindow *window, QObject *parent)
+    : QObject(parent)
+    , window(window)
+    , lastSwapMs(-1)
+    , reportStartMs(0)
+    , _targetFps(60.f)
+    , _skipStaticFrames(true)
+    , animated(1)
+    , running(false)
+    , _presentedFrames(0)
+    , _droppedFrames(0)
+    , reportPresented(0)
+    , reportDropped(0)
+{
+    // frameSwapped() comes from the render thread; the default
+    // connection queues it onto ours, where update() is safe to call.
+    connect(window, SIGNAL(frameSwapped()), this, SLOT(frameSwapped()));
+
+    skipTimer.setSingleShot(true);
+    skipTimer.setTimerType(Qt::PreciseTimer);
+    connect(&skipTimer, SIGNAL(timeout()), this, SLOT(requestUpdate()));
+
+    clock.start();
+}
+
+void
+FrameScheduler::start()
+{
+    running = true;
+    animated = 1;
+    lastSwapMs = -1;
+    reportStartMs = clock.elapsed();
+    reportPresented = 0;
+    reportDropped = 0;
+
+    requestUpdate();
+}
+
+void
+FrameScheduler::stop()
+{
+    running = false;
+    skipTimer.stop();
+}
+
+void
+FrameScheduler::setTargetFps(qreal fps)
+{
+    if (fps <= 0)
+        return;
+
+    _targetFps = fps;
+    lastSwapMs = -1;
+}
+
+void
+FrameScheduler::setSkipStaticFrames(bool skip)
+{
+    _skipStaticFrames = skip;
+
+    if (running && !skip)
+        requestUpdate();
+}
+
+void
+FrameScheduler::setAnimated(bool animated)
+{
+    this->animated = animated ? 1 : 0;
+}
+
+qreal
+FrameScheduler::refreshRate() const
+{
+    QScreen *screen = window->screen();
+    qreal rate = screen ? screen->refreshRate() : 0;
+
+    return rate > 0 ? rate : 60.f;
+}
+
+void
+FrameScheduler::requestUpdate()
+{
+    if (running)
+        window->update();
+}
+
+void
+FrameScheduler::frameSwapped()
+{
+    if (!running)
+        return;
+
+    const qreal refresh = refreshRate();
+    const qreal target = qMin(_targetFps, refresh);
+    const qreal intervalMs = 1000.f / target;
+    const qint64 now = clock.elapsed();
+
+    if (lastSwapMs >= 0) {
+        // A frame is late once it misses its vsync by more than half an
+        // interval; every whole interval beyond that is a dropped frame.
+        int missed = qRound((now - lastSwapMs) / intervalMs) - 1;
+        if (missed > 0) {
+            _droppedFrames += missed;
+            reportDropped += missed;
+        }
+    }
+
+    lastSwapMs = now;
+    _presentedFrames++;
+    reportPresented++;
+
+    if (now - reportStartMs >= REPORT_INTERVAL_MS) {
+        qDebug() << reportPresented << "frames presented," << reportDropped << "dropped in"
+                 << (now - reportStartMs) << "ms, target" << target << "fps";
+        reportStartMs = now;
+        reportPresented = 0;
+        reportDropped = 0;
+        emit statsChanged();
+    }
+
+    if (_skipStaticFrames && !animated) {
+        // Nothing changes between frames; the scene graph will still
+        // redraw on its own for resizes and UI changes.
+        lastSwapMs = -1;
+        return;
+    }
+
+    // An update() now is presented on the next vsync. For lower target
+    // rates, hold it back until the vsyncs to skip have passed.
+    const qreal waitMs = intervalMs - 1000.f / refresh;
+    if (waitMs < 1.f)
+        requestUpdate();
+    else
+        skipTimer.start(qRound(waitMs));
+}
@@ -0,0 +1,68 @@
+#ifndef FRAMESCHEDULER_H
+#define FRAMESCHEDULER_H
+
+#include <QtGui>
+#include <QtQuick>
+
+/*
+ * Paces redraws of a QQuickWindow off its own frameSwapped() signal
+ * instead of a free running timer, so that frames line up with the
+ * display refresh.
+ *
+ * Rendering at the display rate simply asks for the next frame as soon as
+ * the previous one was swapped. Lower target rates wait out the vsyncs
+ * that should be skipped before asking. Intervals longer than the target
+ * are counted as dropped frames. Content that does not depend on time is
+ * drawn once and then left alone until start() is called again.
+ */
+class FrameScheduler : public QObject
+{
+    Q_OBJECT
+
+public:
+    FrameScheduler(QQuickWindow *window, QObject *parent = 0);
+
+    void start();
+    void stop();
+
+    qreal targetFps() const { return _targetFps; }
+    void setTargetFps(qreal fps);
+
+    bool skipStaticFrames() const { return _skipStaticFrames; }
+    void setSkipStaticFrames(bool skip);
+
+    // May be called from the render thread
+    void setAnimated(bool animated);
+
+    int presentedFrames() const { return _presentedFrames; }
+    int droppedFrames() const { return _droppedFrames; }
+
+signals:
+    void statsChanged();
+
+private slots:
+    void frameSwapped();
+    void requestUpdate();
+
+private:
+    qreal refreshRate() const;
+
+    QQuickWindow *window;
+    QTimer skipTimer;
+    QElapsedTimer clock;
+
+    qint64 lastSwapMs;
+    qint64 reportStartMs;
+
+    qreal _targetFps;
+    bool _skipStaticFrames;
+    QAtomicInt animated;
+    bool running;
+
+    int _presentedFrames;
+    int _droppedFrames;
+    int reportPresented;
+    int reportDropped;
+};
+
+#endif // FRAMESCHEDULER_H
@@ -0,0 +1,121 @@
+#include "ktxtexture.h"
+
+static const uchar KTX_IDENTIFIER[12] = {
+    0xAB, 'K', 'T', 'X', ' ', '1', '1', 0xBB, '\r', '\n', 0x1A, '\n'
+};
+static const int KTX_HEADER_SIZE = 64;
+
+#ifndef GL_ETC1_RGB8_OES
+#define GL_ETC1_RGB8_OES 0x8D64
+#endif
+
+KtxTexture::KtxTexture(const QByteArray &data)
+    : _valid(false)
+    , glType(0)
+    , glFormat(0)
+    , glInternalFormat(0)
+    , _width(0)
+    , _height(0)
+{
+    const uchar *p = (const uchar *) data.constData();
+
+    if (data.size() < KTX_HEADER_SIZE || memcmp(p, KTX_IDENTIFIER, sizeof KTX_IDENTIFIER) != 0)
+        return;
+
+    // Written on the build host; big endian files are not worth supporting
+    if (qFromLittleEndian<quint32>(p + 12) != 0x04030201)
+        return;
+
+    glType = qFromLittleEndian<quint32>(p + 16);
+    glFormat = qFromLittleEndian<quint32>(p + 24);
+    glInternalFormat = qFromLittleEndian<quint32>(p + 28);
+    _width = qFromLittleEndian<quint32>(p + 36);
+    _height = qFromLittleEndian<quint32>(p + 40);
+    const quint32 depth = qFromLittleEndian<quint32>(p + 44);
+    const quint32 arrayElements = qFromLittleEndian<quint32>(p + 48);
+    const quint32 faces = qFromLittleEndian<quint32>(p + 52);
+    const quint32 levels = qMax(1u, qFromLittleEndian<quint32>(p + 56));
+    const quint32 keyValueBytes = qFromLittleEndian<quint32>(p + 60);
+
+    if (depth > 0 || arrayElements > 0 || faces != 1 || _width <= 0 || _height <= 0)
+        return;
+
+    qint64 offset = KTX_HEADER_SIZE + keyValueBytes;
+    for (quint32 level = 0; level < levels; level++) {
+        if (offset + 4 > data.size())
+            return;
+
+        const quint32 imageSize = qFromLittleEndian<quint32>(p + offset);
+        offset += 4;
+        if (offset + imageSize > data.size())
+            return;
+
+        levelData.append(QByteArray::fromRawData(data.constData() + offset, imageSize));
+        offset += (imageSize + 3) & ~3;
+    }
+
+    _valid = true;
+}
+
+qint64
+KtxTexture::dataSize() const
+{
+    qint64 size = 0;
+    for (int level = 0; level < levelData.size(); level++)
+        size += levelData.at(level).size();
+    return size;
+}
+
+QString
+KtxTexture::formatName() const
+{
+    switch (glInternalFormat) {
+    case GL_ETC1_RGB8_OES:
+        return "ETC1";
+    case GL_RGBA:
+        return "RGBA8";
+    default:
+        return QString("0x%1").arg(glInternalFormat, 0, 16);
+    }
+}
+
+GLuint
+KtxTexture::upload() const
+{
+    if (!_valid)
+        return 0;
+
+    // Only errors from this upload should count
+    while (glGetError() != GL_NO_ERROR)
+        ;
+
+    GLuint texture;
+    glGenTextures(1, &texture);
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+
+    int width = _width, height = _height;
+    for (int level = 0; level < levelData.size(); level++) {
+        const QByteArray &image = levelData.at(level);
+
+        if (isCompressed())
+            glCompressedTexImage2D(GL_TEXTURE_2D, level, glInternalFormat, width, height, 0,
+                                   image.size(), image.constData());
+        else
+            glTexImage2D(GL_TEXTURE_2D, level, glInternalFormat, width, height, 0,
+                         glFormat, glType, image.constData());
+
+        width = qMax(1, width / 2);
+        height = qMax(1, height / 2);
+    }
+
+    if (glGetError() != GL_NO_ERROR) {
+        glDeleteTextures(1, &texture);
+        return 0;
+    }
+
+    const bool mipmapped = levelData.size() > 1;
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, mipmapped ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    return texture;
+}
@@ -0,0 +1,43 @@
+#ifndef KTXTEXTURE_H
+#define KTXTEXTURE_H
+
+#include <QtGui>
+
+/*
+ * A KTX 1.1 texture read in place from memory, as stored in a
+ * ShaderPack. Mip levels come precomputed from the file, so nothing is
+ * generated on the device. Only what the shadertoy textures need is
+ * supported: 2D, one face, no arrays, written little endian, with every
+ * mip level present in the file.
+ */
+class KtxTexture
+{
+public:
+    // data has to stay alive for as long as this object
+    KtxTexture(const QByteArray &data);
+
+    bool isValid() const { return _valid; }
+    bool isCompressed() const { return glFormat == 0; }
+    GLenum internalFormat() const { return glInternalFormat; }
+    int width() const { return _width; }
+    int height() const { return _height; }
+    int levels() const { return levelData.size(); }
+    // Image data of all levels, what upload() hands to GL
+    qint64 dataSize() const;
+    QString formatName() const;
+
+    // Uploads every level into a new texture object, bound to
+    // GL_TEXTURE_2D; returns 0 on failure
+    GLuint upload() const;
+
+private:
+    bool _valid;
+    GLenum glType;
+    GLenum glFormat;
+    GLenum glInternalFormat;
+    int _width;
+    int _height;
+    QVector<QByteArray> levelData;
+};
+
+#endif // KTXTEXTURE_H
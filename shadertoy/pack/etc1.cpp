@@ -0,0 +1,248 @@
+#include "etc1.h"
+
+#include <limits.h>
+#include <string.h>
+
+static const int modifierTables[8][2] = {
+    { 2, 8 }, { 5, 17 }, { 9, 29 }, { 13, 42 },
+    { 18, 60 }, { 24, 80 }, { 33, 106 }, { 47, 183 }
+};
+
+// Pixel index value (msb << 1 | lsb) -> modifier
+static const int modifierSign[4] = { 1, 1, -1, -1 };
+static const int modifierSize[4] = { 0, 1, 0, 1 };
+
+static inline int
+clamp255(int v)
+{
+    return v < 0 ? 0 : (v > 255 ? 255 : v);
+}
+
+static inline int
+sq(int v)
+{
+    return v * v;
+}
+
+struct SubBlock {
+    int pixels[8];  // indices into the 16 block pixels, y * 4 + x
+};
+
+struct Encoding {
+    int error;
+    int flip;
+    int diff;
+    int base[2][3];   // quantized, 4 or 5 bits
+    int color[2][3];  // expanded to 8 bits
+    int table[2];
+    int indices[16];  // per pixel, y * 4 + x
+};
+
+static void
+subBlocks(int flip, SubBlock sub[2])
+{
+    for (int i = 0; i < 8; i++) {
+        if (!flip) {
+            // Two 2x4 halves, left and right
+            sub[0].pixels[i] = (i / 2) * 4 + (i % 2);
+            sub[1].pixels[i] = (i / 2) * 4 + (i % 2) + 2;
+        } else {
+            // Two 4x2 halves, top and bottom
+            sub[0].pixels[i] = (i / 4) * 4 + (i % 4);
+            sub[1].pixels[i] = (i / 4 + 2) * 4 + (i % 4);
+        }
+    }
+}
+
+/*
+ * Picks the modifier table and the per pixel modifiers for one sub-block
+ * around the given base colour; returns the squared error.
+ */
+static int
+fitSubBlock(const uint8_t block[16][3], const SubBlock &sub, const int color[3],
+            int *table, int indices[16])
+{
+    int bestError = INT_MAX;
+
+    for (int t = 0; t < 8; t++) {
+        int error = 0;
+        int chosen[8];
+
+        for (int i = 0; i < 8 && error < bestError; i++) {
+            const uint8_t *p = block[sub.pixels[i]];
+            int best = INT_MAX;
+
+            for (int m = 0; m < 4; m++) {
+                int d = modifierSign[m] * modifierTables[t][modifierSize[m]];
+                int e = sq(clamp255(color[0] + d) - p[0])
+                        + sq(clamp255(color[1] + d) - p[1])
+                        + sq(clamp255(color[2] + d) - p[2]);
+                if (e < best) {
+                    best = e;
+                    chosen[i] = m;
+                }
+            }
+            error += best;
+        }
+
+        if (error < bestError) {
+            bestError = error;
+            *table = t;
+            for (int i = 0; i < 8; i++)
+                indices[sub.pixels[i]] = chosen[i];
+        }
+    }
+
+    return bestError;
+}
+
+static void
+average(const uint8_t block[16][3], const SubBlock &sub, float avg[3])
+{
+    for (int c = 0; c < 3; c++) {
+        int sum = 0;
+        for (int i = 0; i < 8; i++)
+            sum += block[sub.pixels[i]][c];
+        avg[c] = sum / 8.f;
+    }
+}
+
+static bool
+tryMode(const uint8_t block[16][3], int flip, int diff, Encoding *out)
+{
+    SubBlock sub[2];
+    float avg[2][3];
+    Encoding e;
+
+    subBlocks(flip, sub);
+    average(block, sub[0], avg[0]);
+    average(block, sub[1], avg[1]);
+
+    e.flip = flip;
+    e.diff = diff;
+
+    for (int s = 0; s < 2; s++) {
+        for (int c = 0; c < 3; c++) {
+            if (diff) {
+                e.base[s][c] = (int) (avg[s][c] * 31.f / 255.f + 0.5f);
+                e.color[s][c] = (e.base[s][c] << 3) | (e.base[s][c] >> 2);
+            } else {
+                e.base[s][c] = (int) (avg[s][c] * 15.f / 255.f + 0.5f);
+                e.color[s][c] = (e.base[s][c] << 4) | e.base[s][c];
+            }
+        }
+    }
+
+    // The second colour is stored as a 3 bit signed delta from the first
+    if (diff)
+        for (int c = 0; c < 3; c++)
+            if (e.base[1][c] - e.base[0][c] < -4 || e.base[1][c] - e.base[0][c] > 3)
+                return false;
+
+    e.error = fitSubBlock(block, sub[0], e.color[0], &e.table[0], e.indices)
+            + fitSubBlock(block, sub[1], e.color[1], &e.table[1], e.indices);
+
+    if (e.error < out->error)
+        *out = e;
+    return true;
+}
+
+static void
+packBlock(const Encoding &e, uint8_t out[8])
+{
+    uint32_t high = 0, low = 0;
+
+    if (e.diff) {
+        for (int c = 0; c < 3; c++) {
+            int delta = (e.base[1][c] - e.base[0][c]) & 7;
+            high |= (uint32_t) ((e.base[0][c] << 3) | delta) << (24 - c * 8);
+        }
+    } else {
+        for (int c = 0; c < 3; c++)
+            high |= (uint32_t) ((e.base[0][c] << 4) | e.base[1][c]) << (24 - c * 8);
+    }
+
+    high |= e.table[0] << 5;
+    high |= e.table[1] << 2;
+    high |= e.diff << 1;
+    high |= e.flip;
+
+    // Pixel bits are stored column by column
+    for (int x = 0; x < 4; x++) {
+        for (int y = 0; y < 4; y++) {
+            int bit = x * 4 + y;
+            int index = e.indices[y * 4 + x];
+            low |= (uint32_t) (index >> 1) << (bit + 16);
+            low |= (uint32_t) (index & 1) << bit;
+        }
+    }
+
+    for (int i = 0; i < 4; i++) {
+        out[i] = high >> (24 - i * 8);
+        out[i + 4] = low >> (24 - i * 8);
+    }
+}
+
+int
+etc1Size(int width, int height)
+{
+    return ((width + 3) / 4) * ((height + 3) / 4) * 8;
+}
+
+std::vector<uint8_t>
+etc1Encode(const uint8_t *rgb, int width, int height)
+{
+    std::vector<uint8_t> out(etc1Size(width, height));
+    uint8_t *dst = &out[0];
+
+    for (int by = 0; by < height; by += 4) {
+        for (int bx = 0; bx < width; bx += 4) {
+            uint8_t block[16][3];
+
+            for (int y = 0; y < 4; y++) {
+                for (int x = 0; x < 4; x++) {
+                    int sx = bx + x < width ? bx + x : width - 1;
+                    int sy = by + y < height ? by + y : height - 1;
+                    memcpy(block[y * 4 + x], rgb + (sy * width + sx) * 3, 3);
+                }
+            }
+
+            Encoding best;
+            best.error = INT_MAX;
+            for (int flip = 0; flip < 2; flip++) {
+                tryMode(block, flip, 1, &best);
+                tryMode(block, flip, 0, &best);
+            }
+
+            packBlock(best, dst);
+            dst += 8;
+        }
+    }
+
+    return out;
+}
+
+std::vector<uint8_t>
+downsample(const uint8_t *rgb, int width, int height, int *outWidth, int *outHeight)
+{
+    const int w = width > 1 ? width / 2 : 1;
+    const int h = height > 1 ? height / 2 : 1;
+    std::vector<uint8_t> out(w * h * 3);
+
+    for (int y = 0; y < h; y++) {
+        for (int x = 0; x < w; x++) {
+            int x0 = x * 2, x1 = x0 + 1 < width ? x0 + 1 : x0;
+            int y0 = y * 2, y1 = y0 + 1 < height ? y0 + 1 : y0;
+
+            for (int c = 0; c < 3; c++) {
+                int sum = rgb[(y0 * width + x0) * 3 + c] + rgb[(y0 * width + x1) * 3 + c]
+                        + rgb[(y1 * width + x0) * 3 + c] + rgb[(y1 * width + x1) * 3 + c];
+                out[(y * w + x) * 3 + c] = (sum + 2) / 4;
+            }
+        }
+    }
+
+    *outWidth = w;
+    *outHeight = h;
+    return out;
+}
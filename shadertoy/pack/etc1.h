@@ -0,0 +1,29 @@
+#ifndef ETC1_H
+#define ETC1_H
+
+#include <stdint.h>
+#include <vector>
+
+#define ETC1_RGB8_OES 0x8D64
+
+/*
+ * Minimal ETC1 encoder for the shadertoy textures.
+ *
+ * Each 4x4 block is tried in both flip orientations, in individual and
+ * differential mode, with the base colours taken from the sub-block
+ * averages and the best of the eight modifier tables per sub-block. That
+ * is well short of what the vendor tools do, but it is deterministic,
+ * has no dependencies and looks fine on noisy photographic textures.
+ */
+
+// Encodes a tightly packed RGB8 image; partial blocks at the right and
+// bottom edge are padded by repeating the last row and column.
+std::vector<uint8_t> etc1Encode(const uint8_t *rgb, int width, int height);
+
+// Size in bytes of an ETC1 image, 8 bytes per started 4x4 block
+int etc1Size(int width, int height);
+
+// Halves an RGB8 image with a box filter (down to 1 in each direction)
+std::vector<uint8_t> downsample(const uint8_t *rgb, int width, int height, int *outWidth, int *outHeight);
+
+#endif // ETC1_H
@@ -0,0 +1,424 @@
+/*
+ * Build-time packer for the shadertoy assets.
+ *
+ * Writes every shader in shaders/ and every texture in textures/ into one
+ * indexed file that the app maps into memory at startup (see ShaderPack),
+ * so nothing has to be decoded or converted on the device:
+ *
+ *  - shader sources have their comments and #ifdef GL_ES boilerplate
+ *    removed, and are stored NUL terminated, ready for glShaderSource;
+ *  - textures are decoded, flipped bottom-up the way the app samples
+ *    them, and stored twice as KTX containers with a mip chain down to
+ *    1x1: ETC1 for glCompressedTexImage2D, and RGBA8 for GPUs without
+ *    ETC1. --ktx-dir also writes them out as standalone .ktx files.
+ *
+ * Run from the shadertoy/ directory:
+ *
+ *   ./shadertoypack [--root DIR] [-o shaders.pack] [--ktx-dir DIR]
+ *
+ * File layout, all integers little endian:
+ *
+ *   header   "STPK", version, entry count, offset of the index
+ *   index    count x { char name[52], type, offset, size }
+ *   data     entries, each starting on a 16 byte boundary
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <dirent.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include <jpeglib.h>
+
+#include "etc1.h"
+
+static const char PACK_MAGIC[4] = { 'S', 'T', 'P', 'K' };
+static const uint32_t PACK_VERSION = 2;
+static const int PACK_NAME_LENGTH = 52;
+static const int PACK_ALIGNMENT = 16;
+
+enum EntryType {
+    ENTRY_SHADER = 1,
+    ENTRY_TEXTURE = 2
+};
+
+struct Entry {
+    std::string name;
+    uint32_t type;
+    std::vector<uint8_t> data;
+};
+
+static double
+nowMs()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static bool
+readFile(const std::string &filename, std::string &data)
+{
+    FILE *file = fopen(filename.c_str(), "rb");
+    if (!file)
+        return false;
+
+    char buf[4096];
+    size_t n;
+    data.clear();
+    while ((n = fread(buf, 1, sizeof buf, file)) > 0)
+        data.append(buf, n);
+
+    fclose(file);
+    return true;
+}
+
+static std::vector<std::string>
+listFiles(const std::string &dirname, const char *suffix)
+{
+    std::vector<std::string> files;
+    DIR *dir = opendir(dirname.c_str());
+    if (!dir)
+        return files;
+
+    const size_t suffixLength = strlen(suffix);
+    while (dirent *entry = readdir(dir)) {
+        std::string name = entry->d_name;
+        if (name.size() > suffixLength
+                && name.compare(name.size() - suffixLength, suffixLength, suffix) == 0)
+            files.push_back(name);
+    }
+    closedir(dir);
+
+    std::sort(files.begin(), files.end());
+    return files;
+}
+
+/*
+ * Drops // and block comments, blank lines and trailing whitespace, and
+ * resolves #ifdef GL_ES sections: the app always compiles for ES, so their
+ * contents stay and any #else part goes. Everything else is left alone,
+ * so compile errors still make sense.
+ */
+static std::string
+stripShader(const std::string &source)
+{
+    std::string text;
+
+    for (size_t i = 0; i < source.size(); i++) {
+        if (source.compare(i, 2, "//") == 0) {
+            while (i < source.size() && source[i] != '\n')
+                i++;
+            text += '\n';
+        } else if (source.compare(i, 2, "/*") == 0) {
+            size_t end = source.find("*/", i + 2);
+            i = end == std::string::npos ? source.size() : end + 1;
+            text += ' ';
+        } else {
+            text += source[i];
+        }
+    }
+
+    std::string out;
+    std::vector<int> sections;  // 1 inside #ifdef GL_ES, 2 inside its #else, 0 other
+    size_t start = 0;
+
+    while (start < text.size()) {
+        size_t end = text.find('\n', start);
+        if (end == std::string::npos)
+            end = text.size();
+
+        std::string line = text.substr(start, end - start);
+        start = end + 1;
+
+        size_t last = line.find_last_not_of(" \t\r");
+        line = last == std::string::npos ? "" : line.substr(0, last + 1);
+        size_t first = line.find_first_not_of(" \t");
+        std::string directive = first == std::string::npos ? "" : line.substr(first);
+
+        if (directive.compare(0, 3, "#if") == 0) {
+            if (directive == "#ifdef GL_ES" || directive == "#if defined(GL_ES)") {
+                sections.push_back(1);
+                continue;
+            }
+            sections.push_back(0);
+        } else if (directive.compare(0, 5, "#else") == 0 && !sections.empty() && sections.back()) {
+            sections.back() = 2;
+            continue;
+        } else if (directive.compare(0, 6, "#endif") == 0 && !sections.empty()) {
+            int section = sections.back();
+            sections.pop_back();
+            if (section)
+                continue;
+        }
+
+        if (std::find(sections.begin(), sections.end(), 2) != sections.end())
+            continue;
+        if (line.empty())
+            continue;
+
+        out += line;
+        out += '\n';
+    }
+
+    return out;
+}
+
+static void
+put32(std::vector<uint8_t> &out, uint32_t value)
+{
+    for (int i = 0; i < 4; i++)
+        out.push_back((value >> (i * 8)) & 0xff);
+}
+
+/*
+ * Decodes a JPEG into bottom-up RGB8, matching
+ * QImage(textureFilename).mirrored() in the app.
+ */
+static bool
+decodeJpeg(const std::string &filename, std::vector<uint8_t> &pixels, int *width, int *height)
+{
+    FILE *file = fopen(filename.c_str(), "rb");
+    if (!file)
+        return false;
+
+    jpeg_decompress_struct cinfo;
+    jpeg_error_mgr jerr;
+    cinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_decompress(&cinfo);
+    jpeg_stdio_src(&cinfo, file);
+    jpeg_read_header(&cinfo, TRUE);
+    cinfo.out_color_space = JCS_RGB;
+    jpeg_start_decompress(&cinfo);
+
+    *width = cinfo.output_width;
+    *height = cinfo.output_height;
+    const int stride = *width * 3;
+    pixels.resize(stride * *height);
+
+    while (cinfo.output_scanline < cinfo.output_height) {
+        JSAMPROW row = &pixels[(*height - 1 - cinfo.output_scanline) * stride];
+        jpeg_read_scanlines(&cinfo, &row, 1);
+    }
+
+    jpeg_finish_decompress(&cinfo);
+    jpeg_destroy_decompress(&cinfo);
+    fclose(file);
+    return true;
+}
+
+enum TextureFormat {
+    FORMAT_ETC1,
+    FORMAT_RGBA8
+};
+
+/*
+ * KTX 1.1 container with a full mip chain down to 1x1, either ETC1 or
+ * uncompressed RGBA8 for GPUs without ETC1. glFormat and glType are 0 for
+ * compressed data, as the spec requires; RGBA8 rows are always a multiple
+ * of 4 bytes, so no row padding is needed.
+ */
+static std::vector<uint8_t>
+encodeKtx(std::vector<uint8_t> pixels, int width, int height, TextureFormat format)
+{
+    static const uint8_t identifier[12] = {
+        0xAB, 'K', 'T', 'X', ' ', '1', '1', 0xBB, '\r', '\n', 0x1A, '\n'
+    };
+    static const uint32_t GL_UNSIGNED_BYTE_ = 0x1401, GL_RGB_ = 0x1907, GL_RGBA_ = 0x1908;
+
+    int levels = 1;
+    for (int w = width, h = height; w > 1 || h > 1; w = w > 1 ? w / 2 : 1, h = h > 1 ? h / 2 : 1)
+        levels++;
+
+    const bool etc1 = format == FORMAT_ETC1;
+
+    std::vector<uint8_t> out(identifier, identifier + sizeof identifier);
+    put32(out, 0x04030201);                         // endianness
+    put32(out, etc1 ? 0 : GL_UNSIGNED_BYTE_);       // glType
+    put32(out, 1);                                  // glTypeSize
+    put32(out, etc1 ? 0 : GL_RGBA_);                // glFormat
+    put32(out, etc1 ? ETC1_RGB8_OES : GL_RGBA_);    // glInternalFormat
+    put32(out, etc1 ? GL_RGB_ : GL_RGBA_);          // glBaseInternalFormat
+    put32(out, width);
+    put32(out, height);
+    put32(out, 0);                                  // pixelDepth
+    put32(out, 0);                                  // numberOfArrayElements
+    put32(out, 1);                                  // numberOfFaces
+    put32(out, levels);
+    put32(out, 0);                                  // bytesOfKeyValueData
+
+    for (int level = 0; level < levels; level++) {
+        if (etc1) {
+            std::vector<uint8_t> etc = etc1Encode(&pixels[0], width, height);
+            put32(out, etc.size());
+            out.insert(out.end(), etc.begin(), etc.end());
+        } else {
+            put32(out, width * height * 4);
+            for (int i = 0; i < width * height; i++) {
+                out.insert(out.end(), &pixels[i * 3], &pixels[i * 3] + 3);
+                out.push_back(0xff);
+            }
+        }
+
+        if (level + 1 < levels)
+            pixels = downsample(&pixels[0], width, height, &width, &height);
+    }
+
+    return out;
+}
+
+static bool
+writeFile(const std::string &filename, const std::vector<uint8_t> &data)
+{
+    FILE *file = fopen(filename.c_str(), "wb");
+    if (!file)
+        return false;
+    bool ok = fwrite(&data[0], 1, data.size(), file) == data.size();
+    return fclose(file) == 0 && ok;
+}
+
+static bool
+writePack(const std::string &filename, const std::vector<Entry> &entries)
+{
+    std::vector<uint8_t> out(PACK_MAGIC, PACK_MAGIC + 4);
+    put32(out, PACK_VERSION);
+    put32(out, entries.size());
+    put32(out, 16);
+
+    size_t offset = 16 + entries.size() * (PACK_NAME_LENGTH + 12);
+    for (size_t i = 0; i < entries.size(); i++) {
+        char name[PACK_NAME_LENGTH] = { 0 };
+        strncpy(name, entries[i].name.c_str(), PACK_NAME_LENGTH - 1);
+
+        offset = (offset + PACK_ALIGNMENT - 1) & ~(PACK_ALIGNMENT - 1);
+        out.insert(out.end(), name, name + PACK_NAME_LENGTH);
+        put32(out, entries[i].type);
+        put32(out, offset);
+        put32(out, entries[i].data.size());
+        offset += entries[i].data.size();
+    }
+
+    for (size_t i = 0; i < entries.size(); i++) {
+        out.resize((out.size() + PACK_ALIGNMENT - 1) & ~(PACK_ALIGNMENT - 1), 0);
+        out.insert(out.end(), entries[i].data.begin(), entries[i].data.end());
+    }
+
+    return writeFile(filename, out);
+}
+
+static void
+usage(int error_code)
+{
+    fprintf(stderr, "Usage: shadertoypack [OPTIONS]\n\n"
+            "  --root DIR\tshadertoy source directory (default .)\n"
+            "  -o FILE\tOutput file (default shaders.pack)\n"
+            "  --ktx-dir DIR\tAlso write every texture as standalone .ktx files\n"
+            "  -h\t\tThis help text\n\n");
+
+    exit(error_code);
+}
+
+int
+main(int argc, char **argv)
+{
+    std::string root = ".";
+    std::string output = "shaders.pack";
+    std::string ktxDir;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp("--root", argv[i]) == 0 && i + 1 < argc) {
+            root = argv[++i];
+        } else if (strcmp("-o", argv[i]) == 0 && i + 1 < argc) {
+            output = argv[++i];
+        } else if (strcmp("--ktx-dir", argv[i]) == 0 && i + 1 < argc) {
+            ktxDir = argv[++i];
+        } else if (strcmp("-h", argv[i]) == 0) {
+            usage(EXIT_SUCCESS);
+        } else {
+            usage(EXIT_FAILURE);
+        }
+    }
+
+    std::vector<Entry> entries;
+    size_t sourceBytes = 0;
+
+    std::vector<std::string> shaders = listFiles(root + "/shaders", ".glsl");
+    for (size_t i = 0; i < shaders.size(); i++) {
+        std::string source;
+        if (!readFile(root + "/shaders/" + shaders[i], source)) {
+            fprintf(stderr, "could not read %s\n", shaders[i].c_str());
+            return EXIT_FAILURE;
+        }
+
+        std::string stripped = stripShader(source);
+        Entry entry;
+        entry.name = "shaders/" + shaders[i];
+        entry.type = ENTRY_SHADER;
+        entry.data.assign(stripped.begin(), stripped.end());
+        entry.data.push_back(0);
+        entries.push_back(entry);
+
+        sourceBytes += source.size();
+        printf("%-32s %6zu -> %6zu bytes\n", entry.name.c_str(), source.size(), stripped.size());
+    }
+
+    std::vector<std::string> textures = listFiles(root + "/textures", ".jpg");
+    for (size_t i = 0; i < textures.size(); i++) {
+        std::vector<uint8_t> pixels;
+        int width = 0, height = 0;
+        double start = nowMs();
+
+        if (!decodeJpeg(root + "/textures/" + textures[i], pixels, &width, &height)) {
+            fprintf(stderr, "could not decode %s\n", textures[i].c_str());
+            return EXIT_FAILURE;
+        }
+
+        // texl0.jpg -> textures/texl0.etc1.ktx and textures/texl0.rgba.ktx
+        const std::string base = textures[i].substr(0, textures[i].rfind('.'));
+        static const struct {
+            TextureFormat format;
+            const char *suffix;
+        } formats[] = {
+            { FORMAT_ETC1, ".etc1.ktx" },
+            { FORMAT_RGBA8, ".rgba.ktx" }
+        };
+
+        for (size_t f = 0; f < sizeof formats / sizeof formats[0]; f++) {
+            Entry entry;
+            entry.name = "textures/" + base + formats[f].suffix;
+            entry.type = ENTRY_TEXTURE;
+            entry.data = encodeKtx(pixels, width, height, formats[f].format);
+            entries.push_back(entry);
+
+            if (!ktxDir.empty() && !writeFile(ktxDir + "/" + base + formats[f].suffix, entry.data)) {
+                fprintf(stderr, "could not write %s/%s%s\n", ktxDir.c_str(), base.c_str(), formats[f].suffix);
+                return EXIT_FAILURE;
+            }
+
+            printf("%-32s %dx%d + mips, %zu bytes\n", entry.name.c_str(), width, height, entry.data.size());
+        }
+        printf("%-32s encoded in %.0f ms\n", textures[i].c_str(), nowMs() - start);
+    }
+
+    for (size_t i = 0; i < entries.size(); i++) {
+        if (entries[i].name.size() >= (size_t) PACK_NAME_LENGTH) {
+            fprintf(stderr, "name too long for the pack index: %s\n", entries[i].name.c_str());
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (!writePack(output, entries)) {
+        fprintf(stderr, "could not write %s\n", output.c_str());
+        return EXIT_FAILURE;
+    }
+
+    printf("wrote %s: %zu shaders (%zu bytes of source), %zu textures\n",
+           output.c_str(), shaders.size(), sourceBytes, textures.size());
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,96 @@
+#include "programreflection.h"
+
+ProgramReflection::ProgramReflection(GLuint program)
+{
+    GLint count = 0, maxLength = 0;
+
+    glGetProgramiv(program, GL_ACTIVE_UNIFORM_MAX_LENGTH, &maxLength);
+    glGetProgramiv(program, GL_ACTIVE_UNIFORMS, &count);
+
+    QByteArray name(qMax(maxLength, 1), Qt::Uninitialized);
+    for (GLint i = 0; i < count; i++) {
+        Variable v;
+        GLsizei length = 0;
+        glGetActiveUniform(program, i, name.size(), &length, &v.size, &v.type, name.data());
+
+        // Arrays are reported as "name[0]"; index them by their base name
+        QByteArray key = name.left(length);
+        if (key.endsWith("[0]"))
+            key.chop(3);
+
+        v.location = glGetUniformLocation(program, key.constData());
+        _uniforms.insert(key, v);
+    }
+
+    glGetProgramiv(program, GL_ACTIVE_ATTRIBUTE_MAX_LENGTH, &maxLength);
+    glGetProgramiv(program, GL_ACTIVE_ATTRIBUTES, &count);
+
+    name.resize(qMax(maxLength, 1));
+    for (GLint i = 0; i < count; i++) {
+        Variable v;
+        GLsizei length = 0;
+        glGetActiveAttrib(program, i, name.size(), &length, &v.size, &v.type, name.data());
+
+        QByteArray key = name.left(length);
+        v.location = glGetAttribLocation(program, key.constData());
+        _attributes.insert(key, v);
+    }
+
+    qDebug() << "program" << program << "uniforms:" << _uniforms.keys()
+             << "attributes:" << _attributes.keys();
+}
+
+GLint
+ProgramReflection::uniformLocation(const QByteArray &name) const
+{
+    QHash<QByteArray, Variable>::const_iterator it = _uniforms.constFind(name);
+    return it != _uniforms.constEnd() ? it->location : -1;
+}
+
+GLint
+ProgramReflection::attributeLocation(const QByteArray &name) const
+{
+    QHash<QByteArray, Variable>::const_iterator it = _attributes.constFind(name);
+    return it != _attributes.constEnd() ? it->location : -1;
+}
+
+bool
+ProgramReflection::changed(GLint location, const QVector4D &value)
+{
+    QHash<GLint, QVector4D>::iterator it = values.find(location);
+    if (it != values.end() && *it == value)
+        return false;
+
+    values.insert(location, value);
+    return true;
+}
+
+int
+ProgramReflection::set(GLint location, GLfloat x)
+{
+    if (location == -1 || !changed(location, QVector4D(x, 0, 0, 0)))
+        return 0;
+
+    glUniform1f(location, x);
+    return 1;
+}
+
+int
+ProgramReflection::set(GLint location, GLfloat x, GLfloat y)
+{
+    if (location == -1 || !changed(location, QVector4D(x, y, 0, 0)))
+        return 0;
+
+    glUniform2f(location, x, y);
+    return 1;
+}
+
+int
+ProgramReflection::set(GLint location, GLint i)
+{
+    if (location == -1 || !changed(location, QVector4D(i, 0, 0, 0)))
+        return 0;
+
+    glUniform1i(location, i);
+    return 1;
+}
@@ -0,0 +1,45 @@
+#ifndef PROGRAMREFLECTION_H
+#define PROGRAMREFLECTION_H
+
+#include <QtGui>
+
+/*
+ * Table of the active uniforms and attributes of a linked program,
+ * built once with glGetActiveUniform / glGetActiveAttrib.
+ *
+ * Uniform values live in the program object, so the last value uploaded
+ * through set() is remembered and identical uploads are skipped. The
+ * set() calls return the number of GL calls they actually made, for the
+ * per-frame call counter in ShaderToyGLView.
+ */
+class ProgramReflection
+{
+public:
+    struct Variable {
+        GLint location;
+        GLenum type;
+        GLint size;
+    };
+
+    explicit ProgramReflection(GLuint program);
+
+    const QHash<QByteArray, Variable> &uniforms() const { return _uniforms; }
+    const QHash<QByteArray, Variable> &attributes() const { return _attributes; }
+
+    bool hasUniform(const QByteArray &name) const { return _uniforms.contains(name); }
+    GLint uniformLocation(const QByteArray &name) const;
+    GLint attributeLocation(const QByteArray &name) const;
+
+    int set(GLint location, GLfloat x);
+    int set(GLint location, GLfloat x, GLfloat y);
+    int set(GLint location, GLint i);
+
+private:
+    bool changed(GLint location, const QVector4D &value);
+
+    QHash<QByteArray, Variable> _uniforms;
+    QHash<QByteArray, Variable> _attributes;
+    QHash<GLint, QVector4D> values;
+};
+
+#endif // PROGRAMREFLECTION_H
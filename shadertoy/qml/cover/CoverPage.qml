@@ -38,6 +38,14 @@ CoverBackground {
         text: qsTr("My Cover")
     }
 
+    Label {
+        anchors.top: label.bottom
+        anchors.horizontalCenter: parent.horizontalCenter
+        font.pixelSize: Theme.fontSizeExtraSmall
+        visible: shaderToy.gpuTimerMode !== ""
+        text: "GPU " + shaderToy.gpuFrameMs.toFixed(1) + " ms"
+    }
+
     CoverActionList {
         id: coverAction
 
@@ -121,6 +121,28 @@ Page {
             title: "Select shader"
         }
 
+        PullDownMenu {
+            MenuItem {
+                text: shaderToy.showGpuOverlay ? "Hide GPU timing" : "Show GPU timing"
+                onClicked: shaderToy.showGpuOverlay = !shaderToy.showGpuOverlay
+            }
+
+            MenuItem {
+                text: shaderToy.dynamicResolution ? "Native resolution" : "Dynamic resolution"
+                onClicked: shaderToy.dynamicResolution = !shaderToy.dynamicResolution
+            }
+
+            MenuItem {
+                text: shaderToy.skipStaticFrames ? "Always redraw" : "Skip static frames"
+                onClicked: shaderToy.skipStaticFrames = !shaderToy.skipStaticFrames
+            }
+
+            MenuItem {
+                text: shaderToy.targetFps < 60 ? "Target 60 fps" : "Target 30 fps"
+                onClicked: shaderToy.targetFps = shaderToy.targetFps < 60 ? 60 : 30
+            }
+        }
+
         delegate: BackgroundItem {
             id: delegate
 
@@ -132,7 +154,8 @@ Page {
             }
             onClicked:
             {
-                shaderToy.start(fragmentShader, vertexShader, texture);
+                // One texture per channel, tex0 / iChannel0 and up
+                shaderToy.start(fragmentShader, vertexShader, [texture]);
                 // hide listview to get "onClicked" events on page
                 listView.visible = false;
             }
@@ -0,0 +1,103 @@
+#include "resolutionscaler.h"
+
+#include <qmath.h>
+
+const qreal ResolutionScaler::STEP = 1.f / 16.f;
+
+// Frames to hold the target before probing a larger scale, and the cap
+// the back-off doubles up to
+static const int PROBE_DELAY_FRAMES = 60;
+static const int MAX_PROBE_DELAY_FRAMES = 600;
+// Largest drop in one change, in STEPs
+static const int MAX_STEPS_DOWN = 2;
+// Frames to ignore after a change while the averages catch up
+static const int COOLDOWN_FRAMES = 8;
+// Over budget means this much above the target interval
+static const qreal OVER_BUDGET = 1.15f;
+// Weight of the newest frame in the moving average
+static const qreal AVERAGE_WEIGHT = 0.2f;
+
+ResolutionScaler::ResolutionScaler()
+    : _minScale(0.25f)
+{
+    reset();
+}
+
+void
+ResolutionScaler::reset()
+{
+    _scale = 1.f;
+    averageMs = 0;
+    framesOnTarget = 0;
+    probeDelay = PROBE_DELAY_FRAMES;
+    ceiling = 2.f;
+    cooldown = COOLDOWN_FRAMES;
+    probing = false;
+}
+
+qreal
+ResolutionScaler::quantize(qreal scale) const
+{
+    return qBound(_minScale, qFloor(scale / STEP) * STEP, (qreal) 1.f);
+}
+
+bool
+ResolutionScaler::update(qreal frameMs, qreal targetMs)
+{
+    if (targetMs <= 0 || frameMs <= 0)
+        return false;
+
+    averageMs = averageMs > 0 ? averageMs + (frameMs - averageMs) * AVERAGE_WEIGHT : frameMs;
+
+    if (cooldown > 0) {
+        cooldown--;
+        return false;
+    }
+
+    qreal scale = _scale;
+
+    if (averageMs > targetMs * OVER_BUDGET) {
+        // Frame times are whole vsync intervals, so the overshoot only
+        // says which way to go; limit how far a single change goes.
+        scale = quantize(_scale * qSqrt(targetMs / averageMs));
+        scale = qBound(_scale - MAX_STEPS_DOWN * STEP, scale, _scale - STEP);
+        scale = quantize(scale);
+
+        if (probing) {
+            // The level below was fine a moment ago
+            scale = quantize(_scale - STEP);
+            ceiling = _scale;
+            probeDelay = qMin(probeDelay * 2, MAX_PROBE_DELAY_FRAMES);
+        }
+        framesOnTarget = 0;
+        probing = false;
+    } else {
+        framesOnTarget++;
+
+        if (probing && framesOnTarget >= PROBE_DELAY_FRAMES) {
+            // The probe held; forget about the level that failed before
+            if (_scale >= ceiling) {
+                ceiling = 2.f;
+                probeDelay = PROBE_DELAY_FRAMES;
+            }
+            probing = false;
+        }
+
+        const qreal next = quantize(_scale + STEP);
+        const int delay = next >= ceiling ? probeDelay : PROBE_DELAY_FRAMES;
+        if (_scale < 1.f && framesOnTarget >= delay) {
+            scale = next;
+            framesOnTarget = 0;
+            probing = true;
+        }
+    }
+
+    if (scale == _scale)
+        return false;
+
+    // Scale the running average to what the new pixel count should cost
+    averageMs *= (scale * scale) / (_scale * _scale);
+    _scale = scale;
+    cooldown = COOLDOWN_FRAMES;
+    return true;
+}
@@ -0,0 +1,50 @@
+#ifndef RESOLUTIONSCALER_H
+#define RESOLUTIONSCALER_H
+
+#include <QtGlobal>
+
+/*
+ * Picks the render scale for the dynamic resolution mode from measured
+ * frame times.
+ *
+ * Frames over budget shrink the scale right away, in proportion to how
+ * far over they are (the cost of a full-screen shader goes with the pixel
+ * count, so by the square root of the ratio). While the target is held the
+ * scale is probed one step up now and then; a probe that has to be undone
+ * doubles the wait before that level is tried again, so the scale settles
+ * instead of bouncing between two levels.
+ *
+ * Scales are quantized to STEP so the offscreen buffer is not reallocated
+ * on every frame.
+ */
+class ResolutionScaler
+{
+public:
+    ResolutionScaler();
+
+    void reset();
+
+    qreal scale() const { return _scale; }
+
+    qreal minScale() const { return _minScale; }
+    void setMinScale(qreal scale) { _minScale = qBound(STEP, scale, (qreal) 1.f); }
+
+    // Returns true when the scale changed
+    bool update(qreal frameMs, qreal targetMs);
+
+    static const qreal STEP;
+
+private:
+    qreal quantize(qreal scale) const;
+
+    qreal _scale;
+    qreal _minScale;
+    qreal averageMs;
+    int framesOnTarget;
+    int probeDelay;
+    qreal ceiling;
+    int cooldown;
+    bool probing;
+};
+
+#endif // RESOLUTIONSCALER_H
@@ -0,0 +1,414 @@
+#include "shaderloader.h"
+#include "ktxtexture.h"
+
+#include <sailfishapp.h>
+
+static const char defaultVertexShader[] =
+        "precision highp float;\n"
+        "attribute vec2 coord2d;\n"
+
+        "void main() {\n"
+        "  gl_Position = vec4(coord2d, 0.0, 1.0);\n"
+        "}\n";
+
+static QByteArray
+readSource(const QString &filename)
+{
+    QFile file(filename);
+
+    if (!file.open(QFile::ReadOnly | QFile::Text)) {
+        qDebug() << "could not open file for read" << filename;
+        return QByteArray();
+    }
+
+    return file.readAll();
+}
+
+/*
+ * Uploads a channel's KTX data, or failing that its decoded image with
+ * generated mips, and reports what it cost.
+ */
+static GLuint
+uploadTexture(const ShaderChannel &channel, qint64 *bytes)
+{
+    QElapsedTimer upload;
+    upload.start();
+    GLuint texture = 0;
+
+    if (!channel.ktx.isEmpty()) {
+        KtxTexture ktx(channel.ktx);
+        texture = ktx.upload();
+        *bytes = ktx.dataSize();
+
+        if (texture)
+            qDebug() << "texture" << channel.filename << ktx.formatName() << ktx.width() << "x" << ktx.height()
+                     << ktx.levels() << "levels:" << *bytes << "bytes uploaded in"
+                     << upload.nsecsElapsed() / 1000000.f << "ms";
+    }
+
+    if (!texture && !channel.image.isNull()) {
+        const QImage &image = channel.image;
+
+        glGenTextures(1, &texture);
+        glBindTexture(GL_TEXTURE_2D, texture);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, image.width(), image.height(), 0,
+                     GL_RGBA, GL_UNSIGNED_BYTE, image.constBits());
+        glGenerateMipmap(GL_TEXTURE_2D);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+
+        // Level 0 plus the mip chain the driver generated
+        *bytes = image.byteCount() * 4 / 3;
+
+        qDebug() << "texture" << channel.filename << "RGBA8 from JPEG" << image.width() << "x"
+                 << image.height() << "+ generated mips:" << image.byteCount()
+                 << "bytes uploaded in" << upload.nsecsElapsed() / 1000000.f << "ms";
+    }
+
+    return texture;
+}
+
+class ShaderReadJob : public QRunnable
+{
+public:
+    ShaderReadJob(ShaderLoader *loader, PreparedShader *shader, const QString &fragmentShaderFilename,
+                  const QString &vertexShaderFilename, const QStringList &textureFilenames)
+        : loader(loader)
+        , shader(shader)
+        , fragmentShaderFilename(fragmentShaderFilename)
+        , vertexShaderFilename(vertexShaderFilename)
+        , textureFilenames(textureFilenames)
+    {
+    }
+
+    void run()
+    {
+        loader->read(shader, fragmentShaderFilename, vertexShaderFilename, textureFilenames);
+    }
+
+private:
+    ShaderLoader *loader;
+    PreparedShader *shader;
+    QString fragmentShaderFilename;
+    QString vertexShaderFilename;
+    QStringList textureFilenames;
+};
+
+ShaderLoader::ShaderLoader(QQuickWindow *window)
+    : QThread()
+    , window(window)
+    , compressedTextures(0)
+    , generation(0)
+    , ready(0)
+    , context(0)
+    , releaseRequested(false)
+    , quitting(false)
+{
+    if (!pack.open(SailfishApp::pathTo("shaders.pack").toLocalFile()))
+        qDebug() << "no shader pack, loading from resources";
+
+    // Offscreen surfaces have to be created on the GUI thread
+    surface = new QOffscreenSurface();
+    surface->setFormat(window->requestedFormat());
+    surface->create();
+
+    start();
+}
+
+ShaderLoader::~ShaderLoader()
+{
+    {
+        QMutexLocker locker(&queueMutex);
+        quitting = true;
+        queueChanged.wakeOne();
+    }
+    wait();
+
+    // Read jobs still running hold a pointer to us
+    QThreadPool::globalInstance()->waitForDone();
+
+    delete ready.fetchAndStoreOrdered(NULL);
+    qDeleteAll(superseded);
+    delete surface;
+}
+
+void
+ShaderLoader::load(const QString &fragmentShaderFilename, const QString &vertexShaderFilename,
+                   const QStringList &textureFilenames)
+{
+    PreparedShader *shader = new PreparedShader();
+    shader->generation = generation.fetchAndAddOrdered(1) + 1;
+    shader->name = QFileInfo(fragmentShaderFilename).baseName();
+
+    QThreadPool::globalInstance()->start(new ShaderReadJob(this, shader, fragmentShaderFilename,
+                                                           vertexShaderFilename, textureFilenames));
+}
+
+void
+ShaderLoader::cancel()
+{
+    // Whatever is in flight is dropped when it is next looked at
+    generation.ref();
+}
+
+void
+ShaderLoader::readTexture(ShaderChannel *channel)
+{
+    channel->ktx = pack.texture(channel->filename, compressedTextures.load() ? ShaderPack::Etc1Texture
+                                                                             : ShaderPack::Rgba8Texture);
+    if (channel->ktx.isEmpty())
+        channel->image = QImage(channel->filename).mirrored().convertToFormat(QImage::Format_RGBA8888);
+}
+
+void
+ShaderLoader::read(PreparedShader *shader, const QString &fragmentShaderFilename,
+                   const QString &vertexShaderFilename, const QStringList &textureFilenames)
+{
+    QTime elapsed;
+    elapsed.start();
+
+    if (vertexShaderFilename.isEmpty())
+        shader->vertexSource = defaultVertexShader;
+    else
+        shader->vertexSource = pack.shaderSource(vertexShaderFilename);
+    if (shader->vertexSource.isEmpty())
+        shader->vertexSource = readSource(vertexShaderFilename);
+
+    shader->fragmentSource = pack.shaderSource(fragmentShaderFilename);
+    if (shader->fragmentSource.isEmpty())
+        shader->fragmentSource = readSource(fragmentShaderFilename);
+
+    for (int i = 0; i < MAX_CHANNELS && i < textureFilenames.size(); i++) {
+        ShaderChannel &channel = shader->channels[i];
+        channel.filename = textureFilenames.at(i);
+
+        // Resident textures are picked up from the cache in build()
+        if (!channel.filename.isEmpty() && !textures.contains(channel.filename))
+            readTexture(&channel);
+    }
+
+    qDebug() << "read" << shader->name << "in" << elapsed.elapsed() << "ms";
+
+    if (shader->generation != generation.load()) {
+        delete shader;
+        return;
+    }
+
+    QMutexLocker locker(&queueMutex);
+    if (context) {
+        // Only the newest request is worth compiling
+        qDeleteAll(queue);
+        queue.clear();
+        queue.enqueue(shader);
+        queueChanged.wakeOne();
+    } else {
+        locker.unlock();
+        publish(shader);
+    }
+}
+
+void
+ShaderLoader::publish(PreparedShader *shader)
+{
+    PreparedShader *old = ready.fetchAndStoreOrdered(shader);
+    if (old) {
+        QMutexLocker locker(&supersededMutex);
+        superseded.append(old);
+    }
+
+    // A static shader has no frames scheduled to pick this up
+    QMetaObject::invokeMethod(window, "update", Qt::QueuedConnection);
+}
+
+void
+ShaderLoader::run()
+{
+    QMutexLocker locker(&queueMutex);
+
+    forever {
+        while (!quitting && !releaseRequested && queue.isEmpty())
+            queueChanged.wait(&queueMutex);
+
+        if (releaseRequested || quitting) {
+            qDeleteAll(queue);
+            queue.clear();
+
+            if (context) {
+                if (context->makeCurrent(surface)) {
+                    // Its texture has to go while this context is alive
+                    PreparedShader *pending = ready.fetchAndStoreOrdered(NULL);
+                    if (pending)
+                        discard(pending);
+                    cache.clear();
+                }
+                context->doneCurrent();
+                delete context;
+                context = NULL;
+            }
+
+            releaseRequested = false;
+            released.wakeAll();
+
+            if (quitting)
+                return;
+            continue;
+        }
+
+        PreparedShader *shader = queue.dequeue();
+        if (shader->generation != generation.load()) {
+            delete shader;
+            continue;
+        }
+
+        if (!context->makeCurrent(surface)) {
+            qDebug() << "loader context lost, handing" << shader->name << "back to the render thread";
+            locker.unlock();
+            publish(shader);
+            locker.relock();
+            continue;
+        }
+
+        locker.unlock();
+
+        build(shader, &cache);
+
+        // The render thread uses these objects from another context;
+        // make sure they are complete before it can see them
+        glFinish();
+
+        if (shader->generation == generation.load())
+            publish(shader);
+        else
+            discard(shader);
+
+        locker.relock();
+    }
+}
+
+bool
+ShaderLoader::attach()
+{
+    QOpenGLContext *shareContext = QOpenGLContext::currentContext();
+    if (!shareContext)
+        return false;
+
+    compressedTextures = shareContext->hasExtension("GL_OES_compressed_ETC1_RGB8_texture") ? 1 : 0;
+
+    if (!surface->isValid())
+        return false;
+
+    QOpenGLContext *loaderContext = new QOpenGLContext();
+    loaderContext->setFormat(shareContext->format());
+    loaderContext->setShareContext(shareContext);
+
+    if (!loaderContext->create() || !QOpenGLContext::areSharing(loaderContext, shareContext)) {
+        qDebug() << "no shared context, shaders will be compiled on the render thread";
+        delete loaderContext;
+        return false;
+    }
+
+    loaderContext->moveToThread(this);
+
+    QMutexLocker locker(&queueMutex);
+    context = loaderContext;
+    return true;
+}
+
+void
+ShaderLoader::detach()
+{
+    {
+        QMutexLocker locker(&queueMutex);
+        if (context) {
+            releaseRequested = true;
+            queueChanged.wakeOne();
+            while (releaseRequested)
+                released.wait(&queueMutex);
+        }
+    }
+
+    // Nothing prepared for the old scene graph can be used with the next
+    // one; the loader thread already dropped what it had built
+    PreparedShader *shader = ready.fetchAndStoreOrdered(NULL);
+    if (shader)
+        discard(shader);
+    discardSuperseded();
+}
+
+PreparedShader *
+ShaderLoader::takeReady()
+{
+    PreparedShader *shader = ready.fetchAndStoreOrdered(NULL);
+
+    discardSuperseded();
+
+    if (shader && shader->generation != generation.load()) {
+        discard(shader);
+        return NULL;
+    }
+
+    return shader;
+}
+
+void
+ShaderLoader::discardSuperseded()
+{
+    QList<PreparedShader *> shaders;
+    {
+        QMutexLocker locker(&supersededMutex);
+        shaders.swap(superseded);
+    }
+
+    foreach (PreparedShader *shader, shaders)
+        discard(shader);
+}
+
+void
+ShaderLoader::build(PreparedShader *shader, ShaderProgramCache *cache)
+{
+    QTime elapsed;
+    elapsed.start();
+
+    shader->program = cache->program(shader->vertexSource, shader->fragmentSource);
+    if (!shader->program) {
+        shader->failed = true;
+        return;
+    }
+    shader->reflection = cache->reflection(shader->program);
+
+    for (int i = 0; i < MAX_CHANNELS; i++) {
+        ShaderChannel &channel = shader->channels[i];
+        if (channel.filename.isEmpty())
+            continue;
+
+        channel.texture = textures.acquire(channel.filename);
+        if (channel.texture)
+            continue;
+
+        // Evicted since read() looked
+        if (channel.ktx.isEmpty() && channel.image.isNull())
+            readTexture(&channel);
+
+        qint64 bytes = 0;
+        GLuint texture = uploadTexture(channel, &bytes);
+        if (texture)
+            channel.texture = textures.insert(channel.filename, texture, bytes);
+
+        channel.ktx.clear();
+        channel.image = QImage();
+    }
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    qDebug() << "prepared" << shader->name << "in" << elapsed.elapsed() << "ms";
+}
+
+void
+ShaderLoader::discard(PreparedShader *shader)
+{
+    // The program stays in its cache, textures in theirs
+    for (int i = 0; i < MAX_CHANNELS; i++)
+        if (shader->channels[i].texture)
+            textures.release(shader->channels[i].filename);
+    delete shader;
+}
@@ -0,0 +1,133 @@
+#ifndef SHADERLOADER_H
+#define SHADERLOADER_H
+
+#include <QtGui>
+#include <QtQuick>
+
+#include "shaderpack.h"
+#include "shaderprogramcache.h"
+#include "texturecache.h"
+
+// Texture inputs, bound to units 0.. as tex<N> or iChannel<N>
+static const int MAX_CHANNELS = 4;
+
+struct ShaderChannel
+{
+    ShaderChannel() : texture(0) {}
+
+    QString filename;
+    QByteArray ktx;
+    QImage image;
+    GLuint texture;
+};
+
+/*
+ * Everything needed to draw one shader. Sources and texture data come
+ * from the worker pool, either pointing into the shader pack or read and
+ * decoded from the resources; program and texture are filled in by the
+ * loader thread, or by the render thread when there is no shared context.
+ */
+struct PreparedShader
+{
+    PreparedShader()
+        : generation(0), program(0), reflection(0), failed(false) {}
+
+    int generation;
+    QString name;
+    QByteArray vertexSource;
+    QByteArray fragmentSource;
+    ShaderChannel channels[MAX_CHANNELS];
+
+    QOpenGLShaderProgram *program;
+    ProgramReflection *reflection;
+    bool failed;
+};
+
+/*
+ * Prepares shaders without blocking the render thread.
+ *
+ * load() reads the shader files and decodes the texture on the global
+ * thread pool, then hands them to the loader thread, which compiles the
+ * program and uploads the texture in its own GL context, shared with the
+ * scene graph one. The render thread picks the result up with takeReady()
+ * at the start of a frame, so it goes from the old shader to the new one
+ * between two frames and never waits for either step.
+ *
+ * Until attach() has succeeded, prepared shaders come back without a
+ * program and build() has to be called on the render thread; only the
+ * file I/O and image decoding are then off-thread.
+ *
+ * Assets come from shaders.pack when it is installed (see ShaderPack),
+ * and from the Qt resources otherwise. Packed textures come with their
+ * mip chain, as ETC1 when the scene graph context supports it and RGBA8
+ * otherwise; JPEGs are only decoded when there is no pack.
+ *
+ * Programs are owned by the loader's own ShaderProgramCache, textures by
+ * its TextureCache; a PreparedShader pins its textures there until it is
+ * discarded, on a thread with a context current so that evicted textures
+ * can be deleted. Textures that are still resident are not read again.
+ */
+class ShaderLoader : public QThread
+{
+    Q_OBJECT
+
+public:
+    ShaderLoader(QQuickWindow *window);
+    ~ShaderLoader();
+
+    // GUI thread. A new request supersedes any unfinished one.
+    void load(const QString &fragmentShaderFilename, const QString &vertexShaderFilename,
+              const QStringList &textureFilenames);
+    void cancel();
+
+    // Render thread, with the scene graph context current
+    bool attach();
+    void detach();
+    PreparedShader *takeReady();
+
+    // Any thread with a GL context current
+    void build(PreparedShader *shader, ShaderProgramCache *cache);
+    void discard(PreparedShader *shader);
+
+    TextureCache *textureCache() { return &textures; }
+
+protected:
+    void run();
+
+private:
+    friend class ShaderReadJob;
+
+    void read(PreparedShader *shader, const QString &fragmentShaderFilename,
+              const QString &vertexShaderFilename, const QStringList &textureFilenames);
+    void readTexture(ShaderChannel *channel);
+    void publish(PreparedShader *shader);
+    void discardSuperseded();
+
+    QQuickWindow *window;
+    QOffscreenSurface *surface;
+    ShaderPack pack;
+    TextureCache textures;
+    QAtomicInt compressedTextures;
+    QAtomicInt generation;
+    QAtomicPointer<PreparedShader> ready;
+
+    // Shared with the loader thread, under queueMutex
+    QMutex queueMutex;
+    QWaitCondition queueChanged;
+    QWaitCondition released;
+    QQueue<PreparedShader *> queue;
+    QOpenGLContext *context;
+    bool releaseRequested;
+    bool quitting;
+
+    // Shaders replaced before the render thread took them. publish() can
+    // run without a context current, so takeReady() and detach() discard
+    // them instead.
+    QMutex supersededMutex;
+    QList<PreparedShader *> superseded;
+
+    // Loader thread only
+    ShaderProgramCache cache;
+};
+
+#endif // SHADERLOADER_H
@@ -0,0 +1,90 @@
+#include "shaderpack.h"
+
+static const char PACK_MAGIC[4] = { 'S', 'T', 'P', 'K' };
+static const quint32 PACK_VERSION = 2;
+static const int PACK_NAME_LENGTH = 52;
+static const int PACK_INDEX_ENTRY_SIZE = PACK_NAME_LENGTH + 12;
+
+ShaderPack::ShaderPack()
+    : data(NULL)
+{
+}
+
+bool
+ShaderPack::open(const QString &filename)
+{
+    file.setFileName(filename);
+    if (!file.open(QFile::ReadOnly))
+        return false;
+
+    const qint64 size = file.size();
+    const uchar *map = size >= 16 ? file.map(0, size) : NULL;
+    if (!map) {
+        file.close();
+        return false;
+    }
+
+    const quint32 version = qFromLittleEndian<quint32>(map + 4);
+    const quint32 count = qFromLittleEndian<quint32>(map + 8);
+    const quint32 indexOffset = qFromLittleEndian<quint32>(map + 12);
+
+    if (memcmp(map, PACK_MAGIC, 4) != 0 || version != PACK_VERSION
+            || indexOffset + (qint64) count * PACK_INDEX_ENTRY_SIZE > size) {
+        qDebug() << "ignoring invalid shader pack" << filename;
+        file.close();
+        return false;
+    }
+
+    for (quint32 i = 0; i < count; i++) {
+        const uchar *p = map + indexOffset + i * PACK_INDEX_ENTRY_SIZE;
+        Entry entry;
+        entry.type = qFromLittleEndian<quint32>(p + PACK_NAME_LENGTH);
+        entry.offset = qFromLittleEndian<quint32>(p + PACK_NAME_LENGTH + 4);
+        entry.size = qFromLittleEndian<quint32>(p + PACK_NAME_LENGTH + 8);
+
+        if ((qint64) entry.offset + entry.size > size)
+            continue;
+
+        QString name = QString::fromLatin1((const char *) p, qstrnlen((const char *) p, PACK_NAME_LENGTH));
+        index.insert(name, entry);
+    }
+
+    data = map;
+    qDebug() << "mapped shader pack" << filename << "with" << index.size() << "entries";
+    return true;
+}
+
+QString
+ShaderPack::entryName(const QString &filename)
+{
+    return filename.section('/', -2);
+}
+
+QByteArray
+ShaderPack::entry(const QString &filename, quint32 type) const
+{
+    if (!data)
+        return QByteArray();
+
+    QHash<QString, Entry>::const_iterator it = index.constFind(entryName(filename));
+    if (it == index.constEnd() || it->type != type)
+        return QByteArray();
+
+    // The mapping lives as long as we do
+    return QByteArray::fromRawData((const char *) data + it->offset, it->size);
+}
+
+QByteArray
+ShaderPack::shaderSource(const QString &filename) const
+{
+    QByteArray source = entry(filename, ShaderEntry);
+    source.chop(1);
+    return source;
+}
+
+QByteArray
+ShaderPack::texture(const QString &filename, TextureFormat format) const
+{
+    const QString name = filename.section('/', 0, -2) + "/" + QFileInfo(filename).completeBaseName();
+    return entry(name + (format == Etc1Texture ? ".etc1.ktx" : ".rgba.ktx"), TextureEntry);
+}
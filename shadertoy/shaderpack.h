@@ -0,0 +1,58 @@
+#ifndef SHADERPACK_H
+#define SHADERPACK_H
+
+#include <QtCore>
+
+/*
+ * Read-only view of a pack built by shadertoypack (see
+ * pack/shadertoypack.cpp for the layout). The file is mapped into memory
+ * once and entries are handed out as QByteArrays pointing straight into
+ * the mapping, so shader sources go to the compiler and textures to
+ * glCompressedTexImage2D without being copied or decoded.
+ *
+ * Entries are looked up by the last two components of their path, so
+ * ":/foo/shaders/julia.f.glsl" finds "shaders/julia.f.glsl". Textures are
+ * stored per format, ":/foo/textures/texl0.jpg" is
+ * "textures/texl0.etc1.ktx" or "textures/texl0.rgba.ktx".
+ *
+ * Safe to use from any thread once open() has returned.
+ */
+class ShaderPack
+{
+public:
+    enum TextureFormat {
+        Etc1Texture,
+        Rgba8Texture
+    };
+
+    ShaderPack();
+
+    bool open(const QString &filename);
+    bool isOpen() const { return data != NULL; }
+
+    // NUL terminated, the terminator is not part of the size
+    QByteArray shaderSource(const QString &filename) const;
+    // KTX container with a full mip chain, see KtxTexture
+    QByteArray texture(const QString &filename, TextureFormat format) const;
+
+private:
+    enum EntryType {
+        ShaderEntry = 1,
+        TextureEntry = 2
+    };
+
+    struct Entry {
+        quint32 type;
+        quint32 offset;
+        quint32 size;
+    };
+
+    static QString entryName(const QString &filename);
+    QByteArray entry(const QString &filename, quint32 type) const;
+
+    QFile file;
+    const uchar *data;
+    QHash<QString, Entry> index;
+};
+
+#endif // SHADERPACK_H
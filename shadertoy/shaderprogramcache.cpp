@@ -0,0 +1,215 @@
+#include "shaderprogramcache.h"
+
+#ifndef GL_PROGRAM_BINARY_LENGTH_OES
+#define GL_PROGRAM_BINARY_LENGTH_OES 0x8741
+#endif
+
+#ifndef GL_NUM_PROGRAM_BINARY_FORMATS_OES
+#define GL_NUM_PROGRAM_BINARY_FORMATS_OES 0x87FE
+#endif
+
+// Bumped whenever the on-disk layout changes
+static const quint32 CACHE_FILE_MAGIC = 0x53544231; // "STB1"
+
+ShaderProgramCache::ShaderProgramCache()
+    : resolved(false)
+    , getProgramBinary(NULL)
+    , programBinary(NULL)
+    , _memoryHits(0)
+    , _diskHits(0)
+    , _misses(0)
+{
+    cacheDir = QStandardPaths::writableLocation(QStandardPaths::CacheLocation) + "/programs";
+}
+
+ShaderProgramCache::~ShaderProgramCache()
+{
+    // Programs are GL objects; clear() has to be called while the
+    // context is still current. Anything left here is simply dropped.
+    if (!programs.isEmpty())
+        qDebug() << "program cache destroyed with" << programs.size() << "live programs";
+}
+
+void
+ShaderProgramCache::resolveBinaryFunctions()
+{
+    resolved = true;
+
+    QOpenGLContext *context = QOpenGLContext::currentContext();
+    if (!context || !context->hasExtension("GL_OES_get_program_binary")) {
+        qDebug() << "GL_OES_get_program_binary not available, disk cache disabled";
+        return;
+    }
+
+    GLint formats = 0;
+    glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS_OES, &formats);
+    if (formats < 1) {
+        qDebug() << "driver exposes no program binary formats, disk cache disabled";
+        return;
+    }
+
+    getProgramBinary = (GetProgramBinaryProc) context->getProcAddress("glGetProgramBinaryOES");
+    programBinary = (ProgramBinaryProc) context->getProcAddress("glProgramBinaryOES");
+
+    // Binaries are only valid for the driver that produced them
+    driverId = QByteArray((const char *) glGetString(GL_VENDOR)) + "|"
+            + QByteArray((const char *) glGetString(GL_RENDERER)) + "|"
+            + QByteArray((const char *) glGetString(GL_VERSION));
+
+    QDir().mkpath(cacheDir);
+}
+
+QString
+ShaderProgramCache::cacheFilename(const QByteArray &key) const
+{
+    return cacheDir + "/" + QString::fromLatin1(key.toHex()) + ".bin";
+}
+
+void
+ShaderProgramCache::report(const char *result, const QByteArray &key) const
+{
+    qDebug() << "program cache" << result << key.toHex().left(8)
+             << "- memory hits:" << _memoryHits
+             << "disk hits:" << _diskHits
+             << "misses:" << _misses;
+}
+
+QOpenGLShaderProgram *
+ShaderProgramCache::program(const QByteArray &vertexSource, const QByteArray &fragmentSource)
+{
+    if (!resolved)
+        resolveBinaryFunctions();
+
+    QCryptographicHash hash(QCryptographicHash::Sha1);
+    hash.addData(driverId);
+    hash.addData(vertexSource);
+    hash.addData("\0", 1);
+    hash.addData(fragmentSource);
+    QByteArray key = hash.result();
+
+    QOpenGLShaderProgram *program = programs.value(key);
+    if (program) {
+        _memoryHits++;
+        report("memory hit", key);
+        return program;
+    }
+
+    program = loadBinary(key);
+    if (program) {
+        _diskHits++;
+        insert(key, program);
+        report("disk hit", key);
+        return program;
+    }
+
+    _misses++;
+
+    QTime elapsed;
+    elapsed.start();
+
+    program = new QOpenGLShaderProgram();
+    program->addShaderFromSourceCode(QOpenGLShader::Vertex, vertexSource);
+    program->addShaderFromSourceCode(QOpenGLShader::Fragment, fragmentSource);
+
+    // Both paths rely on coord2d being at 0 so that cached binaries
+    // keep the same attribute layout as freshly linked programs.
+    program->bindAttributeLocation("coord2d", 0);
+
+    if (!program->link()) {
+        qDebug() << "Program link result:" << program->log();
+        delete program;
+        return NULL;
+    }
+
+    report("miss", key);
+    qDebug() << "compile + link took" << elapsed.elapsed() << "ms";
+
+    saveBinary(key, program);
+    insert(key, program);
+    return program;
+}
+
+QOpenGLShaderProgram *
+ShaderProgramCache::loadBinary(const QByteArray &key)
+{
+    if (!programBinary)
+        return NULL;
+
+    QFile file(cacheFilename(key));
+    if (!file.open(QFile::ReadOnly))
+        return NULL;
+
+    QDataStream in(&file);
+    quint32 magic, format;
+    QByteArray binary;
+    in >> magic >> format >> binary;
+    file.close();
+
+    if (in.status() != QDataStream::Ok || magic != CACHE_FILE_MAGIC || binary.isEmpty()) {
+        file.remove();
+        return NULL;
+    }
+
+    QTime elapsed;
+    elapsed.start();
+
+    QOpenGLShaderProgram *program = new QOpenGLShaderProgram();
+    program->create();
+    programBinary(program->programId(), format, binary.constData(), binary.size());
+
+    // With no shaders attached, link() only checks GL_LINK_STATUS of
+    // the program populated by glProgramBinaryOES.
+    if (!program->link()) {
+        // Driver update or corrupt file; fall back to compiling
+        qDebug() << "rejected cached program binary" << key.toHex().left(8);
+        delete program;
+        file.remove();
+        return NULL;
+    }
+
+    qDebug() << "binary load took" << elapsed.elapsed() << "ms";
+    return program;
+}
+
+void
+ShaderProgramCache::saveBinary(const QByteArray &key, QOpenGLShaderProgram *program)
+{
+    if (!getProgramBinary)
+        return;
+
+    GLint length = 0;
+    glGetProgramiv(program->programId(), GL_PROGRAM_BINARY_LENGTH_OES, &length);
+    if (length <= 0)
+        return;
+
+    QByteArray binary(length, Qt::Uninitialized);
+    GLenum format = 0;
+    getProgramBinary(program->programId(), length, &length, &format, binary.data());
+    binary.resize(length);
+
+    QSaveFile file(cacheFilename(key));
+    if (!file.open(QFile::WriteOnly)) {
+        qDebug() << "could not open program cache file for write";
+        return;
+    }
+
+    QDataStream out(&file);
+    out << CACHE_FILE_MAGIC << (quint32) format << binary;
+    file.commit();
+}
+
+void
+ShaderProgramCache::insert(const QByteArray &key, QOpenGLShaderProgram *program)
+{
+    programs.insert(key, program);
+    reflections.insert(program, new ProgramReflection(program->programId()));
+}
+
+void
+ShaderProgramCache::clear()
+{
+    qDeleteAll(reflections);
+    reflections.clear();
+    qDeleteAll(programs);
+    programs.clear();
+}
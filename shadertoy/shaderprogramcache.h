@@ -0,0 +1,60 @@
+#ifndef SHADERPROGRAMCACHE_H
+#define SHADERPROGRAMCACHE_H
+
+#include <QtGui>
+
+#include "programreflection.h"
+
+/*
+ * Cache of linked shader programs, keyed on a hash of the vertex and
+ * fragment source. Linked programs are kept in memory for the lifetime
+ * of the GL context, and their binaries are written to disk with
+ * GL_OES_get_program_binary so that the next launch can skip the
+ * compile + link step as well.
+ *
+ * Each program also gets a ProgramReflection, built once when it is
+ * linked or loaded.
+ *
+ * Must only be used from one thread, with a GL context current. The
+ * render thread and ShaderLoader each have their own.
+ */
+class ShaderProgramCache
+{
+public:
+    ShaderProgramCache();
+    ~ShaderProgramCache();
+
+    QOpenGLShaderProgram *program(const QByteArray &vertexSource, const QByteArray &fragmentSource);
+    ProgramReflection *reflection(QOpenGLShaderProgram *program) const { return reflections.value(program); }
+    void clear();
+
+    int memoryHits() const { return _memoryHits; }
+    int diskHits() const { return _diskHits; }
+    int misses() const { return _misses; }
+
+private:
+    typedef void (*GetProgramBinaryProc)(GLuint program, GLsizei bufSize, GLsizei *length, GLenum *binaryFormat, GLvoid *binary);
+    typedef void (*ProgramBinaryProc)(GLuint program, GLenum binaryFormat, const GLvoid *binary, GLint length);
+
+    void resolveBinaryFunctions();
+    QString cacheFilename(const QByteArray &key) const;
+    QOpenGLShaderProgram *loadBinary(const QByteArray &key);
+    void saveBinary(const QByteArray &key, QOpenGLShaderProgram *program);
+    void report(const char *result, const QByteArray &key) const;
+    void insert(const QByteArray &key, QOpenGLShaderProgram *program);
+
+    QHash<QByteArray, QOpenGLShaderProgram *> programs;
+    QHash<QOpenGLShaderProgram *, ProgramReflection *> reflections;
+    QString cacheDir;
+    QByteArray driverId;
+
+    bool resolved;
+    GetProgramBinaryProc getProgramBinary;
+    ProgramBinaryProc programBinary;
+
+    int _memoryHits;
+    int _diskHits;
+    int _misses;
+};
+
+#endif // SHADERPROGRAMCACHE_H
@@ -15,7 +15,16 @@ TARGET = shadertoy
 CONFIG += sailfishapp
 
 SOURCES += src/shadertoy.cpp \
-    shadertoyglview.cpp
+    shadertoyglview.cpp \
+    framescheduler.cpp \
+    shaderprogramcache.cpp \
+    programreflection.cpp \
+    resolutionscaler.cpp \
+    shaderloader.cpp \
+    shaderpack.cpp \
+    ktxtexture.cpp \
+    texturecache.cpp \
+    ../common/gputimer.c
 
 OTHER_FILES += qml/shadertoy.qml \
     qml/cover/CoverPage.qml \
@@ -32,8 +41,28 @@ CONFIG += sailfishapp_i18n
 TRANSLATIONS += translations/shadertoy-de.ts
 
 HEADERS += \
-    shadertoyglview.h
+    shadertoyglview.h \
+    framescheduler.h \
+    shaderprogramcache.h \
+    programreflection.h \
+    resolutionscaler.h \
+    shaderloader.h \
+    shaderpack.h \
+    ktxtexture.h \
+    texturecache.h \
+    ../common/gputimer.h
+
+INCLUDEPATH += ../common
+LIBS += -lEGL
 
 RESOURCES += \
     resources.qrc
 
+# Prebuilt shaders and textures from shadertoypack.pro. Without it the
+# app loads everything from resources.qrc as before.
+exists(shaders.pack) {
+    pack.files = shaders.pack
+    pack.path = /usr/share/$${TARGET}
+    INSTALLS += pack
+}
+
@@ -0,0 +1,15 @@
+# Headless benchmark for every shader in shaders/. Plain EGL + GLES2,
+# no Sailfish or Qt dependencies, so it builds and runs on a Linux CI box
+# with Mesa (llvmpipe is fine):
+#
+#   qmake shadertoybench.pro && make && ./shadertoybench > bench.json
+
+TARGET = shadertoybench
+TEMPLATE = app
+
+CONFIG += console
+CONFIG -= qt app_bundle
+
+SOURCES += bench/shadertoybench.cpp
+
+LIBS += -lEGL -lGLESv2 -ljpeg
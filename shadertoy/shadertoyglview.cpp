@@ -1,35 +1,186 @@
 #include "shadertoyglview.h"
 #include "sys/time.h"
 
+// Pinned for every program by ShaderProgramCache
+static const GLuint QUAD_ATTRIBUTE = 0;
+
+// Frame time histogram shown in the overlay and exported to QML
+static const int GPU_HISTOGRAM_BUCKETS = 16;
+static const float GPU_HISTOGRAM_BUCKET_MS = 2.0f;
+// Frames between updates of the QML properties, and between stdout reports
+static const int GPU_STATS_INTERVAL = 30;
+static const int GPU_PRINT_INTERVAL = 300;
+
+// Stretches the dynamic resolution buffer over the window
+static const char upscaleVertexShader[] =
+        "precision highp float;\n"
+        "attribute vec2 coord2d;\n"
+        "varying vec2 uv;\n"
+
+        "void main() {\n"
+        "  uv = coord2d * 0.5 + 0.5;\n"
+        "  gl_Position = vec4(coord2d, 0.0, 1.0);\n"
+        "}\n";
+
+static const char upscaleFragmentShader[] =
+        "precision mediump float;\n"
+        "uniform sampler2D source;\n"
+        "varying vec2 uv;\n"
+
+        "void main() {\n"
+        "  gl_FragColor = texture2D(source, uv);\n"
+        "}\n";
+
 ShaderToyGLView::ShaderToyGLView(QQuickWindow *window)
     : QObject()
     , window(window)
+    , loaderAttached(false)
     , program(0)
+    , reflection(0)
     , time()
+    , vao(0)
+    , fbo(0)
+    , upscaleProgram(0)
+    , _vbo_quad(0)
     , running(false)
+    , lastCallCount(-1)
+    , _dynamicResolution(0)
+    , _renderScale(1000)
+    , lastFrameNs(-1)
+    , gpuTimerReady(false)
+    , gpuTimerFrames(0)
+    , _showGpuOverlay(0)
+    , _gpuFrameMs(0)
 {
     connect(window, SIGNAL(afterRendering()),
             this, SLOT(renderGL()),
             Qt::DirectConnection);
     connect(window, SIGNAL(sceneGraphInitialized()),
                     this, SLOT(cleanup()), Qt::DirectConnection);
+    connect(window, SIGNAL(sceneGraphInvalidated()),
+                    this, SLOT(cleanup()), Qt::DirectConnection);
     mutex = new QMutex;
     time.start();
+
+    loader = new ShaderLoader(window);
+
+    for (int i = 0; i < MAX_CHANNELS; i++)
+        textures[i] = 0;
+
+    scheduler = new FrameScheduler(window, this);
+    connect(scheduler, SIGNAL(statsChanged()), this, SIGNAL(frameStatsChanged()));
+
+    QSettings settings;
+    scheduler->setTargetFps(settings.value("targetFps", 60.f).toReal());
+    scheduler->setSkipStaticFrames(settings.value("skipStaticFrames", true).toBool());
+    _dynamicResolution = settings.value("dynamicResolution", false).toBool() ? 1 : 0;
+    _showGpuOverlay = settings.value("showGpuOverlay", false).toBool() ? 1 : 0;
+    loader->textureCache()->setBudget(settings.value("textureBudget", loader->textureCache()->budget()).toLongLong());
+
+    frameClock.start();
+}
+
+ShaderToyGLView::~ShaderToyGLView()
+{
+    delete loader;
+}
+
+void
+ShaderToyGLView::setTargetFps(qreal fps)
+{
+    if (fps <= 0 || fps == scheduler->targetFps())
+        return;
+
+    scheduler->setTargetFps(fps);
+    QSettings().setValue("targetFps", fps);
+    emit targetFpsChanged();
+}
+
+void
+ShaderToyGLView::setSkipStaticFrames(bool skip)
+{
+    if (skip == scheduler->skipStaticFrames())
+        return;
+
+    scheduler->setSkipStaticFrames(skip);
+    QSettings().setValue("skipStaticFrames", skip);
+    emit skipStaticFramesChanged();
+}
+
+void
+ShaderToyGLView::setDynamicResolution(bool enabled)
+{
+    if (enabled == dynamicResolution())
+        return;
+
+    QMutexLocker locker(mutex);
+    _dynamicResolution = enabled ? 1 : 0;
+    scaler.reset();
+    _renderScale = 1000;
+    lastFrameNs = -1;
+
+    QSettings().setValue("dynamicResolution", enabled);
+    emit dynamicResolutionChanged();
+    emit renderScaleChanged();
+}
+
+void
+ShaderToyGLView::setShowGpuOverlay(bool show)
+{
+    if (show == showGpuOverlay())
+        return;
+
+    _showGpuOverlay = show ? 1 : 0;
+    QSettings().setValue("showGpuOverlay", show);
+    emit showGpuOverlayChanged();
+}
+
+QString
+ShaderToyGLView::gpuTimerMode() const
+{
+    QMutexLocker locker(&gpuStatsMutex);
+    return _gpuTimerMode;
+}
+
+qreal
+ShaderToyGLView::gpuFrameMs() const
+{
+    QMutexLocker locker(&gpuStatsMutex);
+    return _gpuFrameMs;
+}
+
+QVariantList
+ShaderToyGLView::gpuHistogram() const
+{
+    QMutexLocker locker(&gpuStatsMutex);
+    return _gpuHistogram;
 }
 
 void
-ShaderToyGLView::start(QString fragmentShaderFilename, QString vertexShaderFilename, QString textureFilename)
+ShaderToyGLView::start(QString fragmentShaderFilename, QString vertexShaderFilename, QVariantList textureFilenames)
 {
     qDebug() << "start, fragshader=" + fragmentShaderFilename;
 
     this->fragmentShaderFilename = fragmentShaderFilename;
     this->vertexShaderFilename = vertexShaderFilename;
-    this->textureFilename = textureFilename;
+    // One entry per channel; unset roles come through as undefined
+    this->textureFilenames.clear();
+    foreach (const QVariant &filename, textureFilenames)
+        this->textureFilenames.append(filename.toString());
 
-    float fps = 60.f;
-    timerId = startTimer(1000.f / fps);
+    // The current shader, if any, stays on screen until this one is ready
+    loader->load(fragmentShaderFilename, vertexShaderFilename, this->textureFilenames);
+
+    // Every shader starts at full resolution
+    {
+        QMutexLocker locker(mutex);
+        scaler.reset();
+        _renderScale = 1000;
+    }
+    emit renderScaleChanged();
 
     running = true;
+    scheduler->start();
 }
 
 void
@@ -40,13 +191,15 @@ ShaderToyGLView::stop()
     qDebug() << "stopping";
 
     running = false;
-    killTimer(timerId);
-
-    glDeleteProgram(_program);
-    glDeleteBuffers(1,&_vbo_quad);
+    scheduler->stop();
+    loader->cancel();
 
+    // The program itself stays alive in programCache for the next start(),
+    // and the quad is kept until the scene graph goes away. Textures stay
+    // pinned until the next shader replaces them, so that they are released
+    // on the render thread.
     program = NULL;
-    texture = NULL;
+    reflection = NULL;
 
     glUseProgram(0);
 
@@ -60,31 +213,33 @@ void
 ShaderToyGLView::cleanup()
 {
     qDebug() << "cleanup";
-}
 
-QString
-ShaderToyGLView::loadShaderSourceFile(QString filename)
-{
-    QFile file(filename);
+    QMutexLocker locker(mutex);
 
-    if(!file.open(QFile::ReadOnly | QFile::Text)){
-        qDebug() << "could not open file for read";
-        return NULL;
-    }
+    releaseTextures();
+    loader->detach();
+    loader->textureCache()->clear();
+    loaderAttached = false;
 
-    QTextStream in(&file);
-    QString data = in.readAll();
+    programCache.clear();
+    program = NULL;
+    reflection = NULL;
+    upscaleProgram = NULL;
 
-    file.close();
-    return data;
-}
+    delete fbo;
+    fbo = NULL;
 
-void
-ShaderToyGLView::timerEvent(QTimerEvent *event)
-{
-    // Ideally you should stop the timer whenever the window is
-    // minimized / hidden or the screen is turned off.
-    window->update();
+    if (gpuTimerReady) {
+        gpu_timer_fini(&gpuTimer);
+        gpuTimerReady = false;
+    }
+
+    delete vao;
+    vao = NULL;
+    if (_vbo_quad) {
+        glDeleteBuffers(1, &_vbo_quad);
+        _vbo_quad = 0;
+    }
 }
 
 float
@@ -98,120 +253,351 @@ ShaderToyGLView::getDeltaTimeS()
     return deltaTime;
 }
 
+void
+ShaderToyGLView::setupQuad()
+{
+    GLfloat triangle_vertices[] = {
+        -1.0, -1.0,
+        1.0, -1.0,
+        -1.0,  1.0,
+        1.0, -1.0,
+        1.0,  1.0,
+        -1.0,  1.0
+    };
+
+    glGenBuffers(1, &_vbo_quad);
+    glBindBuffer(GL_ARRAY_BUFFER, _vbo_quad);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(triangle_vertices), triangle_vertices, GL_STATIC_DRAW);
+
+    // With GL_OES_vertex_array_object the attribute setup is recorded
+    // once and every frame just binds it. The scene graph changes buffer
+    // and attribute state between our frames, so without it everything
+    // has to be specified again each time.
+    vao = new QOpenGLVertexArrayObject();
+    if (vao->create()) {
+        vao->bind();
+        glVertexAttribPointer(QUAD_ATTRIBUTE, 2, GL_FLOAT, GL_FALSE, 0, 0);
+        glEnableVertexAttribArray(QUAD_ATTRIBUTE);
+        vao->release();
+    } else {
+        delete vao;
+        vao = NULL;
+    }
+
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
 void
 ShaderToyGLView::renderGL()
 {
     QMutexLocker locker(mutex);
 
+    if (!loaderAttached)
+        loaderAttached = loader->attach();
+
     if (!running)
     {
         return;
     }
 
-    if (!program) {
+    if (!_vbo_quad)
+        setupQuad();
 
-        GLfloat triangle_vertices[] = {
-            -1.0, -1.0,
-            1.0, -1.0,
-            -1.0,  1.0,
-            1.0, -1.0,
-            1.0,  1.0,
-            -1.0,  1.0
-        };
+    PreparedShader *next = loader->takeReady();
+    if (next) {
+        // No shared context; finish it here
+        if (!next->program && !next->failed)
+            loader->build(next, &programCache);
+        useShader(next);
+    }
 
-        glGenBuffers(1, &_vbo_quad);
-        glBindBuffer(GL_ARRAY_BUFFER, _vbo_quad);
-        glBufferData(GL_ARRAY_BUFFER, sizeof(triangle_vertices), triangle_vertices, GL_STATIC_DRAW);
+    if (!running || !program)
+        return;
 
-        program = new QOpenGLShaderProgram();
+    if (!gpuTimerReady) {
+        gpu_timer_init(&gpuTimer);
+        shaderPass = gpu_timer_add_pass(&gpuTimer, "shader");
+        upscalePass = gpu_timer_add_pass(&gpuTimer, "upscale");
+        gpuTimerReady = true;
+        qDebug() << "gpu timing:" << gpu_timer_mode_name(&gpuTimer);
+    }
 
-        if (vertexShaderFilename == NULL || vertexShaderFilename.isEmpty())
-        {
-            program->addShaderFromSourceCode(QOpenGLShader::Vertex,
-                                             "precision highp float;\n"
-                                             "attribute vec2 coord2d;\n"
+    gpu_timer_frame_begin(&gpuTimer);
 
-                                             "void main() {\n"
-                                             "  gl_Position = vec4(coord2d, 0.0, 1.0);\n"
-                                             "}\n"
-                                             );
-        }
-        else
-        {
-            program->addShaderFromSourceCode(QOpenGLShader::Vertex, loadShaderSourceFile(vertexShaderFilename));
+    int calls = 0;
+
+    if (dynamicResolution()) {
+        // Static shaders are not redrawn continuously, so their frame
+        // intervals say nothing about the cost
+        const qint64 now = frameClock.nsecsElapsed();
+        const qreal frameMs = (now - lastFrameNs) / 1000000.f;
+        if (lastFrameNs >= 0 && unif_time != -1
+                && scaler.update(frameMs, 1000.f / scheduler->targetFps())) {
+            _renderScale = qRound(scaler.scale() * 1000);
+            emit renderScaleChanged();
         }
+        lastFrameNs = now;
 
-        program->addShaderFromSourceCode(QOpenGLShader::Fragment, loadShaderSourceFile(fragmentShaderFilename));
+        renderScaled(calls);
+    } else {
+        gpu_timer_pass_begin(&gpuTimer, shaderPass);
+        drawShader(window->width(), window->height(), calls);
+    }
 
-        program->link();
-        qDebug() << "Program link result:" << program->log();
+    gpu_timer_frame_end(&gpuTimer);
 
-        _program = program->programId();
-        _attribute_coord2d = glGetAttribLocation(_program, "coord2d");
+    if (showGpuOverlay())
+        drawGpuOverlay();
 
-        // Start timer
-        gettimeofday(&_startTime, NULL);
+    if (++gpuTimerFrames % GPU_STATS_INTERVAL == 0)
+        publishGpuStats();
 
-        if (textureFilename != NULL && !textureFilename.isEmpty())
-        {
-            texture = new QOpenGLTexture(QImage(textureFilename).mirrored());
-            texture->setMinificationFilter(QOpenGLTexture::LinearMipMapLinear);
-            texture->setMagnificationFilter(QOpenGLTexture::Linear);
-        }
+    _glCallsPerFrame = calls;
+    if (calls != lastCallCount) {
+        qDebug() << "GL calls per frame:" << calls;
+        lastCallCount = calls;
     }
+}
 
-    if (program->bind()) {
+/*
+ * Swaps in a shader prepared by the loader. Happens between two frames,
+ * so the old program is drawn right up to this point.
+ */
+void
+ShaderToyGLView::useShader(PreparedShader *shader)
+{
+    if (shader->failed) {
+        loader->discard(shader);
+        running = false;
+        return;
+    }
 
-        float r=(float)rand()/(float)RAND_MAX;
-        float g=(float)rand()/(float)RAND_MAX;
-        float b=(float)rand()/(float)RAND_MAX;
+    // The shader's pins become ours
+    releaseTextures();
+    for (int i = 0; i < MAX_CHANNELS; i++) {
+        textures[i] = shader->channels[i].texture;
+        textureKeys[i] = shader->channels[i].filename;
+        shader->channels[i].texture = 0;
+    }
 
-        // set the clear colour
-        glClearColor(r,g,b,1);
+    program = shader->program;
+    _program = program->programId();
+    reflection = shader->reflection;
 
-        // clear screen
-        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    unif_time = reflection->uniformLocation("time");
+    unif_resolution = reflection->uniformLocation("resolution");
+    for (int i = 0; i < MAX_CHANNELS; i++) {
+        unif_channels[i] = reflection->uniformLocation("tex" + QByteArray::number(i));
+        if (unif_channels[i] == -1)
+            unif_channels[i] = reflection->uniformLocation("iChannel" + QByteArray::number(i));
+    }
 
-        GLint unif_resolution, unif_time, unif_tex0;
+    if (reflection->hasUniform("mouse"))
+        qDebug() << "shader declares mouse, which is not driven yet";
 
-        unif_time = glGetUniformLocation(_program, "time");
-        float deltaTimeS = getDeltaTimeS();
-        glUniform1f(unif_time, deltaTimeS);
+    // Shaders without a time uniform only need to be drawn once
+    scheduler->setAnimated(unif_time != -1);
 
-        unif_resolution = glGetUniformLocation(_program, "resolution");
+    // Start timer
+    gettimeofday(&_startTime, NULL);
 
-        glUniform2f(unif_resolution, window->width(),window->height());
+    lastCallCount = -1;
+    lastFrameNs = -1;
 
-        unif_tex0 = glGetUniformLocation(_program, "tex0");
+    loader->discard(shader);
+}
 
-        if (unif_tex0 != -1)
-        {
-            if (texture != NULL)
-            {
-                glUniform1i(unif_tex0, 0);
-                glActiveTexture(GL_TEXTURE0);
-                texture->bind();
-            }
-        }
+void
+ShaderToyGLView::releaseTextures()
+{
+    for (int i = 0; i < MAX_CHANNELS; i++) {
+        if (textures[i])
+            loader->textureCache()->release(textureKeys[i]);
+        textures[i] = 0;
+        textureKeys[i].clear();
+    }
+}
 
+void
+ShaderToyGLView::drawQuad(int &calls)
+{
+    if (vao) {
+        vao->bind();
+        glDrawArrays(GL_TRIANGLES, 0, 6);
+        vao->release();
+        calls += 3;
+    } else {
         /* Describe our vertices array to OpenGL */
         glBindBuffer(GL_ARRAY_BUFFER, _vbo_quad);
-        glVertexAttribPointer(
-                    _attribute_coord2d, // attribute
-                    2,                 // number of elements per vertex, here (x,y)
-                    GL_FLOAT,          // the type of each element
-                    GL_FALSE,          // take our values as-is
-                    0,                 // no extra data between each position
-                    0                  // offset of first element
-                    );
-        glEnableVertexAttribArray(_attribute_coord2d);
+        glVertexAttribPointer(QUAD_ATTRIBUTE, 2, GL_FLOAT, GL_FALSE, 0, 0);
+        glEnableVertexAttribArray(QUAD_ATTRIBUTE);
 
         /* Push each element in buffer_vertices to the vertex shader */
         glDrawArrays(GL_TRIANGLES, 0, 6);
 
-        glDisableVertexAttribArray(_attribute_coord2d);
+        glDisableVertexAttribArray(QUAD_ATTRIBUTE);
+        calls += 5;
+    }
+}
+
+void
+ShaderToyGLView::drawShader(int width, int height, int &calls)
+{
+    if (!program->bind())
+        return;
+    calls++;
+
+    // clear screen
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    calls++;
+
+    // Uniforms are program state and survive the scene graph, so only
+    // changed values are uploaded. Texture bindings are not, and
+    // have to be redone every frame.
+    calls += reflection->set(unif_time, getDeltaTimeS());
+    calls += reflection->set(unif_resolution, width, height);
+
+    int units = 0;
+    for (int i = 0; i < MAX_CHANNELS; i++) {
+        if (unif_channels[i] == -1 || !textures[i])
+            continue;
+
+        calls += reflection->set(unif_channels[i], (GLint) i);
+        glActiveTexture(GL_TEXTURE0 + i);
+        glBindTexture(GL_TEXTURE_2D, textures[i]);
+        calls += 2;
+        units = i + 1;
+    }
+
+    drawQuad(calls);
+
+    // Leave unit 0 active, as the scene graph expects
+    if (units > 1) {
+        glActiveTexture(GL_TEXTURE0);
+        calls++;
+    }
+
+    program->release();
+    calls++;
+}
+
+void
+ShaderToyGLView::renderScaled(int &calls)
+{
+    const qreal dpr = window->devicePixelRatio();
+    const QSize windowSize(window->width() * dpr, window->height() * dpr);
+    const QSize renderSize(qMax(1, qRound(windowSize.width() * scaler.scale())),
+                           qMax(1, qRound(windowSize.height() * scaler.scale())));
+
+    if (!fbo || fbo->size() != renderSize) {
+        delete fbo;
+        fbo = new QOpenGLFramebufferObject(renderSize);
+        glBindTexture(GL_TEXTURE_2D, fbo->texture());
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glBindTexture(GL_TEXTURE_2D, 0);
+        qDebug() << "render scale" << scaler.scale() << "->" << renderSize;
+    }
+
+    if (!upscaleProgram) {
+        upscaleProgram = programCache.program(upscaleVertexShader, upscaleFragmentShader);
+        if (!upscaleProgram) {
+            gpu_timer_pass_begin(&gpuTimer, shaderPass);
+            drawShader(window->width(), window->height(), calls);
+            return;
+        }
+    }
+
+    // The shader sees the internal size as its resolution, so
+    // gl_FragCoord based math stays correct at any scale.
+    gpu_timer_pass_begin(&gpuTimer, shaderPass);
+    fbo->bind();
+    glViewport(0, 0, renderSize.width(), renderSize.height());
+    calls += 2;
+
+    drawShader(renderSize.width(), renderSize.height(), calls);
+
+    gpu_timer_pass_begin(&gpuTimer, upscalePass);
+    QOpenGLFramebufferObject::bindDefault();
+    glViewport(0, 0, windowSize.width(), windowSize.height());
+    calls += 2;
+
+    upscaleProgram->bind();
+    calls += programCache.reflection(upscaleProgram)->set(
+                programCache.reflection(upscaleProgram)->uniformLocation("source"), 0);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, fbo->texture());
+    calls += 3;
+
+    drawQuad(calls);
+
+    upscaleProgram->release();
+    calls++;
+}
+
+void
+ShaderToyGLView::publishGpuStats()
+{
+    struct gpu_timer_stats stats;
+    int buckets[GPU_HISTOGRAM_BUCKETS];
+
+    gpu_timer_stats(&gpuTimer, GPU_TIMER_FRAME, &stats);
+    gpu_timer_histogram(&gpuTimer, GPU_TIMER_FRAME, buckets, GPU_HISTOGRAM_BUCKETS, GPU_HISTOGRAM_BUCKET_MS);
+
+    {
+        QMutexLocker locker(&gpuStatsMutex);
+        _gpuTimerMode = gpu_timer_mode_name(&gpuTimer);
+        _gpuFrameMs = stats.avg;
+        _gpuHistogram.clear();
+        for (int i = 0; i < GPU_HISTOGRAM_BUCKETS; i++)
+            _gpuHistogram.append(buckets[i]);
+    }
+    emit gpuStatsChanged();
+
+    if (gpuTimerFrames % GPU_PRINT_INTERVAL == 0) {
+        gpu_timer_print(&gpuTimer, stdout);
+        fflush(stdout);
+    }
+}
+
+/*
+ * The shader covers the whole window on top of the QML scene, so the
+ * frame time histogram is drawn here rather than as a QML item: one
+ * scissored clear per bar, bottom left, 0 - 32 ms in 2 ms buckets.
+ */
+void
+ShaderToyGLView::drawGpuOverlay()
+{
+    int buckets[GPU_HISTOGRAM_BUCKETS];
+    int peak = 0;
+
+    gpu_timer_histogram(&gpuTimer, GPU_TIMER_FRAME, buckets, GPU_HISTOGRAM_BUCKETS, GPU_HISTOGRAM_BUCKET_MS);
+    for (int i = 0; i < GPU_HISTOGRAM_BUCKETS; i++)
+        peak = qMax(peak, buckets[i]);
+
+    const int margin = 16, barWidth = 12, maxHeight = 120;
+    const qreal targetMs = 1000.f / scheduler->targetFps();
+
+    glEnable(GL_SCISSOR_TEST);
+
+    glScissor(margin, margin, GPU_HISTOGRAM_BUCKETS * barWidth, maxHeight);
+    glClearColor(0, 0, 0, 0.6f);
+    glClear(GL_COLOR_BUFFER_BIT);
+
+    for (int i = 0; i < GPU_HISTOGRAM_BUCKETS && peak > 0; i++) {
+        int height = buckets[i] * maxHeight / peak;
+        if (height == 0)
+            continue;
+
+        // Green within the frame budget, red beyond it
+        if ((i + 1) * GPU_HISTOGRAM_BUCKET_MS <= targetMs)
+            glClearColor(0.2f, 0.9f, 0.2f, 1);
+        else
+            glClearColor(0.9f, 0.2f, 0.2f, 1);
 
-        program->release();
+        glScissor(margin + i * barWidth, margin, barWidth - 2, height);
+        glClear(GL_COLOR_BUFFER_BIT);
     }
 
+    glDisable(GL_SCISSOR_TEST);
 }
@@ -5,43 +5,127 @@
 #include <QtQuick>
 #include <sailfishapp.h>
 
+#include "gputimer.h"
+#include "framescheduler.h"
+#include "resolutionscaler.h"
+#include "shaderloader.h"
+#include "shaderprogramcache.h"
+
 class ShaderToyGLView : public QObject
 {
     Q_OBJECT
+    Q_PROPERTY(qreal targetFps READ targetFps WRITE setTargetFps NOTIFY targetFpsChanged)
+    Q_PROPERTY(bool skipStaticFrames READ skipStaticFrames WRITE setSkipStaticFrames NOTIFY skipStaticFramesChanged)
+    Q_PROPERTY(int droppedFrames READ droppedFrames NOTIFY frameStatsChanged)
+    Q_PROPERTY(int glCallsPerFrame READ glCallsPerFrame NOTIFY frameStatsChanged)
+    Q_PROPERTY(bool dynamicResolution READ dynamicResolution WRITE setDynamicResolution NOTIFY dynamicResolutionChanged)
+    Q_PROPERTY(qreal renderScale READ renderScale NOTIFY renderScaleChanged)
+    Q_PROPERTY(bool showGpuOverlay READ showGpuOverlay WRITE setShowGpuOverlay NOTIFY showGpuOverlayChanged)
+    Q_PROPERTY(QString gpuTimerMode READ gpuTimerMode NOTIFY gpuStatsChanged)
+    Q_PROPERTY(qreal gpuFrameMs READ gpuFrameMs NOTIFY gpuStatsChanged)
+    Q_PROPERTY(QVariantList gpuHistogram READ gpuHistogram NOTIFY gpuStatsChanged)
 
 public:
     ShaderToyGLView(QQuickWindow *window);
-    void timerEvent(QTimerEvent *event);
-    QString loadShaderSourceFile(QString filename);
+    ~ShaderToyGLView();
+
+    qreal targetFps() const { return scheduler->targetFps(); }
+    void setTargetFps(qreal fps);
+
+    bool skipStaticFrames() const { return scheduler->skipStaticFrames(); }
+    void setSkipStaticFrames(bool skip);
+
+    int droppedFrames() const { return scheduler->droppedFrames(); }
+    int glCallsPerFrame() const { return _glCallsPerFrame.load(); }
+
+    // Renders into a smaller offscreen buffer that follows targetFps
+    bool dynamicResolution() const { return _dynamicResolution.load(); }
+    void setDynamicResolution(bool enabled);
+    qreal renderScale() const { return _renderScale.load() / 1000.f; }
+
+    // GPU frame time from gputimer, refreshed every few frames
+    bool showGpuOverlay() const { return _showGpuOverlay.load(); }
+    void setShowGpuOverlay(bool show);
+    QString gpuTimerMode() const;
+    qreal gpuFrameMs() const;
+    QVariantList gpuHistogram() const;
+
+signals:
+    void targetFpsChanged();
+    void skipStaticFramesChanged();
+    void frameStatsChanged();
+    void dynamicResolutionChanged();
+    void renderScaleChanged();
+    void showGpuOverlayChanged();
+    void gpuStatsChanged();
 
 public slots:
     void renderGL();
-    void start(QString fragmentShaderFilename, QString vertexShaderFilename, QString textureFilename);
+    void start(QString fragmentShaderFilename, QString vertexShaderFilename, QVariantList textureFilenames);
     void stop();
     void cleanup();
 
 private:
     float getDeltaTimeS();
+    void setupQuad();
+    void useShader(PreparedShader *shader);
+    void releaseTextures();
+    void drawQuad(int &calls);
+    void drawShader(int width, int height, int &calls);
+    void renderScaled(int &calls);
+    void publishGpuStats();
+    void drawGpuOverlay();
 
-    int timerId;
+    FrameScheduler *scheduler;
     QMutex *mutex;
 
     QString fragmentShaderFilename;
     QString vertexShaderFilename;
-    QString textureFilename;
+    QStringList textureFilenames;
 
     QQuickWindow *window;
+    ShaderLoader *loader;
+    bool        loaderAttached;
+    ShaderProgramCache programCache;
     QOpenGLShaderProgram *program;
+    ProgramReflection *reflection;
     QTime time;
-    QOpenGLTexture *texture;
+    // Pinned in the loader's TextureCache while this shader uses them
+    GLuint      textures[MAX_CHANNELS];
+    QString     textureKeys[MAX_CHANNELS];
+    QOpenGLVertexArrayObject *vao;
+    QOpenGLFramebufferObject *fbo;
+    QOpenGLShaderProgram *upscaleProgram;
 
     timeval     _startTime;
 
     GLuint      _vbo_quad;
     GLuint      _program;
-    GLint       _attribute_coord2d;
+    GLint       unif_time;
+    GLint       unif_resolution;
+    GLint       unif_channels[MAX_CHANNELS];
 
     bool        running;
+
+    QAtomicInt  _glCallsPerFrame;
+    int         lastCallCount;
+
+    QAtomicInt  _dynamicResolution;
+    QAtomicInt  _renderScale; // permille, written by the render thread
+    ResolutionScaler scaler;
+    QElapsedTimer frameClock;
+    qint64      lastFrameNs;
+
+    struct gpu_timer gpuTimer;
+    bool        gpuTimerReady;
+    int         shaderPass;
+    int         upscalePass;
+    int         gpuTimerFrames;
+    QAtomicInt  _showGpuOverlay;
+    mutable QMutex gpuStatsMutex;
+    QString     _gpuTimerMode;
+    qreal       _gpuFrameMs;
+    QVariantList _gpuHistogram;
 };
 
 #endif // SHADERTOYGL_H
@@ -0,0 +1,20 @@
+# Build-time packer for shaders/ and textures/, see pack/shadertoypack.cpp.
+# Runs on the build host, needs only libjpeg:
+#
+#   qmake shadertoypack.pro && make && ./shadertoypack
+#
+# and leaves shaders.pack next to shadertoy.pro, where the app build
+# picks it up.
+
+TARGET = shadertoypack
+TEMPLATE = app
+
+CONFIG += console
+CONFIG -= qt app_bundle
+
+SOURCES += pack/shadertoypack.cpp \
+    pack/etc1.cpp
+
+HEADERS += pack/etc1.h
+
+LIBS += -ljpeg
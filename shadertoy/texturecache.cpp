@@ -0,0 +1,143 @@
+#include "texturecache.h"
+
+// Room for all the shipped textures as RGBA8 with mips, several times over
+static const qint64 DEFAULT_BUDGET = 8 * 1024 * 1024;
+
+TextureCache::TextureCache()
+    : _budget(DEFAULT_BUDGET)
+    , _residentBytes(0)
+    , hits(0)
+    , misses(0)
+    , evictions(0)
+{
+}
+
+TextureCache::~TextureCache()
+{
+    // Like ShaderProgramCache, clear() has to run while a context is current
+    if (!entries.isEmpty())
+        qDebug() << "texture cache destroyed with" << entries.size() << "resident textures";
+}
+
+qint64
+TextureCache::budget() const
+{
+    QMutexLocker locker(&mutex);
+    return _budget;
+}
+
+void
+TextureCache::setBudget(qint64 bytes)
+{
+    QMutexLocker locker(&mutex);
+    _budget = bytes;
+    evict();
+}
+
+qint64
+TextureCache::residentBytes() const
+{
+    QMutexLocker locker(&mutex);
+    return _residentBytes;
+}
+
+bool
+TextureCache::contains(const QString &key) const
+{
+    QMutexLocker locker(&mutex);
+    return entries.contains(key);
+}
+
+GLuint
+TextureCache::acquire(const QString &key)
+{
+    QMutexLocker locker(&mutex);
+
+    QHash<QString, Entry>::iterator it = entries.find(key);
+    if (it == entries.end()) {
+        misses++;
+        return 0;
+    }
+
+    if (it->pins++ == 0)
+        lru.removeOne(key);
+    hits++;
+    report("hit", key);
+    return it->texture;
+}
+
+GLuint
+TextureCache::insert(const QString &key, GLuint texture, qint64 bytes)
+{
+    QMutexLocker locker(&mutex);
+
+    QHash<QString, Entry>::iterator it = entries.find(key);
+    if (it != entries.end()) {
+        glDeleteTextures(1, &texture);
+        if (it->pins++ == 0)
+            lru.removeOne(key);
+        return it->texture;
+    }
+
+    Entry entry;
+    entry.texture = texture;
+    entry.bytes = bytes;
+    entry.pins = 1;
+    entries.insert(key, entry);
+    _residentBytes += bytes;
+
+    evict();
+    report("upload", key);
+    return texture;
+}
+
+void
+TextureCache::release(const QString &key)
+{
+    QMutexLocker locker(&mutex);
+
+    QHash<QString, Entry>::iterator it = entries.find(key);
+    if (it == entries.end() || it->pins == 0)
+        return;
+
+    if (--it->pins == 0) {
+        lru.append(key);
+        evict();
+    }
+}
+
+void
+TextureCache::evict()
+{
+    while (_residentBytes > _budget && !lru.isEmpty()) {
+        const QString key = lru.takeFirst();
+        Entry entry = entries.take(key);
+
+        glDeleteTextures(1, &entry.texture);
+        _residentBytes -= entry.bytes;
+        evictions++;
+        report("evict", key);
+    }
+}
+
+void
+TextureCache::clear()
+{
+    QMutexLocker locker(&mutex);
+
+    foreach (const Entry &entry, entries)
+        glDeleteTextures(1, &entry.texture);
+
+    entries.clear();
+    lru.clear();
+    _residentBytes = 0;
+}
+
+void
+TextureCache::report(const char *event, const QString &key) const
+{
+    qDebug() << "texture cache" << event << key
+             << "- resident:" << _residentBytes / 1024 << "of" << _budget / 1024 << "KB"
+             << "in" << entries.size() << "textures, hits:" << hits
+             << "misses:" << misses << "evictions:" << evictions;
+}
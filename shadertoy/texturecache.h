@@ -0,0 +1,67 @@
+#ifndef TEXTURECACHE_H
+#define TEXTURECACHE_H
+
+#include <QtGui>
+
+/*
+ * Residency cache for shader input textures, keyed on the source
+ * filename, so a texture shared by several shaders is uploaded once.
+ *
+ * Textures handed out by acquire() or insert() are pinned until the
+ * matching release(). Unpinned textures stay resident for the next shader
+ * that wants them, and are deleted least recently used first whenever the
+ * resident total goes over the budget. Pinned ones are never evicted, so
+ * the budget can be exceeded by what is actually on screen, but not by
+ * anything else.
+ *
+ * Thread safe. Every call that can delete textures (insert, release,
+ * setBudget, clear) needs a context of the share group current.
+ */
+class TextureCache
+{
+public:
+    TextureCache();
+    ~TextureCache();
+
+    qint64 budget() const;
+    void setBudget(qint64 bytes);
+
+    // Pins and returns a resident texture, or 0 when it has to be uploaded
+    GLuint acquire(const QString &key);
+    bool contains(const QString &key) const;
+
+    // Takes ownership of a freshly uploaded texture and pins it. When
+    // another thread got there first, texture is deleted and the resident
+    // one is returned instead.
+    GLuint insert(const QString &key, GLuint texture, qint64 bytes);
+
+    void release(const QString &key);
+
+    // Deletes everything, pinned or not
+    void clear();
+
+    qint64 residentBytes() const;
+
+private:
+    struct Entry {
+        GLuint texture;
+        qint64 bytes;
+        int pins;
+    };
+
+    void evict();
+    void report(const char *event, const QString &key) const;
+
+    mutable QMutex mutex;
+    QHash<QString, Entry> entries;
+    // Unpinned keys, least recently used first
+    QList<QString> lru;
+    qint64 _budget;
+    qint64 _residentBytes;
+
+    int hits;
+    int misses;
+    int evictions;
+};
+
+#endif // TEXTURECACHE_H